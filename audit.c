@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include "malloc_free.h"
+#include "audit.h"
+
+/* Returns 1 if a chunk is on a list linked through next, like an arena's pending list or remote free stack. */
+static int on_list(node_t *list, header_t *chunk)
+{
+    for (node_t *curr = list; curr; curr = curr->next)
+    {
+        if ((header_t *)curr == chunk)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void scan_free_list()
+{
+    printf("\nSCANNING FREE LIST\n");
+
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        for (size_t i = 0; i < NUM_BINS; i++)
+        {
+            node_t *curr = arenas[a].bins[i];
+
+            while (curr)
+            {
+                printf("Free chunk at %" PRId64 " with size %zu in arena %zu bin %zu and next %" PRId64 "\n", (int64_t)((uint64_t)curr - start), chunk_size((header_t *)curr), a, i, curr->next ? (int64_t)((uint64_t)curr->next - start) : 0);
+                curr = curr->next;
+            }
+        }
+    }
+}
+
+void scan_allocated_list()
+{
+
+    printf("\nSCANNING ALLOCATED LIST\n");
+
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        arena_t *arena = &arenas[a];
+        for (size_t i = 0; i < arena->num_regions; i++)
+        {
+            void *ptr = first_chunk(&arena->regions[i]);
+
+            // Stop at the fencepost
+            while (ptr < arena->regions[i].base + arena->regions[i].size - sizeof(header_t))
+            {
+                header_t *chunk = (header_t *)ptr;
+
+                if (chunk->size_flags & CHUNK_IN_USE)
+                {
+#ifdef MF_DEBUG
+                    assert(chunk->magic == MAGIC_NUMBER || chunk->magic == TCACHE_MAGIC || chunk->magic == REMOTE_MAGIC || chunk->magic == PENDING_MAGIC);
+#endif
+
+                    printf("Allocated chunk at %" PRId64 " with size %zu\n", (int64_t)((uint64_t)chunk - start), chunk_size(chunk));
+                }
+
+                ptr += chunk_size(chunk);
+            }
+        }
+    }
+}
+
+void audit()
+{
+    printf("\nAUDITING THE HEAP\n\n");
+
+    // Mapped chunks live outside every region so they only show up as totals
+    if (mmapped_chunks)
+    {
+        printf("MMAPPED CHUNKS: %zu USING %zu BYTES\n", mmapped_chunks, mmapped_bytes);
+    }
+
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        arena_t *arena = &arenas[a];
+
+        if (arena->num_regions || arena->num_small_pages)
+        {
+            printf("ARENA %zu\n", a);
+        }
+
+        for (size_t i = 0; i < arena->num_regions; i++)
+        {
+            void *ptr = first_chunk(&arena->regions[i]);
+            // Nothing comes before the first chunk so it must look like it follows an allocated one
+            int prev_in_use = PREV_IN_USE;
+
+            printf("REGION %zu: ADDRESS %" PRId64 " SIZE %zu\n", i, (int64_t)((uint64_t)arena->regions[i].base - start), arena->regions[i].size);
+
+            // Stop at the fencepost
+            while (ptr < arena->regions[i].base + arena->regions[i].size - sizeof(header_t))
+            {
+                header_t *chunk = (header_t *)ptr;
+                assert((chunk->size_flags & PREV_IN_USE) == prev_in_use);
+
+                // segment must be free
+                if (!(chunk->size_flags & CHUNK_IN_USE))
+                {
+                    // cast the ptr to a free node
+                    node_t *free_chunk = (node_t *)ptr;
+
+                    // Free chunks are always coalesced and carry their size in their footer
+                    assert(prev_in_use);
+                    assert(*chunk_footer(chunk) == chunk_size(chunk));
+
+                    printf("\x1b[34m");
+                    printf("--------------------\n");
+                    printf("FREE BLOCK\n");
+                    printf("ADDRESS: %" PRId64 "\n", (int64_t)((uint64_t)ptr - start));
+                    printf("SIZE: %zu\n", chunk_size(chunk));
+                    printf("NEXT: %" PRId64 "\n", free_chunk->next ? (int64_t)((uint64_t)free_chunk->next - start) : 0);
+                    printf("--------------------\n");
+                    printf("\x1b[1m");
+                    printf("\x1b[0m");
+
+                    prev_in_use = 0;
+                }
+                // segment must be allocated
+                else
+                {
+#ifdef MF_DEBUG
+                    assert(chunk->magic == MAGIC_NUMBER || chunk->magic == TCACHE_MAGIC || chunk->magic == REMOTE_MAGIC || chunk->magic == PENDING_MAGIC);
+#endif
+
+                    printf("\x1b[31m");
+                    printf("--------------------\n");
+                    // Cached, remotely freed and pending chunks are free as far as the program is concerned but still allocated in the heap
+                    if (in_tcache(chunk))
+                    {
+                        printf("CACHED BLOCK\n");
+                    }
+                    else if (on_list(arena->remote_frees, chunk))
+                    {
+                        printf("REMOTE FREED BLOCK\n");
+                    }
+                    else if (on_list(arena->pending, chunk))
+                    {
+                        printf("PENDING BLOCK\n");
+                    }
+#ifdef MF_DEBUG
+                    else if (chunk->size_flags & CHUNK_FREED)
+                    {
+                        printf("QUARANTINED BLOCK\n");
+                    }
+#endif
+                    else if (chunk->size_flags & CHUNK_SAMPLED)
+                    {
+                        printf("SAMPLED BLOCK\n");
+                    }
+                    else
+                    {
+                        printf("ALLOCATED BLOCK\n");
+                    }
+                    printf("ADDRESS: %" PRId64 "\n", (int64_t)((uint64_t)ptr - start));
+                    printf("SIZE: %zu\n", chunk_size(chunk));
+                    printf("--------------------\n");
+                    printf("\x1b[1m");
+                    printf("\x1b[0m");
+
+                    prev_in_use = PREV_IN_USE;
+                }
+
+                ptr += chunk_size(chunk);
+            }
+
+            // Every region must be accounted for exactly and end in its fencepost
+            header_t *fencepost = (header_t *)ptr;
+            assert(ptr == arena->regions[i].base + arena->regions[i].size - sizeof(header_t));
+            assert(chunk_size(fencepost) == 0 && (fencepost->size_flags & CHUNK_IN_USE));
+#ifdef MF_DEBUG
+            assert(fencepost->magic == MAGIC_NUMBER);
+#endif
+            assert((fencepost->size_flags & PREV_IN_USE) == prev_in_use);
+        }
+
+        // Small pages sit outside the regions and hold objects with no headers, so only each page is shown
+        for (size_t used = 0; used < small_zone_used; used += SMALL_PAGE_SIZE)
+        {
+            small_page_t *page = (small_page_t *)(small_zone + used);
+            if (page->arena != a)
+            {
+                continue;
+            }
+            if (page->size)
+            {
+                printf("SMALL PAGE AT %" PRId64 " WITH %zu BYTE OBJECTS, %zu FREE\n", (int64_t)((uint64_t)page - start), page->size, page->num_free);
+            }
+            else
+            {
+                printf("EMPTY SMALL PAGE AT %" PRId64 "\n", (int64_t)((uint64_t)page - start));
+            }
+        }
+    }
+}
+
+/* Prints the non-empty buckets of one or two histograms side by side. */
+static void print_buckets(size_bucket_t *free_chunks, size_bucket_t *allocated_chunks)
+{
+    printf("%-24s %12s %14s", "SIZE RANGE", "FREE CHUNKS", "FREE BYTES");
+    printf(allocated_chunks ? " %12s %14s\n" : "\n", "ALLOCATED", "ALLOCATED BYTES");
+    for (size_t i = 0; i < REPORT_BUCKETS; i++)
+    {
+        if (!free_chunks[i].chunks && !(allocated_chunks && allocated_chunks[i].chunks))
+        {
+            continue;
+        }
+
+        char range[48];
+        snprintf(range, sizeof(range), "[%zu, %zu)", (size_t)1 << i, (size_t)1 << (i + 1));
+        printf("%-24s %12zu %14zu", range, free_chunks[i].chunks, free_chunks[i].bytes);
+        if (allocated_chunks)
+        {
+            printf(" %12zu %14zu", allocated_chunks[i].chunks, allocated_chunks[i].bytes);
+        }
+        printf("\n");
+    }
+}
+
+void print_heap_report()
+{
+    heap_report_t report;
+    my_heap_report(&report);
+
+    printf("\nHEAP FRAGMENTATION REPORT\n\n");
+    print_buckets(report.free_chunks, report.allocated_chunks);
+
+    printf("\nEXTERNAL FRAGMENTATION: %.3f (LARGEST FREE CHUNK %zu OF %zu FREE BYTES)\n", report.external_fragmentation, report.largest_free, report.free_bytes);
+    printf("INTERNAL FRAGMENTATION: %.3f (%" PRIu64 " BYTES ASKED FOR, %" PRIu64 " HANDED OUT)\n", report.internal_fragmentation, report.requested_bytes, report.granted_bytes);
+
+    for (size_t i = 0; i < NUM_SMALL_CLASSES; i++)
+    {
+        if (report.small_pages[i])
+        {
+            printf("SMALL %zu BYTE OBJECTS: %zu OF %zu IN USE ON %zu PAGES\n", (i + 1) * ALIGN_TO, report.small_objects[i], report.small_capacity[i], report.small_pages[i]);
+        }
+    }
+
+    printf("\nOUT OF MEMORY FAILURES: %" PRIu64 "\n", report.failures);
+    for (size_t i = 0; i < report.num_snapshots; i++)
+    {
+        failure_snapshot_t *snapshot = &report.snapshots[i];
+        printf("\nNEEDED %zu BYTES FROM ARENA %zu WITH %zu FREE BYTES IN %zu REGIONS, THE LARGEST CHUNK %zu\n", snapshot->needed_size, snapshot->arena, snapshot->free_bytes, snapshot->regions, snapshot->largest_free);
+        print_buckets(snapshot->free_chunks, NULL);
+    }
+}
+
+#pragma region Incremental_Audit
+
+// How many chunks audit_step checks between looks at the clock
+#define AUDIT_CLOCK_INTERVAL 64
+
+const char *audit_status_string(audit_status_t status)
+{
+    switch (status)
+    {
+    case AUDIT_OK:
+        return "HEAP IS CONSISTENT";
+    case AUDIT_IN_PROGRESS:
+        return "AUDIT IN PROGRESS";
+    case AUDIT_BAD_SIZE:
+        return "CHUNK SIZE IS INVALID";
+    case AUDIT_BAD_ARENA:
+        return "CHUNK BELONGS TO ANOTHER ARENA";
+    case AUDIT_BAD_MAGIC:
+        return "CHUNK HAS A BAD MAGIC NUMBER";
+    case AUDIT_BAD_PREV_IN_USE:
+        return "PREV IN USE BIT DOESN'T MATCH THE CHUNK BEFORE";
+    case AUDIT_BAD_FOOTER:
+        return "FREE CHUNK FOOTER DOESN'T MATCH ITS SIZE";
+    case AUDIT_NOT_COALESCED:
+        return "FREE CHUNK FOLLOWS ANOTHER FREE CHUNK";
+    case AUDIT_BAD_FREE_LIST:
+        return "FREE CHUNK ISN'T LINKED INTO ITS BIN";
+    case AUDIT_BAD_FENCEPOST:
+        return "REGION DOESN'T END IN A FENCEPOST";
+    }
+    return "UNKNOWN AUDIT STATUS";
+}
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Returns 1 if ptr points into one of the arena's regions, so a corrupted link can be told apart before following it. */
+static int in_arena(arena_t *arena, void *ptr)
+{
+    for (size_t i = 0; i < arena->num_regions; i++)
+    {
+        if ((char *)ptr >= (char *)arena->regions[i].base && (char *)ptr < (char *)arena->regions[i].base + arena->regions[i].size)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Checks one chunk or fencepost the same way audit() does, given whether the chunk in front of it is in use. The caller must hold the arena's lock. */
+static audit_status_t check_chunk(arena_t *arena, region_t *region, header_t *chunk, int prev_in_use)
+{
+    char *fencepost = (char *)region->base + region->size - sizeof(header_t);
+    size_t size = chunk_size(chunk);
+
+    if ((char *)chunk == fencepost)
+    {
+        int intact = size == 0 && (chunk->size_flags & CHUNK_IN_USE) && (chunk->size_flags & PREV_IN_USE) == prev_in_use;
+        return intact ? AUDIT_OK : AUDIT_BAD_FENCEPOST;
+    }
+    if (size < MIN_CHUNK_SIZE || size % ALIGN_TO || size > (size_t)(fencepost - (char *)chunk))
+    {
+        return AUDIT_BAD_SIZE;
+    }
+    if (chunk_arena(chunk) != arena)
+    {
+        return AUDIT_BAD_ARENA;
+    }
+    if ((chunk->size_flags & PREV_IN_USE) != prev_in_use)
+    {
+        return AUDIT_BAD_PREV_IN_USE;
+    }
+
+    if (chunk->size_flags & CHUNK_IN_USE)
+    {
+#ifdef MF_DEBUG
+        if (chunk->magic != MAGIC_NUMBER && chunk->magic != TCACHE_MAGIC && chunk->magic != REMOTE_MAGIC && chunk->magic != PENDING_MAGIC)
+        {
+            return AUDIT_BAD_MAGIC;
+        }
+#endif
+        return AUDIT_OK;
+    }
+
+    // Free chunks are always coalesced, carry their size in their footer and sit in the bin for their size
+    if (!prev_in_use)
+    {
+        return AUDIT_NOT_COALESCED;
+    }
+    if (*chunk_footer(chunk) != size)
+    {
+        return AUDIT_BAD_FOOTER;
+    }
+
+    node_t *node = (node_t *)chunk;
+    size_t index = bin_index(size);
+    if (node->next && (!in_arena(arena, node->next) || node->next->prev != node))
+    {
+        return AUDIT_BAD_FREE_LIST;
+    }
+    if (node->prev ? !in_arena(arena, node->prev) || node->prev->next != node : arena->bins[index] != node)
+    {
+        return AUDIT_BAD_FREE_LIST;
+    }
+    if (!((arena->bin_map[index / 64] >> (index % 64)) & 1))
+    {
+        return AUDIT_BAD_FREE_LIST;
+    }
+    return AUDIT_OK;
+}
+
+/* Returns the lowest addressed region of an arena at or after address, or NULL if there is none. The caller must hold the arena's lock. */
+static region_t *region_from(arena_t *arena, char *address)
+{
+    for (size_t i = 0; i < arena->num_regions; i++)
+    {
+        if ((char *)arena->regions[i].base >= address)
+        {
+            return &arena->regions[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Checks the heap a piece at a time, picking up where the cursor left off, so a big heap can be verified without stopping the program for long.
+ * Stops after max_chunks chunks or once max_us microseconds have passed, whichever comes first. 0 means no limit.
+ * Each arena is only locked while its chunks are being checked. Nothing is printed or asserted, the result says what was found.
+ * After a corrupted chunk the cursor moves on to the next region, since the rest of that one can't be walked.
+ */
+audit_result_t audit_step(audit_cursor_t *cursor, size_t max_chunks, uint64_t max_us)
+{
+    audit_result_t result = {AUDIT_IN_PROGRESS, 0, NULL, 0};
+    uint64_t deadline = max_us ? now_us() + max_us : 0;
+
+    while (cursor->arena < num_arenas)
+    {
+        arena_t *arena = &arenas[cursor->arena];
+        pthread_mutex_lock(&arena->lock);
+
+        region_t *region = region_from(arena, cursor->region);
+        if (!region)
+        {
+            pthread_mutex_unlock(&arena->lock);
+            cursor->arena++;
+            cursor->region = NULL;
+            cursor->chunk = NULL;
+            continue;
+        }
+
+        // Start the region over if it is new to the cursor, or merges since the cursor was saved may have swallowed its chunk
+        if (!cursor->chunk || (char *)region->base != cursor->region || arena->layout_changes != cursor->layout_changes)
+        {
+            cursor->region = region->base;
+            cursor->chunk = first_chunk(region);
+            // Nothing comes before the first chunk so it must look like it follows an allocated one
+            cursor->prev_in_use = PREV_IN_USE;
+        }
+        else
+        {
+            // Chunks allocated or freed without merging while the cursor was saved flip PREV_IN_USE without changing the
+            // layout, so across the pause the chunk's own bit is all there is to go on
+            cursor->prev_in_use = cursor->chunk->size_flags & PREV_IN_USE;
+        }
+
+        char *fencepost = (char *)region->base + region->size - sizeof(header_t);
+        while (1)
+        {
+            int out_of_chunks = max_chunks && result.chunks_checked == max_chunks;
+            int out_of_time = deadline && result.chunks_checked % AUDIT_CLOCK_INTERVAL == AUDIT_CLOCK_INTERVAL - 1 && now_us() >= deadline;
+            if (out_of_chunks || out_of_time)
+            {
+                cursor->layout_changes = arena->layout_changes;
+                pthread_mutex_unlock(&arena->lock);
+                return result;
+            }
+
+            header_t *chunk = cursor->chunk;
+            audit_status_t status = check_chunk(arena, region, chunk, cursor->prev_in_use);
+            result.chunks_checked++;
+            if (status != AUDIT_OK || (char *)chunk == fencepost)
+            {
+                // Either way the next call starts on the region after this one
+                cursor->region = (char *)region->base + region->size;
+                cursor->chunk = NULL;
+                if (status != AUDIT_OK)
+                {
+                    pthread_mutex_unlock(&arena->lock);
+                    result.status = status;
+                    result.arena = arena->index;
+                    result.chunk = chunk;
+                    return result;
+                }
+                break;
+            }
+
+            cursor->prev_in_use = (chunk->size_flags & CHUNK_IN_USE) ? PREV_IN_USE : 0;
+            cursor->chunk = next_chunk(chunk);
+        }
+
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    // Every arena has been checked, so the next call starts a new pass
+    *cursor = (audit_cursor_t){.passes = cursor->passes + 1};
+    result.status = AUDIT_OK;
+    return result;
+}
+
+#pragma endregion Incremental_Audit
@@ -0,0 +1,59 @@
+#ifndef _AUDIT_H_
+#define _AUDIT_H_
+
+#include "malloc_free.h"
+
+/* What audit_step found. Everything after AUDIT_IN_PROGRESS means the heap is corrupted. */
+typedef enum __audit_status_t
+{
+    // Finished a whole pass over the heap without finding anything wrong
+    AUDIT_OK,
+    // Ran out of chunks or time for this call. Call again with the same cursor to carry on
+    AUDIT_IN_PROGRESS,
+    // Size is too small, not aligned or runs past the end of its region
+    AUDIT_BAD_SIZE,
+    AUDIT_BAD_ARENA,
+    AUDIT_BAD_MAGIC,
+    // PREV_IN_USE doesn't match the chunk in front
+    AUDIT_BAD_PREV_IN_USE,
+    AUDIT_BAD_FOOTER,
+    // Two free chunks sit next to each other
+    AUDIT_NOT_COALESCED,
+    // A free chunk's links don't lead back to it, or it isn't where its bin says
+    AUDIT_BAD_FREE_LIST,
+    AUDIT_BAD_FENCEPOST
+} audit_status_t;
+
+/* Where audit_step left off. Start from a zeroed one. */
+typedef struct __audit_cursor_t
+{
+    size_t arena;
+    // Base of the region being checked. Regions are found by address because their indexes shift as arenas grow and trim
+    char *region;
+    // Next chunk to check, or NULL to start the region from its first chunk
+    header_t *chunk;
+    // Whether the chunk before the next one is in use. Only carried between chunks within one call
+    int prev_in_use;
+    // The arena's layout_changes when the cursor was saved. If it moved, chunk may be inside a merged chunk, so the region starts over
+    uint64_t layout_changes;
+    // Whole passes over the heap finished
+    uint64_t passes;
+} audit_cursor_t;
+
+typedef struct __audit_result_t
+{
+    audit_status_t status;
+    // Where the corruption is, for anything past AUDIT_IN_PROGRESS
+    size_t arena;
+    header_t *chunk;
+    size_t chunks_checked;
+} audit_result_t;
+
+void scan_free_list();
+void scan_allocated_list();
+void audit();
+void print_heap_report();
+audit_result_t audit_step(audit_cursor_t *cursor, size_t max_chunks, uint64_t max_us);
+const char *audit_status_string(audit_status_t status);
+
+#endif
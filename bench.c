@@ -0,0 +1,645 @@
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "malloc_free.h"
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * Allocation benchmarks. Every workload runs once against each allocator below, each in a forked child so the
+ * heaps and their peak RSS don't get mixed up. my_malloc_thp is my_malloc with huge page backed regions and
+ * my_malloc_lazy is my_malloc merging frees in batches of BENCH_COALESCE_BATCH.
+ * dtlb_misses comes from the CPU's counters where the kernel allows it and is -1 where it doesn't.
+ *
+ * ./bench.exe [--ops N] [--seed S] [--format csv|json] [--policy segregated|worst|best|first|next|good]
+ *
+ * --policy picks where the my_malloc variants place chunks, so their fragmentation can be compared.
+ */
+
+#define BENCH_SLOTS 1024
+#define BENCH_BATCH 1024
+#define BENCH_PRODUCERS 2
+#define BENCH_RING 256
+#define MAX_LANES (2 * BENCH_PRODUCERS)
+#define BENCH_WALK_SIZE 64
+#define BENCH_WALK_PASSES 8
+#define BENCH_COALESCE_BATCH 64
+
+typedef struct allocator_t
+{
+    const char *name;
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    // Run in the child before the workload, if set
+    void (*setup)();
+} allocator_t;
+
+// Each thread records its own latencies so timing an operation never needs a lock
+typedef struct lane_t
+{
+    uint32_t *latencies;
+    size_t count;
+    uint64_t rng;
+} lane_t;
+
+typedef struct bench_t
+{
+    const allocator_t *allocator;
+    size_t ops;
+    lane_t lanes[MAX_LANES];
+    size_t num_lanes;
+    size_t live_bytes;
+    size_t peak_live_bytes;
+} bench_t;
+
+typedef struct workload_t
+{
+    const char *name;
+    size_t threads;
+    void (*run)(bench_t *);
+} workload_t;
+
+// What a child sends back to be printed
+typedef struct result_t
+{
+    double seconds;
+    size_t ops;
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t p999;
+    long peak_rss_kb;
+    size_t peak_live_bytes;
+    int64_t dtlb_misses;
+} result_t;
+
+#pragma region Measuring
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64, so every run with the same seed does the same thing */
+static uint64_t next_random(lane_t *lane)
+{
+    lane->rng ^= lane->rng << 13;
+    lane->rng ^= lane->rng >> 7;
+    lane->rng ^= lane->rng << 17;
+    return lane->rng;
+}
+
+static void record(lane_t *lane, uint64_t begin)
+{
+    uint64_t elapsed = now_ns() - begin;
+    lane->latencies[lane->count++] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+}
+
+static void *timed_malloc(bench_t *bench, lane_t *lane, size_t size)
+{
+    uint64_t begin = now_ns();
+    void *ptr = bench->allocator->malloc(size);
+    record(lane, begin);
+    assert(ptr);
+
+    // Touch it like a program would so it shows up in RSS
+    memset(ptr, 0xab, size);
+
+    size_t live = __atomic_add_fetch(&bench->live_bytes, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&bench->peak_live_bytes, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&bench->peak_live_bytes, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    return ptr;
+}
+
+static void timed_free(bench_t *bench, lane_t *lane, void *ptr, size_t size)
+{
+    uint64_t begin = now_ns();
+    bench->allocator->free(ptr);
+    record(lane, begin);
+    __atomic_sub_fetch(&bench->live_bytes, size, __ATOMIC_RELAXED);
+}
+
+static long peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+/* Starts counting data TLB misses in this process and any threads it starts. Returns -1 if the counter isn't available. */
+static int start_dtlb_counter()
+{
+#ifdef __linux__
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static int64_t stop_dtlb_counter(int fd)
+{
+    int64_t count = -1;
+    if (fd >= 0)
+    {
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+        {
+            count = -1;
+        }
+        close(fd);
+    }
+    return count;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+#pragma endregion Measuring
+
+#pragma region Workloads
+
+/* Sizes spread evenly between 8 and 256 bytes */
+static size_t small_size(lane_t *lane)
+{
+    return 8 + next_random(lane) % 249;
+}
+
+/* Sizes spread evenly over powers of two between 8 bytes and 64 KiB, so most requests are small */
+static size_t mixed_size(lane_t *lane)
+{
+    size_t log = 3 + next_random(lane) % 14;
+    return ((size_t)1 << log) + next_random(lane) % ((size_t)1 << log);
+}
+
+/* Randomly frees or refills slots until the op budget runs out, keeping the heap in a steady state. */
+static void churn_slots(bench_t *bench, size_t (*size_of)(lane_t *))
+{
+    lane_t *lane = &bench->lanes[0];
+    void *slots[BENCH_SLOTS] = {0};
+    size_t sizes[BENCH_SLOTS];
+
+    for (size_t i = 0; i < bench->ops; i++)
+    {
+        size_t slot = next_random(lane) % BENCH_SLOTS;
+        if (slots[slot])
+        {
+            timed_free(bench, lane, slots[slot], sizes[slot]);
+            slots[slot] = NULL;
+        }
+        else
+        {
+            sizes[slot] = size_of(lane);
+            slots[slot] = timed_malloc(bench, lane, sizes[slot]);
+        }
+    }
+    for (size_t slot = 0; slot < BENCH_SLOTS; slot++)
+    {
+        if (slots[slot])
+        {
+            bench->allocator->free(slots[slot]);
+        }
+    }
+}
+
+static void run_uniform_small(bench_t *bench)
+{
+    churn_slots(bench, small_size);
+}
+
+static void run_random_mixed(bench_t *bench)
+{
+    churn_slots(bench, mixed_size);
+}
+
+/* Allocates a batch and frees it newest first, or oldest first. */
+static void run_batches(bench_t *bench, int newest_first)
+{
+    lane_t *lane = &bench->lanes[0];
+    void *ptrs[BENCH_BATCH];
+    size_t sizes[BENCH_BATCH];
+
+    for (size_t done = 0; done + 2 * BENCH_BATCH <= bench->ops; done += 2 * BENCH_BATCH)
+    {
+        for (size_t i = 0; i < BENCH_BATCH; i++)
+        {
+            sizes[i] = small_size(lane);
+            ptrs[i] = timed_malloc(bench, lane, sizes[i]);
+        }
+        for (size_t i = 0; i < BENCH_BATCH; i++)
+        {
+            size_t j = newest_first ? BENCH_BATCH - 1 - i : i;
+            timed_free(bench, lane, ptrs[j], sizes[j]);
+        }
+    }
+}
+
+static void run_lifo(bench_t *bench)
+{
+    run_batches(bench, 1);
+}
+
+static void run_fifo(bench_t *bench)
+{
+    run_batches(bench, 0);
+}
+
+/* Leaves the heap as alternating free and allocated chunks, then asks for sizes the holes can't hold, like test_alternating_sequence. */
+static void run_alternating(bench_t *bench)
+{
+    lane_t *lane = &bench->lanes[0];
+    void *ptrs[BENCH_BATCH];
+    void *bigger[BENCH_BATCH / 2];
+    size_t size = 64;
+    size_t bigger_size = 96;
+
+    for (size_t done = 0; done + 3 * BENCH_BATCH <= bench->ops; done += 3 * BENCH_BATCH)
+    {
+        for (size_t i = 0; i < BENCH_BATCH; i++)
+        {
+            ptrs[i] = timed_malloc(bench, lane, size);
+        }
+        for (size_t i = 0; i < BENCH_BATCH; i += 2)
+        {
+            timed_free(bench, lane, ptrs[i], size);
+        }
+        for (size_t i = 0; i < BENCH_BATCH / 2; i++)
+        {
+            bigger[i] = timed_malloc(bench, lane, bigger_size);
+        }
+        for (size_t i = 1; i < BENCH_BATCH; i += 2)
+        {
+            timed_free(bench, lane, ptrs[i], size);
+        }
+        for (size_t i = 0; i < BENCH_BATCH / 2; i++)
+        {
+            timed_free(bench, lane, bigger[i], bigger_size);
+        }
+    }
+}
+
+// Single producer single consumer queue, so every free happens on a different thread from its malloc
+typedef struct ring_t
+{
+    void *ptrs[BENCH_RING];
+    size_t sizes[BENCH_RING];
+    size_t head;
+    size_t tail;
+} ring_t;
+
+typedef struct pair_t
+{
+    bench_t *bench;
+    ring_t ring;
+    lane_t *producer;
+    lane_t *consumer;
+    size_t count;
+} pair_t;
+
+static void *produce(void *arg)
+{
+    pair_t *pair = arg;
+    for (size_t i = 0; i < pair->count; i++)
+    {
+        size_t size = small_size(pair->producer);
+        void *ptr = timed_malloc(pair->bench, pair->producer, size);
+
+        size_t tail = pair->ring.tail;
+        while (tail - __atomic_load_n(&pair->ring.head, __ATOMIC_ACQUIRE) == BENCH_RING)
+        {
+            sched_yield();
+        }
+        pair->ring.ptrs[tail % BENCH_RING] = ptr;
+        pair->ring.sizes[tail % BENCH_RING] = size;
+        __atomic_store_n(&pair->ring.tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *consume(void *arg)
+{
+    pair_t *pair = arg;
+    for (size_t i = 0; i < pair->count; i++)
+    {
+        size_t head = pair->ring.head;
+        while (__atomic_load_n(&pair->ring.tail, __ATOMIC_ACQUIRE) == head)
+        {
+            sched_yield();
+        }
+        void *ptr = pair->ring.ptrs[head % BENCH_RING];
+        size_t size = pair->ring.sizes[head % BENCH_RING];
+        __atomic_store_n(&pair->ring.head, head + 1, __ATOMIC_RELEASE);
+
+        timed_free(pair->bench, pair->consumer, ptr, size);
+    }
+    return NULL;
+}
+
+static void run_producer_consumer(bench_t *bench)
+{
+    pair_t pairs[BENCH_PRODUCERS];
+    pthread_t threads[2 * BENCH_PRODUCERS];
+
+    for (size_t i = 0; i < BENCH_PRODUCERS; i++)
+    {
+        pairs[i].bench = bench;
+        pairs[i].ring.head = 0;
+        pairs[i].ring.tail = 0;
+        pairs[i].producer = &bench->lanes[2 * i];
+        pairs[i].consumer = &bench->lanes[2 * i + 1];
+        pairs[i].count = bench->ops / (2 * BENCH_PRODUCERS);
+        pthread_create(&threads[2 * i], NULL, produce, &pairs[i]);
+        pthread_create(&threads[2 * i + 1], NULL, consume, &pairs[i]);
+    }
+    for (size_t i = 0; i < 2 * BENCH_PRODUCERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Allocates a lot of small objects, links them up in a random order and chases the links, so nearly every step lands on a different page. */
+static void run_tlb_walk(bench_t *bench)
+{
+    lane_t *lane = &bench->lanes[0];
+    size_t count = bench->ops / 2;
+    if (!count)
+    {
+        return;
+    }
+
+    // The order lives outside the heap being measured
+    void **objects = mmap(NULL, count * sizeof(void *), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    assert(objects != MAP_FAILED);
+    for (size_t i = 0; i < count; i++)
+    {
+        objects[i] = timed_malloc(bench, lane, BENCH_WALK_SIZE);
+    }
+
+    // Shuffle, then make each object point at the next one in the shuffled order
+    for (size_t i = count - 1; i > 0; i--)
+    {
+        size_t j = next_random(lane) % (i + 1);
+        void *swap = objects[i];
+        objects[i] = objects[j];
+        objects[j] = swap;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        *(void **)objects[i] = objects[(i + 1) % count];
+    }
+
+    void *volatile *cursor = objects[0];
+    for (size_t i = 0; i < BENCH_WALK_PASSES * count; i++)
+    {
+        cursor = *cursor;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        timed_free(bench, lane, objects[i], BENCH_WALK_SIZE);
+    }
+    munmap(objects, count * sizeof(void *));
+}
+
+static const workload_t workloads[] = {
+    {"uniform_small", 1, run_uniform_small},
+    {"random_mixed", 1, run_random_mixed},
+    {"lifo", 1, run_lifo},
+    {"fifo", 1, run_fifo},
+    {"alternating", 1, run_alternating},
+    {"producer_consumer", 2 * BENCH_PRODUCERS, run_producer_consumer},
+    {"tlb_walk", 1, run_tlb_walk},
+};
+
+static policy_t bench_policy = POLICY_SEGREGATED_FIT;
+
+static void setup_my_malloc()
+{
+    init_heap();
+    set_policy(bench_policy);
+}
+
+static void setup_my_malloc_thp()
+{
+    huge_pages = HUGE_PAGES_ADVISE;
+    setup_my_malloc();
+}
+
+static void setup_my_malloc_lazy()
+{
+    coalesce_batch = BENCH_COALESCE_BATCH;
+    setup_my_malloc();
+}
+
+static const char *policy_names[] = {"segregated", "worst", "best", "first", "next", "good"};
+
+static const allocator_t allocators[] = {
+    {"my_malloc", my_malloc, my_free, setup_my_malloc},
+    {"my_malloc_thp", my_malloc, my_free, setup_my_malloc_thp},
+    {"my_malloc_lazy", my_malloc, my_free, setup_my_malloc_lazy},
+    {"glibc", malloc, free, NULL},
+};
+
+#pragma endregion Workloads
+
+#pragma region Running
+
+/* Runs one workload against one allocator. Called in a fresh child process. */
+static result_t run_workload(const workload_t *workload, const allocator_t *allocator, size_t ops, uint64_t seed)
+{
+    bench_t bench = {0};
+    bench.allocator = allocator;
+    bench.ops = ops;
+    bench.num_lanes = workload->threads;
+
+    // Latencies live outside both heaps and are touched up front so they don't count towards the workload's RSS
+    size_t per_lane = ops + 1;
+    uint32_t *latencies = mmap(NULL, MAX_LANES * per_lane * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    assert(latencies != MAP_FAILED);
+    memset(latencies, 0, MAX_LANES * per_lane * sizeof(uint32_t));
+    for (size_t i = 0; i < bench.num_lanes; i++)
+    {
+        bench.lanes[i].latencies = latencies + i * per_lane;
+        bench.lanes[i].rng = seed + 0x9e3779b97f4a7c15ull * (i + 1);
+    }
+
+    if (allocator->setup)
+    {
+        allocator->setup();
+    }
+    long baseline_rss = peak_rss_kb();
+
+    int dtlb = start_dtlb_counter();
+    uint64_t begin = now_ns();
+    workload->run(&bench);
+    uint64_t end = now_ns();
+
+    result_t result = {0};
+    result.dtlb_misses = stop_dtlb_counter(dtlb);
+    result.seconds = (end - begin) / 1e9;
+    result.peak_rss_kb = peak_rss_kb() - baseline_rss;
+    result.peak_live_bytes = bench.peak_live_bytes;
+
+    // Gather every lane's latencies together to take percentiles
+    size_t total = 0;
+    for (size_t i = 0; i < bench.num_lanes; i++)
+    {
+        memmove(latencies + total, bench.lanes[i].latencies, bench.lanes[i].count * sizeof(uint32_t));
+        total += bench.lanes[i].count;
+    }
+    result.ops = total;
+    if (total)
+    {
+        qsort(latencies, total, sizeof(uint32_t), compare_latencies);
+        result.p50 = latencies[(total - 1) * 50 / 100];
+        result.p99 = latencies[(total - 1) * 99 / 100];
+        result.p999 = latencies[(total - 1) * 999 / 1000];
+    }
+    return result;
+}
+
+/* Share of the memory the workload added to RSS that wasn't holding live data at the peak */
+static double fragmentation(const result_t *result)
+{
+    double used = (double)result->peak_rss_kb * 1024;
+    if (used <= 0 || result->peak_live_bytes >= used)
+    {
+        return 0;
+    }
+    return 1 - result->peak_live_bytes / used;
+}
+
+static void print_result(const char *format, int first, const workload_t *workload, const allocator_t *allocator, const result_t *result)
+{
+    double ops_per_sec = result->seconds > 0 ? result->ops / result->seconds : 0;
+    if (!strcmp(format, "json"))
+    {
+        printf("%s  {\"workload\": \"%s\", \"allocator\": \"%s\", \"threads\": %zu, \"ops\": %zu, \"seconds\": %.6f, "
+               "\"ops_per_sec\": %.0f, \"p50_ns\": %" PRIu32 ", \"p99_ns\": %" PRIu32 ", \"p999_ns\": %" PRIu32 ", "
+               "\"peak_rss_kb\": %ld, \"peak_live_kb\": %zu, \"fragmentation\": %.4f, \"dtlb_misses\": %" PRId64 "}",
+               first ? "" : ",\n", workload->name, allocator->name, workload->threads, result->ops, result->seconds,
+               ops_per_sec, result->p50, result->p99, result->p999, result->peak_rss_kb, result->peak_live_bytes / 1024,
+               fragmentation(result), result->dtlb_misses);
+    }
+    else
+    {
+        printf("%s,%s,%zu,%zu,%.6f,%.0f,%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%ld,%zu,%.4f,%" PRId64 "\n", workload->name,
+               allocator->name, workload->threads, result->ops, result->seconds, ops_per_sec, result->p50, result->p99,
+               result->p999, result->peak_rss_kb, result->peak_live_bytes / 1024, fragmentation(result), result->dtlb_misses);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    size_t ops = 1000000;
+    uint64_t seed = 42;
+    const char *format = "csv";
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "--ops"))
+        {
+            ops = strtoull(argv[i + 1], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--seed"))
+        {
+            seed = strtoull(argv[i + 1], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--format"))
+        {
+            format = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "--policy"))
+        {
+            size_t p = 0;
+            while (p < sizeof(policy_names) / sizeof(policy_names[0]) && strcmp(argv[i + 1], policy_names[p]))
+            {
+                p++;
+            }
+            if (p == sizeof(policy_names) / sizeof(policy_names[0]))
+            {
+                fprintf(stderr, "unknown policy %s\n", argv[i + 1]);
+                return 1;
+            }
+            bench_policy = (policy_t)p;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--ops N] [--seed S] [--format csv|json] [--policy segregated|worst|best|first|next|good]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!strcmp(format, "json"))
+    {
+        printf("[\n");
+    }
+    else
+    {
+        printf("workload,allocator,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_rss_kb,peak_live_kb,fragmentation,dtlb_misses\n");
+    }
+    fflush(stdout);
+
+    int first = 1;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++)
+        {
+            int fds[2];
+            assert(pipe(fds) == 0);
+
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                close(fds[0]);
+                result_t result = run_workload(&workloads[w], &allocators[a], ops, seed);
+                ssize_t written = write(fds[1], &result, sizeof(result));
+                _exit(written == sizeof(result) ? 0 : 1);
+            }
+            close(fds[1]);
+
+            result_t result;
+            ssize_t got = read(fds[0], &result, sizeof(result));
+            close(fds[0]);
+            int status;
+            waitpid(pid, &status, 0);
+            if (got != sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status))
+            {
+                fprintf(stderr, "%s against %s failed\n", workloads[w].name, allocators[a].name);
+                return 1;
+            }
+
+            print_result(format, first, &workloads[w], &allocators[a], &result);
+            first = 0;
+        }
+    }
+
+    if (!strcmp(format, "json"))
+    {
+        printf("\n]\n");
+    }
+    return 0;
+}
+
+#pragma endregion Running
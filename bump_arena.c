@@ -0,0 +1,101 @@
+#include "bump_arena.h"
+
+/* Makes an empty arena that takes block_size byte blocks from the heap, or BUMP_BLOCK_SIZE if block_size is 0. */
+bump_arena_t *bump_arena_create(size_t block_size)
+{
+    bump_arena_t *arena = my_malloc(sizeof(bump_arena_t));
+    if (!arena)
+    {
+        return NULL;
+    }
+
+    arena->current = NULL;
+    arena->next = NULL;
+    arena->block_size = block_size ? block_size : BUMP_BLOCK_SIZE;
+    return arena;
+}
+
+/* Starts a new block big enough for needed bytes. The rest of the current block is left unused. */
+static int add_block(bump_arena_t *arena, size_t needed)
+{
+    size_t size = sizeof(bump_block_t) + needed;
+    if (size < arena->block_size)
+    {
+        size = arena->block_size;
+    }
+
+    bump_block_t *block = my_malloc(size);
+    if (!block)
+    {
+        return 0;
+    }
+
+    block->prev = arena->current;
+    block->end = (char *)block + size;
+    arena->current = block;
+    arena->next = (char *)(block + 1);
+    return 1;
+}
+
+/* Returns size bytes aligned like my_malloc's, usually by just moving a pointer. They can't be freed on their own. */
+void *bump_arena_alloc(bump_arena_t *arena, size_t size)
+{
+    if (size == 0 || size > MAX_REQUEST_SIZE)
+    {
+        errno = size ? ENOMEM : EINVAL;
+        return NULL;
+    }
+
+    size_t needed = (size + ALIGN_TO - 1) & ~(ALIGN_TO - 1);
+    if (!arena->current || (size_t)(arena->current->end - arena->next) < needed)
+    {
+        if (!add_block(arena, needed))
+        {
+            return NULL;
+        }
+    }
+
+    void *ptr = arena->next;
+    arena->next += needed;
+    return ptr;
+}
+
+bump_mark_t bump_arena_save(bump_arena_t *arena)
+{
+    bump_mark_t mark = {arena->current, arena->next};
+    return mark;
+}
+
+/* Throws away everything allocated since mark was saved. Marks saved after it can't be restored afterwards. */
+void bump_arena_restore(bump_arena_t *arena, bump_mark_t mark)
+{
+    while (arena->current != mark.block)
+    {
+        // The mark has to come from this arena and not have been rolled back past already
+        assert(arena->current);
+
+        bump_block_t *prev = arena->current->prev;
+        my_free(arena->current);
+        arena->current = prev;
+    }
+    arena->next = mark.next;
+}
+
+/* Throws away everything, keeping the first block to start over in. */
+void bump_arena_reset(bump_arena_t *arena)
+{
+    while (arena->current && arena->current->prev)
+    {
+        bump_block_t *prev = arena->current->prev;
+        my_free(arena->current);
+        arena->current = prev;
+    }
+    arena->next = arena->current ? (char *)(arena->current + 1) : NULL;
+}
+
+void bump_arena_destroy(bump_arena_t *arena)
+{
+    bump_mark_t empty = {NULL, NULL};
+    bump_arena_restore(arena, empty);
+    my_free(arena);
+}
@@ -0,0 +1,41 @@
+#ifndef _BUMP_ARENA_H_
+#define _BUMP_ARENA_H_
+
+#include "malloc_free.h"
+
+// Blocks are taken from the heap this big unless a single allocation needs more
+#define BUMP_BLOCK_SIZE 65536
+
+/* A block of memory handed out front to back. Blocks link back to the one before them. */
+typedef struct __bump_block_t
+{
+    struct __bump_block_t *prev;
+    char *end;
+} bump_block_t;
+
+/*
+ * Allocations that are thrown away together, by a reset, a destroy or restoring a mark. Not to be confused with the heap's
+ * arena_t. A bump arena isn't locked, so each one should belong to one thread at a time.
+ */
+typedef struct __bump_arena_t
+{
+    bump_block_t *current;
+    char *next;
+    size_t block_size;
+} bump_arena_t;
+
+/* Where an arena was up to, for rolling back everything allocated since */
+typedef struct __bump_mark_t
+{
+    bump_block_t *block;
+    char *next;
+} bump_mark_t;
+
+bump_arena_t *bump_arena_create(size_t block_size);
+void *bump_arena_alloc(bump_arena_t *arena, size_t size);
+void bump_arena_reset(bump_arena_t *arena);
+void bump_arena_destroy(bump_arena_t *arena);
+bump_mark_t bump_arena_save(bump_arena_t *arena);
+void bump_arena_restore(bump_arena_t *arena, bump_mark_t mark);
+
+#endif
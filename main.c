@@ -3,111 +3,21 @@
 #include <string.h>
 #include <inttypes.h>
 #include "malloc_free.h"
+#include "audit.h"
 #include "tests.h"
 
-void scan_free_list()
-{
-    printf("\nSCANNING FREE LIST\n");
-
-    node_t *curr = start_of_free_list;
-
-    while (curr)
-    {
-        printf("Free chunk at %llu with size %llu and next %llu\n", (uint64_t)curr - start, (uint64_t)curr->size, curr->next ? (uint64_t)curr->next - start : 0);
-        curr = curr->next;
-    }
-}
-
-void scan_allocated_list()
-{
-
-    printf("\nSCANNING ALLOCATED LIST\n");
-
-    void *ptr = start_of_heap;
-    node_t *free_block = start_of_free_list;
-
-    while (ptr < start_of_heap + SIZE_OF_HEAP)
-    {
-        if (ptr == free_block)
-        {
-            node_t *free_chunk = (node_t *)ptr;
-
-            free_block = free_block->next;
-
-            ptr += (free_chunk->size + sizeof(node_t));
-        }
-        else
-        {
-            header_t *chunk = (header_t *)ptr;
-
-            assert(chunk->magic == MAGIC_NUMBER);
-
-            printf("Allocated chunk at %llu with size %zu and magic %d\n", (uint64_t)chunk - start, chunk->size, chunk->magic);
-
-            ptr += (chunk->size + sizeof(header_t));
-        }
-    }
-}
-
-void audit()
-{
-    printf("\nAUDITING THE HEAP\n\n");
-
-    void *ptr = start_of_heap;
-    node_t *free_block = start_of_free_list;
-
-    while (ptr < start_of_heap + SIZE_OF_HEAP)
-    {
-        // if ptr matches free block then
-        // segment must be free
-        if (ptr == free_block)
-        {
-            // cast the ptr to a free node
-            node_t *free_chunk = (node_t *)ptr;
-
-            printf("\x1b[34m");
-            printf("--------------------\n");
-            printf("FREE BLOCK\n");
-            printf("ADDRESS: %llu\n", (uint64_t)ptr - start);
-            printf("SIZE: %ld\n", free_chunk->size);
-            printf("NEXT: %llu\n", free_chunk->next ? (uint64_t)free_chunk->next - start : 0);
-            printf("--------------------\n");
-            printf("\x1b[1m");
-            printf("\x1b[0m");
-            // printf("Size of offset: %llu\n", start);
-
-            free_block = free_block->next;
-            ptr += (free_chunk->size + sizeof(node_t));
-        }
-        // segment must be allocated
-        else
-        {
-            header_t *chunk = (header_t *)ptr;
-            assert(chunk->magic == MAGIC_NUMBER);
-
-            printf("\x1b[31m");
-            printf("--------------------\n");
-            printf("ALLOCATED BLOCK\n");
-            printf("ADDRESS: %llu\n", (uint64_t)ptr - start);
-            printf("SIZE: %ld\n", chunk->size);
-            printf("--------------------\n");
-            printf("\x1b[1m");
-            printf("\x1b[0m");
-            ptr += (chunk->size + sizeof(header_t));
-        }
-    }
-
-    assert((uint64_t)ptr - start == SIZE_OF_HEAP);
-}
-
 void display_commands()
 {
     printf("\nCommands:\n");
     printf("\nmalloc - allocate n number of bytes");
     printf("\nfree - free allocated block at address");
     printf("\naudit- account for all memory on the heap");
+    printf("\ncheck - verify the heap n chunks at a time without printing it");
     printf("\nscan_free - show all free spaces on heap");
     printf("\nscan_alloc - show all allocated blocks on heap");
+    printf("\nstats - show heap totals as JSON");
+    printf("\nreport - show free and allocated chunk sizes, fragmentation and out of memory failures");
+    printf("\nprofile - sample allocations with their call stacks, or print what was sampled as folded stacks");
     printf("\ntests - display a list of tests to run");
     printf("\nhelp - display a list of commands");
     printf("\nexit - End shell session");
@@ -120,12 +30,37 @@ void show_tests()
     printf("Please note: running a test will clear the heap\n\n");
     printf("all - run all tests in below order\n");
     printf("reuse - run free chunk reuse tests\n");
-    printf("sorted - run sorted free list tests\n");
+    printf("tags - run boundary tag tests\n");
     printf("splitting - run splitting free chunks tests\n");
     printf("coalescing - run coalescing tests\n");
+    printf("deferred - run deferred coalescing tests\n");
     printf("alternating - run alternating sequence tests\n");
     printf("fit - run worst fit tests\n");
-    printf("return - run malloc bad value tests\n\n");
+    printf("best - run best fit tests\n");
+    printf("first - run first fit tests\n");
+    printf("next - run next fit tests\n");
+    printf("good - run good fit tests\n");
+    printf("segregated - run segregated fit tests\n");
+    printf("tree - run free tree tests\n");
+    printf("return - run malloc bad value tests\n");
+    printf("growth - run heap growth tests\n");
+    printf("realloc - run realloc tests\n");
+    printf("calloc - run calloc tests\n");
+    printf("aligned - run aligned allocation tests\n");
+    printf("trace - run allocation tracing tests\n");
+    printf("slab - run slab cache tests\n");
+    printf("bump - run bump arena tests\n");
+    printf("mmap - run large chunk mapping tests\n");
+    printf("trim - run returning memory to the OS tests\n");
+    printf("huge - run huge page region tests\n");
+    printf("stats - run heap statistics tests\n");
+    printf("small - run small object tests\n");
+    printf("hardening - run debug hardening tests\n");
+    printf("incremental - run incremental audit tests\n");
+    printf("report - run fragmentation report tests\n");
+    printf("profiler - run allocation profiler tests\n");
+    printf("arenas - run arena tests\n");
+    printf("threads - run multi-threaded stress tests\n\n");
 }
 
 /* Run the selected test. */
@@ -139,9 +74,9 @@ void select_test(char *which)
     {
         test_free_chunk_reuse();
     }
-    else if (!strcmp(which, "sorted"))
+    else if (!strcmp(which, "tags"))
     {
-        test_sorted_free_list();
+        test_boundary_tags();
     }
     else if (!strcmp(which, "splitting"))
     {
@@ -151,6 +86,10 @@ void select_test(char *which)
     {
         test_coalesce();
     }
+    else if (!strcmp(which, "deferred"))
+    {
+        test_deferred_coalescing();
+    }
     else if (!strcmp(which, "alternating"))
     {
         test_alternating_sequence();
@@ -159,10 +98,106 @@ void select_test(char *which)
     {
         test_worst_fit();
     }
+    else if (!strcmp(which, "best"))
+    {
+        test_best_fit();
+    }
+    else if (!strcmp(which, "first"))
+    {
+        test_first_fit();
+    }
+    else if (!strcmp(which, "next"))
+    {
+        test_next_fit();
+    }
+    else if (!strcmp(which, "good"))
+    {
+        test_good_fit();
+    }
+    else if (!strcmp(which, "segregated"))
+    {
+        test_segregated_fit();
+    }
+    else if (!strcmp(which, "tree"))
+    {
+        test_free_tree();
+    }
     else if (!strcmp(which, "return"))
     {
         test_malloc_bad_size();
     }
+    else if (!strcmp(which, "growth"))
+    {
+        test_heap_growth();
+    }
+    else if (!strcmp(which, "realloc"))
+    {
+        test_realloc();
+    }
+    else if (!strcmp(which, "calloc"))
+    {
+        test_calloc();
+    }
+    else if (!strcmp(which, "aligned"))
+    {
+        test_aligned_alloc();
+    }
+    else if (!strcmp(which, "trace"))
+    {
+        test_trace();
+    }
+    else if (!strcmp(which, "slab"))
+    {
+        test_slab();
+    }
+    else if (!strcmp(which, "bump"))
+    {
+        test_bump_arena();
+    }
+    else if (!strcmp(which, "mmap"))
+    {
+        test_mmap();
+    }
+    else if (!strcmp(which, "trim"))
+    {
+        test_trim();
+    }
+    else if (!strcmp(which, "huge"))
+    {
+        test_huge_pages();
+    }
+    else if (!strcmp(which, "stats"))
+    {
+        test_mallinfo();
+    }
+    else if (!strcmp(which, "small"))
+    {
+        test_small_objects();
+    }
+    else if (!strcmp(which, "hardening"))
+    {
+        test_hardening();
+    }
+    else if (!strcmp(which, "incremental"))
+    {
+        test_incremental_audit();
+    }
+    else if (!strcmp(which, "report"))
+    {
+        test_heap_report();
+    }
+    else if (!strcmp(which, "profiler"))
+    {
+        test_profiler();
+    }
+    else if (!strcmp(which, "arenas"))
+    {
+        test_arenas();
+    }
+    else if (!strcmp(which, "threads"))
+    {
+        test_threads();
+    }
     else
     {
         printf("Unrecognized test selection. Type 'tests' to see the list of available tests\n");
@@ -184,6 +219,28 @@ void begin_shell()
             audit();
         }
 
+        else if (!strcmp(comm, "check"))
+        {
+            int max_chunks;
+            printf("\nchunks to check per step: ");
+            scanf("%d", &max_chunks);
+
+            audit_cursor_t cursor = {0};
+            audit_result_t result;
+            size_t steps = 0;
+            do
+            {
+                result = audit_step(&cursor, max_chunks > 0 ? max_chunks : 0, 0);
+                steps++;
+            } while (result.status == AUDIT_IN_PROGRESS);
+
+            printf("%s after %zu steps\n", audit_status_string(result.status), steps);
+            if (result.status != AUDIT_OK)
+            {
+                printf("at chunk %" PRId64 " in arena %zu\n", (int64_t)((uint64_t)result.chunk - start), result.arena);
+            }
+        }
+
         else if (!strcmp(comm, "scan_free"))
         {
             scan_free_list();
@@ -194,6 +251,35 @@ void begin_shell()
             scan_allocated_list();
         }
 
+        else if (!strcmp(comm, "stats"))
+        {
+            char json[1024];
+            my_mallinfo_json(json, sizeof(json));
+            printf("%s\n", json);
+        }
+
+        else if (!strcmp(comm, "report"))
+        {
+            print_heap_report();
+        }
+
+        else if (!strcmp(comm, "profile"))
+        {
+            int interval;
+            printf("\nmean bytes between samples, or 0 to print the profile and stop: ");
+            scanf("%d", &interval);
+            if (interval > 0)
+            {
+                profile_start(interval);
+            }
+            else
+            {
+                fflush(stdout);
+                profile_write(STDOUT_FILENO, PROFILE_FOLDED);
+                profile_stop();
+            }
+        }
+
         else if (!strcmp(comm, "malloc"))
         {
             int size;
@@ -209,7 +295,7 @@ void begin_shell()
             scanf("%d", &address);
 
             header_t *addr = (header_t *)(address + start);
-            if (addr->magic == MAGIC_NUMBER)
+            if ((addr->size_flags & CHUNK_IN_USE) && chunk_size(addr))
             {
                 my_free(addr + 1);
             }
@@ -238,10 +324,30 @@ void begin_shell()
     printf("\nSession Terminated\n");
 }
 
+/* The allocator never prints anything itself, so the shell reports failures through the log hook. */
+void print_heap_error(heap_error_t error, size_t size)
+{
+    printf("%s (requested %zu bytes)\n", heap_error_string(error), size);
+    if (error == HEAP_SIZE_TOO_LARGE)
+    {
+        printf("Did you try to allocate a negative size?\n");
+    }
+}
+
 int main(int argc, char const *argv[])
 {
+    set_heap_log_hook(print_heap_error);
     init_heap();
+    printf("Heap initialized at address: %" PRIu64 " with size: %zu and %zu arenas\n", (uint64_t)start_of_heap - start, SIZE_OF_HEAP, num_arenas);
     init_tests();
+
+    // `make test` runs everything without the interactive shell
+    if (argc > 1 && !strcmp(argv[1], "test"))
+    {
+        test_all();
+        return 0;
+    }
+
     begin_shell();
     return 0;
 }
\ No newline at end of file
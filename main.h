@@ -2,9 +2,6 @@
 #define _MAIN_H_
 
 #include <string.h>
-
-void scan_free_list();
-void walk_allocated_chunks();
-void audit();
+#include "audit.h"
 
 #endif
\ No newline at end of file
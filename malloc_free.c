@@ -1,184 +1,3516 @@
+// For mremap and dladdr
+#define _GNU_SOURCE
 #include "malloc_free.h"
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <math.h>
 
 const size_t SIZE_OF_HEAP = 4096;
+// Only stored in chunk headers by MF_DEBUG builds
 const int MAGIC_NUMBER = 123456789;
-const size_t ALIGN_TO = 8;
+// Replaces MAGIC_NUMBER while a chunk sits in a thread cache so freeing it twice is caught
+const int TCACHE_MAGIC = 987654321;
+// Replaces MAGIC_NUMBER while a chunk waits on its arena's remote free stack
+const int REMOTE_MAGIC = 192837465;
+// Replaces MAGIC_NUMBER while a freed chunk waits on its arena's pending list to be merged
+const int PENDING_MAGIC = 564738291;
+// Anything bigger than this is almost certainly a negative size that overflowed
+const size_t MAX_REQUEST_SIZE = (size_t)1 << 40;
+// A chunk has to be able to hold a node_t and its footer once it is freed
+const size_t MIN_CHUNK_SIZE = sizeof(node_t) + sizeof(size_t);
+// Smaller chunks have no room for the free tree links, so they are only ever found through their bin
+const size_t TREE_MIN_CHUNK_SIZE = sizeof(tree_node_t) + sizeof(size_t);
+
+void *start_of_heap;
+uint64_t start;
+
+arena_t arenas[MAX_ARENAS];
+size_t num_arenas;
+policy_t policy = POLICY_SEGREGATED_FIT;
+
+// Threads are handed arenas round robin the first time they allocate
+static size_t next_arena;
+static __thread arena_t *thread_arena;
+
+// Allocation failures are reported here instead of being printed
+static __thread heap_error_t last_error;
+static heap_log_hook_t log_hook;
+
+size_t tcache_limit = TCACHE_MAX_COUNT;
+size_t good_fit_probes = GOOD_FIT_PROBES;
+// Frees an arena holds back before merging them in one pass. 0 merges every free straight away
+size_t coalesce_batch = 0;
+
+// Chunks this big get a mapping of their own. Freeing one raises it to that size unless it is turned off
+size_t mmap_threshold = MMAP_THRESHOLD_DEFAULT;
+int mmap_threshold_dynamic = 1;
+size_t mmapped_chunks;
+size_t mmapped_bytes;
+
+huge_pages_t huge_pages = HUGE_PAGES_OFF;
+
+size_t small_object_limit = SMALL_OBJECT_LIMIT;
+// Small pages are carved off the front of one reservation, so a pointer is a small object exactly when it falls inside it
+char *small_zone;
+size_t small_zone_used;
+
+// my_trim uses MADV_FREE where there is one, so the kernel only takes the pages back when it needs them
+int trim_lazily = 0;
+// Counts the background trimmer's wake ups
+static uint64_t trim_tick;
+static __thread tcache_t tcache;
+// Chunks this thread allocated and freed since it last added them to an arena's totals
+static __thread uint64_t thread_mallocs;
+static __thread uint64_t thread_frees;
+static __thread uint64_t thread_requested;
+static __thread uint64_t thread_granted;
+static uint64_t num_failures;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+#ifdef MF_DEBUG
+int guard_blocks = 1;
+size_t quarantine_limit = QUARANTINE_LIMIT;
+static heap_corruption_hook_t corruption_hook;
+
+#define SET_MAGIC(chunk, value) ((chunk)->magic = (value))
+#define CHECK_MAGIC(chunk) assert((chunk)->magic == MAGIC_NUMBER && ((chunk)->size_flags & CHUNK_IN_USE))
+#define GUARDING guard_blocks
+#else
+// Release builds have no magic number to keep or check, and none of the hardening in between
+#define SET_MAGIC(chunk, value) ((void)0)
+#define CHECK_MAGIC(chunk) ((void)0)
+#define GUARDING 0
+#define guard_size(size) (size)
+#define arm_block(ptr, size) (ptr)
+#define held_block(ptr) 1
+#define disarm_block(ptr) 1
+#define must_move(chunk) 0
+#endif
+
+#pragma region Errors
+
+/* Records why an allocation failed and tells the log hook if there is one. */
+static void report_error(heap_error_t error, size_t size)
+{
+    last_error = error;
+    __atomic_add_fetch(&num_failures, 1, __ATOMIC_RELAXED);
+    errno = (error == HEAP_ZERO_SIZE || error == HEAP_BAD_ALIGNMENT) ? EINVAL : ENOMEM;
+
+    if (log_hook)
+    {
+        log_hook(error, size);
+    }
+}
+
+/* Returns why the last failed allocation on this thread failed. Like errno it isn't cleared by a successful one. */
+heap_error_t heap_last_error()
+{
+    return last_error;
+}
+
+const char *heap_error_string(heap_error_t error)
+{
+    switch (error)
+    {
+    case HEAP_OK:
+        return "NO ERROR";
+    case HEAP_SIZE_TOO_LARGE:
+        return "REQUESTED SIZE EXCEEDS HEAP SIZE";
+    case HEAP_ZERO_SIZE:
+        return "REFUSING TO ALLOCATE SIZE 0";
+    case HEAP_OUT_OF_MEMORY:
+        return "NO CHUNK BIG ENOUGH";
+    case HEAP_BAD_ALIGNMENT:
+        return "ALIGNMENT IS NOT A POWER OF TWO";
+    }
+    return "UNKNOWN ERROR";
+}
+
+/* Registers a function to call whenever an allocation fails, or NULL to stay silent. Returns the previous one. */
+heap_log_hook_t set_heap_log_hook(heap_log_hook_t hook)
+{
+    heap_log_hook_t prev_hook = log_hook;
+    log_hook = hook;
+    return prev_hook;
+}
+
+#pragma endregion Errors
+
+#pragma region Tracing
+
+static int trace_fd = -1;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_record_t trace_buffer[TRACE_BUFFER_RECORDS];
+static size_t trace_count;
+static uint64_t trace_began;
+static uint32_t next_trace_thread;
+static __thread uint32_t trace_thread;
+
+static uint64_t trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Writes out the buffered records. If the file can't take them tracing stops. The caller must hold trace_lock. */
+static void flush_trace_buffer()
+{
+    size_t bytes = trace_count * sizeof(trace_record_t);
+    if (bytes && write(trace_fd, trace_buffer, bytes) != (ssize_t)bytes)
+    {
+        close(trace_fd);
+        __atomic_store_n(&trace_fd, -1, __ATOMIC_RELAXED);
+    }
+    trace_count = 0;
+}
+
+/* Only the check for this sits on the allocation path when tracing is off */
+static int is_tracing()
+{
+    return __atomic_load_n(&trace_fd, __ATOMIC_RELAXED) >= 0;
+}
+
+/* Records one call. extra is the old offset for a realloc and the alignment for an aligned allocation. */
+static void trace_call(trace_op_t op, void *ptr, int64_t extra, size_t size)
+{
+    if (!trace_thread)
+    {
+        trace_thread = __atomic_add_fetch(&next_trace_thread, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0)
+    {
+        trace_record_t *record = &trace_buffer[trace_count++];
+        record->time = trace_now() - trace_began;
+        record->offset = (int64_t)((uint64_t)ptr - start);
+        record->extra = extra;
+        record->size = size;
+        record->thread = trace_thread;
+        record->op = op;
+
+        if (trace_count == TRACE_BUFFER_RECORDS)
+        {
+            flush_trace_buffer();
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Starts logging every allocation call to the file at path, replacing it. Returns 0 or -1 with errno set. */
+int trace_start(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    trace_file_header_t header = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record_t), start};
+    if (write(fd, &header, sizeof(header)) != sizeof(header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0)
+    {
+        flush_trace_buffer();
+        close(trace_fd);
+    }
+    trace_count = 0;
+    trace_began = trace_now();
+    __atomic_store_n(&trace_fd, fd, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+/* Flushes whatever is buffered and closes the trace file. */
+void trace_stop()
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0)
+    {
+        flush_trace_buffer();
+        if (trace_fd >= 0)
+        {
+            close(trace_fd);
+        }
+        __atomic_store_n(&trace_fd, -1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+#pragma endregion Tracing
 
 size_t align(size_t raw)
 {
-    size_t aligned = ALIGN_TO * ((raw - 1 + ALIGN_TO + sizeof(header_t)) / ALIGN_TO);
-    return aligned;
+    if (raw + sizeof(header_t) < MIN_CHUNK_SIZE)
+    {
+        raw = MIN_CHUNK_SIZE - sizeof(header_t);
+    }
+    return ALIGN_TO * ((raw - 1 + ALIGN_TO + sizeof(header_t)) / ALIGN_TO);
+}
+
+#pragma region Boundary_Tags
+
+/* Returns a chunk's total size in bytes, header included. */
+size_t chunk_size(header_t *chunk)
+{
+    return chunk->size_flags & CHUNK_SIZE_MASK;
+}
+
+/* Changes a chunk's size and keeps its flags. */
+void set_chunk_size(header_t *chunk, size_t size)
+{
+    chunk->size_flags = (chunk->size_flags & ~CHUNK_SIZE_MASK) | size;
+}
+
+/* Returns the first chunk in a region. It starts far enough in for its payload to be aligned. */
+header_t *first_chunk(region_t *region)
+{
+    return (header_t *)((char *)region->base + ALIGN_TO) - 1;
+}
+
+/* Returns the chunk physically after this one. Every region ends in a fencepost so there always is one. */
+header_t *next_chunk(header_t *chunk)
+{
+    return (header_t *)((char *)chunk + chunk_size(chunk));
+}
+
+/* Returns the chunk physically before this one. Only valid if that chunk is free, since only free chunks have a footer. */
+header_t *prev_chunk(header_t *chunk)
+{
+    size_t prev_size = *((size_t *)chunk - 1);
+    return (header_t *)((char *)chunk - prev_size);
+}
+
+/* Returns the footer at the end of a free chunk. */
+size_t *chunk_footer(header_t *chunk)
+{
+    return (size_t *)((char *)chunk + chunk_size(chunk)) - 1;
+}
+
+/* Returns the arena a chunk was carved from. */
+arena_t *chunk_arena(header_t *chunk)
+{
+    return &arenas[(chunk->size_flags & ARENA_MASK) >> ARENA_SHIFT];
+}
+
+/* Sets and clears flags in an allocated chunk's header. The previous chunk's arena flips PREV_IN_USE in the same word, so this has to hold its lock. */
+static void update_flags(header_t *chunk, size_t set, size_t clear)
+{
+    if (chunk->size_flags & CHUNK_MMAPPED)
+    {
+        chunk->size_flags = (chunk->size_flags & ~clear) | set;
+        return;
+    }
+
+    arena_t *arena = chunk_arena(chunk);
+    pthread_mutex_lock(&arena->lock);
+    chunk->size_flags = (chunk->size_flags & ~clear) | set;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/* Marks a chunk free, writes its footer and tells the next chunk. */
+static void mark_free(node_t *chunk)
+{
+    SET_MAGIC(chunk, 0);
+    chunk->size_flags &= ~CHUNK_IN_USE;
+    *chunk_footer((header_t *)chunk) = chunk_size((header_t *)chunk);
+    next_chunk((header_t *)chunk)->size_flags &= ~PREV_IN_USE;
+}
+
+/* Merges a free chunk with its free physical neighbours. Returns the merged chunk, which is not in any bin. */
+node_t *coalesce(arena_t *arena, node_t *chunk)
+{
+    header_t *next = next_chunk((header_t *)chunk);
+    if (!(next->size_flags & CHUNK_IN_USE))
+    {
+        remove_from_bin(arena, (node_t *)next);
+        set_chunk_size((header_t *)chunk, chunk_size((header_t *)chunk) + chunk_size(next));
+        arena->layout_changes++;
+    }
+
+    if (!(chunk->size_flags & PREV_IN_USE))
+    {
+        node_t *prev = (node_t *)prev_chunk((header_t *)chunk);
+        remove_from_bin(arena, prev);
+        set_chunk_size((header_t *)prev, chunk_size((header_t *)prev) + chunk_size((header_t *)chunk));
+        arena->layout_changes++;
+        chunk = prev;
+    }
+
+    return chunk;
+}
+
+#pragma endregion Boundary_Tags
+
+#pragma region Bins
+
+// bin_index(SMALL_BIN_LIMIT - 1) has to be the last small bin and bin_index(SMALL_BIN_LIMIT) the first power of two one
+_Static_assert((SMALL_BIN_LIMIT - 1) / ALIGN_TO == NUM_SMALL_BINS - 1, "the last small bin has to be NUM_SMALL_BINS - 1");
+_Static_assert(SMALL_BIN_LIMIT == 1 << SMALL_BIN_LIMIT_LOG, "SMALL_BIN_LIMIT_LOG has to match SMALL_BIN_LIMIT");
+
+/* Returns the bin for a chunk of chunk_size total bytes. Small sizes get a bin each, bigger ones share a power of two range. */
+size_t bin_index(size_t chunk_size)
+{
+    if (chunk_size < SMALL_BIN_LIMIT)
+    {
+        return chunk_size / ALIGN_TO;
+    }
+
+    size_t log = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(chunk_size);
+    size_t index = NUM_SMALL_BINS + log - SMALL_BIN_LIMIT_LOG;
+    return index < NUM_BINS ? index : NUM_BINS - 1;
+}
+
+static void tree_add(arena_t *arena, node_t *chunk);
+static void tree_remove(arena_t *arena, node_t *chunk);
+
+void add_to_bin(arena_t *arena, node_t *chunk)
+{
+    size_t index = bin_index(chunk_size((header_t *)chunk));
+    tree_add(arena, chunk);
+    arena->free_bytes += chunk_size((header_t *)chunk);
+    arena->num_free++;
+
+    chunk->prev = NULL;
+    chunk->next = arena->bins[index];
+    if (arena->bins[index])
+    {
+        arena->bins[index]->prev = chunk;
+    }
+    arena->bins[index] = chunk;
+    arena->bin_map[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+void remove_from_bin(arena_t *arena, node_t *chunk)
+{
+    size_t index = bin_index(chunk_size((header_t *)chunk));
+    tree_remove(arena, chunk);
+    arena->free_bytes -= chunk_size((header_t *)chunk);
+    arena->num_free--;
+
+    if (chunk->prev)
+    {
+        chunk->prev->next = chunk->next;
+    }
+    else
+    {
+        arena->bins[index] = chunk->next;
+    }
+    if (chunk->next)
+    {
+        chunk->next->prev = chunk->prev;
+    }
+
+    if (!arena->bins[index])
+    {
+        arena->bin_map[index / 64] &= ~((uint64_t)1 << (index % 64));
+    }
+}
+
+/* Returns the first bin at or after index that has a chunk in it, or NUM_BINS if there are none. */
+static size_t next_nonempty_bin(arena_t *arena, size_t index)
+{
+    while (index < NUM_BINS)
+    {
+        uint64_t word = arena->bin_map[index / 64] & (~(uint64_t)0 << (index % 64));
+        if (word)
+        {
+            return (index & ~(size_t)63) + __builtin_ctzll(word);
+        }
+        index = (index & ~(size_t)63) + 64;
+    }
+    return NUM_BINS;
+}
+
+/* Returns the last bin that has a chunk in it, or NUM_BINS if there are none. */
+static size_t last_nonempty_bin(arena_t *arena)
+{
+    for (size_t word = NUM_BINS / 64; word > 0; word--)
+    {
+        if (arena->bin_map[word - 1])
+        {
+            return (word - 1) * 64 + 63 - __builtin_clzll(arena->bin_map[word - 1]);
+        }
+    }
+    return NUM_BINS;
+}
+
+#pragma endregion Bins
+
+#pragma region Free_Tree
+
+/* Treap priority. Derived from the address so it costs nothing to store and the tree stays balanced whatever order chunks arrive in. */
+static uint64_t tree_priority(tree_node_t *node)
+{
+    return (uint64_t)(uintptr_t)node * 0x9e3779b97f4a7c15ull;
+}
+
+/* Orders free chunks by address, or by size and then address. */
+static int tree_less(tree_order_t order, tree_node_t *a, tree_node_t *b)
+{
+    size_t a_size = chunk_size((header_t *)a);
+    size_t b_size = chunk_size((header_t *)b);
+    return order == TREE_BY_ADDRESS ? a < b : a_size < b_size || (a_size == b_size && a < b);
+}
+
+/* Recomputes the biggest chunk size in a subtree from its children. */
+static void tree_update(tree_node_t *node)
+{
+    node->max_size = chunk_size((header_t *)node);
+    if (node->left && node->left->max_size > node->max_size)
+    {
+        node->max_size = node->left->max_size;
+    }
+    if (node->right && node->right->max_size > node->max_size)
+    {
+        node->max_size = node->right->max_size;
+    }
+}
+
+static tree_node_t *rotate_right(tree_node_t *root)
+{
+    tree_node_t *left = root->left;
+    root->left = left->right;
+    tree_update(root);
+    left->right = root;
+    tree_update(left);
+    return left;
+}
+
+static tree_node_t *rotate_left(tree_node_t *root)
+{
+    tree_node_t *right = root->right;
+    root->right = right->left;
+    tree_update(root);
+    right->left = root;
+    tree_update(right);
+    return right;
+}
+
+static tree_node_t *tree_insert(tree_order_t order, tree_node_t *root, tree_node_t *node)
+{
+    if (!root)
+    {
+        node->left = NULL;
+        node->right = NULL;
+        node->max_size = chunk_size((header_t *)node);
+        return node;
+    }
+
+    if (tree_less(order, node, root))
+    {
+        root->left = tree_insert(order, root->left, node);
+        if (tree_priority(root->left) > tree_priority(root))
+        {
+            return rotate_right(root);
+        }
+    }
+    else
+    {
+        root->right = tree_insert(order, root->right, node);
+        if (tree_priority(root->right) > tree_priority(root))
+        {
+            return rotate_left(root);
+        }
+    }
+    tree_update(root);
+    return root;
+}
+
+/* Joins two subtrees where everything in left orders before everything in right. */
+static tree_node_t *tree_join(tree_node_t *left, tree_node_t *right)
+{
+    if (!left || !right)
+    {
+        return left ? left : right;
+    }
+
+    if (tree_priority(left) > tree_priority(right))
+    {
+        left->right = tree_join(left->right, right);
+        tree_update(left);
+        return left;
+    }
+    right->left = tree_join(left, right->left);
+    tree_update(right);
+    return right;
+}
+
+static tree_node_t *tree_delete(tree_order_t order, tree_node_t *root, tree_node_t *node)
+{
+    if (root == node)
+    {
+        return tree_join(root->left, root->right);
+    }
+
+    if (tree_less(order, node, root))
+    {
+        root->left = tree_delete(order, root->left, node);
+    }
+    else
+    {
+        root->right = tree_delete(order, root->right, node);
+    }
+    tree_update(root);
+    return root;
+}
+
+/* Indexes a free chunk if the arena keeps a free tree and the chunk has room for the links. */
+static void tree_add(arena_t *arena, node_t *chunk)
+{
+    if (arena->indexed && chunk_size((header_t *)chunk) >= TREE_MIN_CHUNK_SIZE)
+    {
+        arena->free_tree = tree_insert(arena->indexed, arena->free_tree, (tree_node_t *)chunk);
+    }
+}
+
+static void tree_remove(arena_t *arena, node_t *chunk)
+{
+    if (arena->indexed && chunk_size((header_t *)chunk) >= TREE_MIN_CHUNK_SIZE)
+    {
+        arena->free_tree = tree_delete(arena->indexed, arena->free_tree, (tree_node_t *)chunk);
+    }
+}
+
+/* Returns the smallest chunk in the tree that can hold needed_size, lowest address first, or NULL. */
+static tree_node_t *tree_best_fit(tree_node_t *root, size_t needed_size)
+{
+    tree_node_t *best = NULL;
+    while (root)
+    {
+        if (needed_size <= chunk_size((header_t *)root))
+        {
+            best = root;
+            root = root->left;
+        }
+        else
+        {
+            root = root->right;
+        }
+    }
+    return best;
+}
+
+/* Returns the lowest addressed chunk that can hold needed_size in a tree ordered by address, or NULL. One path down, since max_size says which side has a fit. */
+static tree_node_t *tree_first_fit(tree_node_t *root, size_t needed_size)
+{
+    while (root && root->max_size >= needed_size)
+    {
+        if (root->left && root->left->max_size >= needed_size)
+        {
+            root = root->left;
+        }
+        else if (needed_size <= chunk_size((header_t *)root))
+        {
+            return root;
+        }
+        else
+        {
+            root = root->right;
+        }
+    }
+    return NULL;
+}
+
+/* Returns the lowest addressed chunk at or after rover that can hold needed_size in a tree ordered by address, or NULL. */
+static tree_node_t *tree_next_fit(tree_node_t *root, size_t needed_size, void *rover)
+{
+    // Best answer so far: a chunk that fits, or failing that a subtree that holds one. Each step left finds a better one
+    tree_node_t *next = NULL;
+    tree_node_t *subtree = NULL;
+    while (root && root->max_size >= needed_size)
+    {
+        if ((void *)root < rover)
+        {
+            root = root->right;
+            continue;
+        }
+
+        // Everything from here rightwards is past the rover, and anything that fits on the left comes first
+        if (needed_size <= chunk_size((header_t *)root))
+        {
+            next = root;
+            subtree = NULL;
+        }
+        else if (root->right && root->right->max_size >= needed_size)
+        {
+            next = NULL;
+            subtree = root->right;
+        }
+        root = root->left;
+    }
+    return next ? next : tree_first_fit(subtree, needed_size);
+}
+
+#pragma endregion Free_Tree
+
+/* Returns the head of the smallest bin that fits if needed_size is small enough for one of the bins below the free tree, otherwise NULL. */
+static node_t *smallest_bin_fit(arena_t *arena, size_t needed_size)
+{
+    if (needed_size >= TREE_MIN_CHUNK_SIZE)
+    {
+        return NULL;
+    }
+    size_t index = next_nonempty_bin(arena, bin_index(needed_size));
+    return index <= bin_index(TREE_MIN_CHUNK_SIZE - 1) ? arena->bins[index] : NULL;
+}
+
+/* Returns the lowest addressed chunk at or after from in the bins from index up to the free tree, otherwise NULL. Those bins aren't kept in address order so every chunk in them is looked at, but they only ever hold chunks too small for the tree's links. */
+static node_t *lowest_bin_fit(arena_t *arena, size_t index, void *from)
+{
+    node_t *lowest = NULL;
+    for (index = next_nonempty_bin(arena, index); index <= bin_index(TREE_MIN_CHUNK_SIZE - 1); index = next_nonempty_bin(arena, index + 1))
+    {
+        for (node_t *curr = arena->bins[index]; curr; curr = curr->next)
+        {
+            if ((void *)curr >= from && (!lowest || curr < lowest))
+            {
+                lowest = curr;
+            }
+        }
+    }
+    return lowest;
+}
+
+/* Returns the biggest free chunk if it can hold needed_size, otherwise NULL. */
+static node_t *find_worst_fit(arena_t *arena, size_t needed_size)
+{
+    tree_node_t *biggest = arena->free_tree;
+    if (!biggest)
+    {
+        if (needed_size >= TREE_MIN_CHUNK_SIZE)
+        {
+            return NULL;
+        }
+
+        // Every free chunk is too small for the tree, so the biggest are in the highest of the bins below it that has any
+        size_t index = bin_index(TREE_MIN_CHUNK_SIZE - 1);
+        while (index > bin_index(needed_size) && !arena->bins[index])
+        {
+            index--;
+        }
+        return lowest_bin_fit(arena, index, NULL);
+    }
+    while (biggest->right)
+    {
+        biggest = biggest->right;
+    }
+
+    // Ties go to the lowest address, like the old address sorted free list did
+    biggest = tree_best_fit(arena->free_tree, chunk_size((header_t *)biggest));
+    return needed_size <= chunk_size((header_t *)biggest) ? &biggest->node : NULL;
+}
+
+/* Returns the smallest free chunk that can hold needed_size, otherwise NULL. */
+static node_t *find_best_fit(arena_t *arena, size_t needed_size)
+{
+    node_t *exact = smallest_bin_fit(arena, needed_size);
+    if (exact)
+    {
+        return exact;
+    }
+    tree_node_t *best = tree_best_fit(arena->free_tree, needed_size);
+    return best ? &best->node : NULL;
+}
+
+/* Returns the lowest addressed free chunk that can hold needed_size, otherwise NULL. */
+static node_t *find_first_fit(arena_t *arena, size_t needed_size)
+{
+    node_t *first = (node_t *)tree_first_fit(arena->free_tree, needed_size);
+    node_t *small = lowest_bin_fit(arena, bin_index(needed_size), NULL);
+    if (small && (!first || small < first))
+    {
+        first = small;
+    }
+    return first;
+}
+
+/* Returns a free chunk from the smallest size class that can hold needed_size, otherwise NULL. */
+static node_t *find_segregated_fit(arena_t *arena, size_t needed_size)
+{
+    size_t index = bin_index(needed_size);
+
+    // Every chunk in a small bin is the same size, so the head is an exact fit
+    if (index < NUM_SMALL_BINS && arena->bins[index])
+    {
+        return arena->bins[index];
+    }
+
+    // Chunks in a range bin may still be too small
+    if (index >= NUM_SMALL_BINS)
+    {
+        for (node_t *curr = arena->bins[index]; curr; curr = curr->next)
+        {
+            if (needed_size <= chunk_size((header_t *)curr))
+            {
+                return curr;
+            }
+        }
+    }
+
+    // Anything in a bigger class fits, so split the head of the first one
+    index = next_nonempty_bin(arena, index + 1);
+    return index < NUM_BINS ? arena->bins[index] : NULL;
+}
+
+/* Returns the lowest addressed free chunk that can hold needed_size, starting from where the last one was carved and wrapping around, otherwise NULL. */
+static node_t *find_next_fit(arena_t *arena, size_t needed_size)
+{
+    node_t *next = (node_t *)tree_next_fit(arena->free_tree, needed_size, arena->rover);
+    node_t *small = lowest_bin_fit(arena, bin_index(needed_size), arena->rover);
+    if (small && (!next || small < next))
+    {
+        next = small;
+    }
+    return next ? next : find_first_fit(arena, needed_size);
+}
+
+/* Returns the tightest fit among the first good_fit_probes chunks from the smallest size class that can hold needed_size, otherwise NULL. */
+static node_t *find_good_fit(arena_t *arena, size_t needed_size)
+{
+    node_t *best = NULL;
+    size_t probes = 0;
+    for (size_t index = next_nonempty_bin(arena, bin_index(needed_size)); index < NUM_BINS; index = next_nonempty_bin(arena, index + 1))
+    {
+        for (node_t *curr = arena->bins[index]; curr; curr = curr->next)
+        {
+            if (needed_size <= chunk_size((header_t *)curr) && (!best || chunk_size((header_t *)curr) < chunk_size((header_t *)best)))
+            {
+                best = curr;
+            }
+            // Stop when out of probes, or when the leftover would be too small to split off anyway
+            if (++probes >= good_fit_probes || (best && chunk_size((header_t *)best) - needed_size < MIN_CHUNK_SIZE))
+            {
+                break;
+            }
+        }
+
+        // Every chunk in a later bin is bigger than any in this one
+        if (best)
+        {
+            return best;
+        }
+    }
+    return NULL;
+}
+
+/* How each policy finds a chunk, and how it needs the arena's free tree ordered to do it. */
+typedef struct __placement_t
+{
+    node_t *(*find)(arena_t *arena, size_t needed_size);
+    tree_order_t tree;
+} placement_t;
+
+static const placement_t placements[] = {
+    [POLICY_SEGREGATED_FIT] = {find_segregated_fit, TREE_NONE},
+    [POLICY_WORST_FIT] = {find_worst_fit, TREE_BY_SIZE},
+    [POLICY_BEST_FIT] = {find_best_fit, TREE_BY_SIZE},
+    [POLICY_FIRST_FIT] = {find_first_fit, TREE_BY_ADDRESS},
+    [POLICY_NEXT_FIT] = {find_next_fit, TREE_BY_ADDRESS},
+    [POLICY_GOOD_FIT] = {find_good_fit, TREE_NONE},
+};
+
+static node_t *find_fit(arena_t *arena, size_t needed_size)
+{
+    return placements[arena->policy].find(arena, needed_size);
+}
+
+/* Builds, rebuilds in another order or drops the free tree of an arena to suit a policy. The caller must hold the arena's lock. */
+static void index_arena(arena_t *arena, policy_t policy)
+{
+    if (arena->indexed == placements[policy].tree)
+    {
+        return;
+    }
+
+    arena->indexed = placements[policy].tree;
+    arena->free_tree = NULL;
+    if (!arena->indexed)
+    {
+        return;
+    }
+    for (size_t i = 0; i < NUM_BINS; i++)
+    {
+        for (node_t *chunk = arena->bins[i]; chunk; chunk = chunk->next)
+        {
+            tree_add(arena, chunk);
+        }
+    }
+}
+
+/* Switches one arena to a new placement policy. */
+void set_arena_policy(arena_t *arena, policy_t new_policy)
+{
+    pthread_mutex_lock(&arena->lock);
+    index_arena(arena, new_policy);
+    arena->policy = new_policy;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/* Switches every arena to a new placement policy. Called before init_heap it picks the policy every arena starts with. */
+void set_policy(policy_t new_policy)
+{
+    policy = new_policy;
+    for (size_t i = 0; i < num_arenas; i++)
+    {
+        set_arena_policy(&arenas[i], new_policy);
+    }
+}
+
+/* Takes a free chunk out of its bin and marks the first needed_size bytes of it allocated. The caller must hold the arena's lock. */
+static void *carve_chunk(arena_t *arena, node_t *chunk, size_t needed_size)
+{
+    size_t size = chunk_size((header_t *)chunk);
+    size_t kept_flags = chunk->size_flags & (ARENA_MASK | CHUNK_ZEROED);
+    remove_from_bin(arena, chunk);
+    // Next fit carries on from here. It is only ever compared against, so it doesn't matter if this stops being a chunk
+    arena->rover = (char *)chunk + needed_size;
+
+    // Split free chunk
+    // The leftover stays free if it is big enough to be a chunk
+    if (size - needed_size >= MIN_CHUNK_SIZE)
+    {
+        node_t *split_free_chunk = (node_t *)((char *)chunk + needed_size);
+        split_free_chunk->size_flags = (size - needed_size) | PREV_IN_USE | kept_flags;
+        mark_free(split_free_chunk);
+        add_to_bin(arena, split_free_chunk);
+    }
+    // Otherwise hand out the whole chunk
+    else
+    {
+        needed_size = size;
+        next_chunk((header_t *)chunk)->size_flags |= PREV_IN_USE;
+    }
+
+    // Create header_t
+    // Free chunks never sit next to each other, so the previous chunk is always in use
+    header_t *allocated_header_t = (header_t *)chunk;
+    allocated_header_t->size_flags = needed_size | CHUNK_IN_USE | PREV_IN_USE | kept_flags;
+    SET_MAGIC(allocated_header_t, MAGIC_NUMBER);
+
+    // Cut big chunk down to size
+    header_t *allocated_address = (header_t *)chunk + 1;
+
+    return (void *)allocated_address;
+}
+
+/* Looks for a fit in every other arena that isn't busy. Returns NULL if none of them have one. */
+static void *steal_from_other_arenas(arena_t *arena, size_t needed_size)
+{
+    for (size_t i = 1; i < num_arenas; i++)
+    {
+        arena_t *other = &arenas[(arena->index + i) % num_arenas];
+
+        // Never wait on another arena, that's what having more than one is meant to avoid
+        if (pthread_mutex_trylock(&other->lock))
+        {
+            continue;
+        }
+
+        void *ptr = NULL;
+        node_t *chunk = find_fit(other, needed_size);
+        if (chunk)
+        {
+            ptr = carve_chunk(other, chunk, needed_size);
+        }
+        pthread_mutex_unlock(&other->lock);
+
+        if (ptr)
+        {
+            return ptr;
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns a chunk to its arena, merging it with free neighbours in constant time. The caller must hold that arena's lock. */
+static void heap_free(arena_t *arena, header_t *hptr)
+{
+    // The size means the same thing for free and allocated chunks so it carries over
+    node_t *new_free_chunk = coalesce(arena, (node_t *)hptr);
+    new_free_chunk->size_flags &= ~(CHUNK_ZEROED | CHUNK_TRIMMED);
+    mark_free(new_free_chunk);
+    add_to_bin(arena, new_free_chunk);
+
+    arena->dirty = 1;
+    arena->last_free_tick = __atomic_load_n(&trim_tick, __ATOMIC_RELAXED);
+}
+
+#pragma region Remote_Frees
+
+/* Pushes a chunk onto its arena's remote free stack with a single CAS. Never takes a lock. */
+static void push_remote_free(arena_t *arena, header_t *hptr)
+{
+    node_t *chunk = (node_t *)hptr;
+    SET_MAGIC(chunk, REMOTE_MAGIC);
+
+    node_t *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do
+    {
+        chunk->next = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, chunk, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Frees everything other threads pushed onto an arena's remote free stack. The caller must hold the arena's lock. */
+static void drain_remote_frees(arena_t *arena)
+{
+    // Only lock holders pop and they take the whole stack at once, so there's no ABA problem
+    node_t *curr = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (curr)
+    {
+        node_t *next = curr->next;
+        SET_MAGIC(curr, MAGIC_NUMBER);
+        heap_free(arena, (header_t *)curr);
+        curr = next;
+    }
+}
+
+/* Drains the remote free stacks of every arena so the heap can be inspected. */
+void drain_all_remote_frees()
+{
+    for (size_t i = 0; i < num_arenas; i++)
+    {
+        pthread_mutex_lock(&arenas[i].lock);
+        drain_remote_frees(&arenas[i]);
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+#pragma endregion Remote_Frees
+
+#pragma region Deferred_Coalescing
+
+/* Merge sorts a pending list by address. Works on the links alone so it needs no memory of its own. */
+static node_t *sort_by_address(node_t *list)
+{
+    if (!list || !list->next)
+    {
+        return list;
+    }
+
+    // Split it in half
+    node_t *slow = list;
+    for (node_t *fast = list->next; fast && fast->next; fast = fast->next->next)
+    {
+        slow = slow->next;
+    }
+    node_t *second = slow->next;
+    slow->next = NULL;
+
+    node_t *a = sort_by_address(list);
+    node_t *b = sort_by_address(second);
+    node_t head;
+    node_t *tail = &head;
+    while (a && b)
+    {
+        if (a < b)
+        {
+            tail->next = a;
+            a = a->next;
+        }
+        else
+        {
+            tail->next = b;
+            b = b->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = a ? a : b;
+    return head.next;
+}
+
+/* Frees every chunk on an arena's pending list in address order. Runs of pending chunks that sit next to each other are joined first so each run is merged and binned once. The caller must hold the arena's lock. */
+static void merge_pending(arena_t *arena)
+{
+    node_t *curr = sort_by_address(arena->pending);
+    arena->pending = NULL;
+    arena->num_pending = 0;
+
+    while (curr)
+    {
+        node_t *next = curr->next;
+        while (next && (header_t *)next == next_chunk((header_t *)curr))
+        {
+            set_chunk_size((header_t *)curr, chunk_size((header_t *)curr) + chunk_size((header_t *)next));
+            arena->layout_changes++;
+            next = next->next;
+        }
+        SET_MAGIC(curr, MAGIC_NUMBER);
+        heap_free(arena, (header_t *)curr);
+        curr = next;
+    }
+}
+
+/* Puts a freed chunk on its arena's pending list in constant time. It stays marked in use so nothing merges with it until the batch pass. The caller must hold the arena's lock. */
+static void defer_free(arena_t *arena, header_t *hptr)
+{
+    node_t *chunk = (node_t *)hptr;
+    SET_MAGIC(chunk, PENDING_MAGIC);
+    chunk->next = arena->pending;
+    arena->pending = chunk;
+
+    if (++arena->num_pending >= coalesce_batch)
+    {
+        merge_pending(arena);
+    }
+}
+
+/* Merges the pending list of every arena so the heap can be inspected. */
+void merge_all_pending()
+{
+    for (size_t i = 0; i < num_arenas; i++)
+    {
+        pthread_mutex_lock(&arenas[i].lock);
+        merge_pending(&arenas[i]);
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+#pragma endregion Deferred_Coalescing
+
+static void record_failure(arena_t *arena, size_t needed_size);
+
+/* Carves needed_size bytes out of an arena. The caller must hold the arena's lock. */
+static void *heap_malloc(arena_t *arena, size_t needed_size)
+{
+    // Pick up anything other threads freed since the last allocation
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED))
+    {
+        drain_remote_frees(arena);
+    }
+
+    node_t *chunk = find_fit(arena, needed_size);
+
+    // Chunks waiting to be merged may make a big enough one
+    if (!chunk && arena->pending)
+    {
+        merge_pending(arena);
+        chunk = find_fit(arena, needed_size);
+    }
+
+    if (!chunk)
+    {
+        // Before mapping more memory see if another arena has some to spare
+        void *ptr = steal_from_other_arenas(arena, needed_size);
+        if (ptr)
+        {
+            return ptr;
+        }
+
+        // If there is no chunk big enough map a new region and carve from that
+        chunk = grow_heap(arena, needed_size);
+        if (!chunk)
+        {
+            record_failure(arena, needed_size);
+            report_error(HEAP_OUT_OF_MEMORY, needed_size);
+            return NULL;
+        }
+    }
+
+    return carve_chunk(arena, chunk, needed_size);
+}
+
+/* Returns the arena this thread allocates from, picking one the first time. */
+static arena_t *get_thread_arena()
+{
+    if (!thread_arena)
+    {
+        thread_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % num_arenas];
+    }
+    return thread_arena;
+}
+
+/* Adds this thread's allocation and free counts to an arena's totals. The caller must hold the arena's lock. */
+static void merge_thread_counts(arena_t *arena)
+{
+    arena->mallocs += thread_mallocs;
+    arena->frees += thread_frees;
+    arena->requested_bytes += thread_requested;
+    arena->granted_bytes += thread_granted;
+    thread_mallocs = 0;
+    thread_frees = 0;
+    thread_requested = 0;
+    thread_granted = 0;
+}
+
+#pragma region Small_Objects
+
+// Objects start on the first cache line after their page's header
+#define SMALL_PAGE_HEADER ((sizeof(small_page_t) + 63) & ~(size_t)63)
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/* Reserves the address range small pages are carved from. If it can't be had every allocation gets a header. */
+static void reserve_small_zone()
+{
+    if (small_zone)
+    {
+        return;
+    }
+
+    // Nothing is committed until a page is touched. The extra page leaves room to align the zone to whole small pages
+    char *base = mmap(NULL, SMALL_ZONE_SIZE + SMALL_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        return;
+    }
+    small_zone = (char *)(((uintptr_t)base + SMALL_PAGE_SIZE - 1) & ~(uintptr_t)(SMALL_PAGE_SIZE - 1));
+}
+
+/* Returns 1 if ptr is an object from a small page, which has no header in front of it. */
+int is_small_object(void *ptr)
+{
+    return small_zone && (uintptr_t)ptr - (uintptr_t)small_zone < SMALL_ZONE_SIZE;
+}
+
+/* Returns the page a small object lives in. Pages are aligned to their size so masking the address finds it. */
+small_page_t *small_page(void *ptr)
+{
+    return (small_page_t *)((uintptr_t)ptr & ~(uintptr_t)(SMALL_PAGE_SIZE - 1));
+}
+
+static void push_page(small_page_t **list, small_page_t *page)
+{
+    page->prev = NULL;
+    page->next = *list;
+    if (*list)
+    {
+        (*list)->prev = page;
+    }
+    *list = page;
+}
+
+static void remove_page(small_page_t **list, small_page_t *page)
+{
+    if (page->prev)
+    {
+        page->prev->next = page->next;
+    }
+    else
+    {
+        *list = page->next;
+    }
+    if (page->next)
+    {
+        page->next->prev = page->prev;
+    }
+}
+
+/* Sets up a page for objects of one size, reusing one of the arena's empty pages if it has any. Returns NULL once the zone is used up. The caller must hold the arena's lock. */
+static small_page_t *new_small_page(arena_t *arena, size_t object_size)
+{
+    small_page_t *page = arena->empty_pages;
+    if (page)
+    {
+        remove_page(&arena->empty_pages, page);
+    }
+    else
+    {
+        size_t used = __atomic_load_n(&small_zone_used, __ATOMIC_RELAXED);
+        do
+        {
+            if (used + SMALL_PAGE_SIZE > SMALL_ZONE_SIZE)
+            {
+                return NULL;
+            }
+        } while (!__atomic_compare_exchange_n(&small_zone_used, &used, used + SMALL_PAGE_SIZE, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        page = (small_page_t *)(small_zone + used);
+        page->arena = arena->index;
+        arena->num_small_pages++;
+    }
+
+    page->size = object_size;
+    page->free_objects = NULL;
+    page->unused = (char *)page + SMALL_PAGE_HEADER;
+    page->num_free = (SMALL_PAGE_SIZE - SMALL_PAGE_HEADER) / object_size;
+    return page;
+}
+
+/* Hands out one object of a small size class. Returns NULL once the zone is used up. The caller must hold the arena's lock. */
+static void *take_small_object(arena_t *arena, size_t class)
+{
+    small_page_t *page = arena->small_pages[class];
+    if (!page)
+    {
+        page = new_small_page(arena, (class + 1) * ALIGN_TO);
+        if (!page)
+        {
+            return NULL;
+        }
+        push_page(&arena->small_pages[class], page);
+    }
+
+    // Reuse a freed object first, otherwise carve the next one that was never used
+    void *obj = page->free_objects;
+    if (obj)
+    {
+        page->free_objects = *(void **)obj;
+    }
+    else
+    {
+        obj = page->unused;
+        page->unused += page->size;
+    }
+
+    // A full page leaves the list until one of its objects comes back
+    if (!--page->num_free)
+    {
+        remove_page(&arena->small_pages[class], page);
+    }
+    arena->small_object_bytes += page->size;
+    return obj;
+}
+
+/* Returns an object to its page. A page that empties goes on the arena's empty list unless it is the last one of its size. The caller must hold the lock of the page's arena. */
+static void give_small_object(arena_t *arena, void *obj)
+{
+    small_page_t *page = small_page(obj);
+    size_t class = page->size / ALIGN_TO - 1;
+    *(void **)obj = page->free_objects;
+    page->free_objects = obj;
+    arena->small_object_bytes -= page->size;
+
+    if (++page->num_free == 1)
+    {
+        push_page(&arena->small_pages[class], page);
+    }
+    else if (page->num_free == (SMALL_PAGE_SIZE - SMALL_PAGE_HEADER) / page->size && (page->prev || page->next))
+    {
+        remove_page(&arena->small_pages[class], page);
+        page->size = 0;
+        push_page(&arena->empty_pages, page);
+    }
+}
+
+#pragma endregion Small_Objects
+
+#pragma region Thread_Cache
+
+/* Hands every chunk in a thread's cache back to the heap when the thread exits. */
+static void tcache_destroy(void *cache)
+{
+    flush_tcache();
+
+    arena_t *arena = get_thread_arena();
+    pthread_mutex_lock(&arena->lock);
+    merge_thread_counts(arena);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+static void create_tcache_key()
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/* Makes sure whatever this thread caches gets returned if it exits. */
+static void tcache_register()
+{
+    if (!tcache.registered)
+    {
+        pthread_once(&tcache_key_once, create_tcache_key);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
+    }
+}
+
+/* Pushes an allocated chunk onto this thread's cache. */
+static void tcache_push(header_t *chunk, size_t index)
+{
+    node_t *cached = (node_t *)chunk;
+    SET_MAGIC(cached, TCACHE_MAGIC);
+    cached->next = tcache.entries[index];
+    tcache.entries[index] = cached;
+    tcache.counts[index]++;
+    tcache_register();
+}
+
+/* Pops a chunk off this thread's cache, or returns NULL if that size is empty. */
+static header_t *tcache_pop(size_t index)
+{
+    node_t *cached = tcache.entries[index];
+    if (!cached)
+    {
+        return NULL;
+    }
+
+    tcache.entries[index] = cached->next;
+    tcache.counts[index]--;
+    SET_MAGIC(cached, MAGIC_NUMBER);
+    return (header_t *)cached;
+}
+
+/* Takes a batch of chunks for an empty cache size under a single lock. */
+static void tcache_fill(size_t index, size_t needed_size)
+{
+    size_t batch = tcache_limit / 2 ? tcache_limit / 2 : 1;
+    arena_t *arena = get_thread_arena();
+
+    pthread_mutex_lock(&arena->lock);
+    for (size_t i = 0; i < batch; i++)
+    {
+        // Only the chunk the program asked for may grow the heap or count as a failure. The rest are carved from
+        // whatever is free already, and the batch just stops short when nothing is
+        void *ptr = NULL;
+        if (!i)
+        {
+            ptr = heap_malloc(arena, needed_size);
+        }
+        else
+        {
+            node_t *free_chunk = find_fit(arena, needed_size);
+            ptr = free_chunk ? carve_chunk(arena, free_chunk, needed_size) : NULL;
+        }
+        if (!ptr)
+        {
+            break;
+        }
+
+        // The whole chunk may have been handed out, so it only gets cached if its real size still files it under index
+        header_t *chunk = (header_t *)ptr - 1;
+        size_t chunk_index = bin_index(chunk_size(chunk));
+        if (chunk_index != index || tcache.counts[index] >= tcache_limit || chunk_arena(chunk) != arena)
+        {
+            if (chunk_arena(chunk) == arena)
+            {
+                heap_free(arena, chunk);
+            }
+            else if (chunk_index == index && tcache.counts[index] < tcache_limit)
+            {
+                // Borrowed from another arena but the right size, so it can still be used
+                tcache_push(chunk, index);
+            }
+            else
+            {
+                // Too big for any thread cache bin, or not wanted. Its own arena takes it back
+                push_remote_free(chunk_arena(chunk), chunk);
+            }
+            break;
+        }
+        tcache_push(chunk, index);
+    }
+    merge_thread_counts(arena);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/* Frees a list of cached chunks. Chunks from this thread's arena are freed under one lock, the rest go on their arena's remote free stack. */
+static void free_cached_chunks(node_t *curr)
+{
+    arena_t *own = get_thread_arena();
+    arena_t *locked = NULL;
+    while (curr)
+    {
+        node_t *next = curr->next;
+        arena_t *arena = chunk_arena((header_t *)curr);
+        if (arena != own)
+        {
+            push_remote_free(arena, (header_t *)curr);
+            curr = next;
+            continue;
+        }
+        if (arena != locked)
+        {
+            if (locked)
+            {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&arena->lock);
+            merge_thread_counts(arena);
+            locked = arena;
+        }
+
+        SET_MAGIC(curr, MAGIC_NUMBER);
+        heap_free(arena, (header_t *)curr);
+        curr = next;
+    }
+
+    if (locked)
+    {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+/* Returns the oldest half of a full cache size to the heap. */
+static void tcache_drain(size_t index)
+{
+    size_t keep = tcache_limit / 2;
+    node_t *curr = tcache.entries[index];
+    node_t *last_kept = NULL;
+    for (size_t i = 0; i < keep && curr; i++)
+    {
+        last_kept = curr;
+        curr = curr->next;
+    }
+
+    if (last_kept)
+    {
+        last_kept->next = NULL;
+    }
+    else
+    {
+        tcache.entries[index] = NULL;
+    }
+    tcache.counts[index] = keep < tcache.counts[index] ? keep : tcache.counts[index];
+
+    free_cached_chunks(curr);
+}
+
+static void tcache_push_object(void *obj, size_t class)
+{
+    *(void **)obj = tcache.objects[class];
+    tcache.objects[class] = obj;
+    tcache.object_counts[class]++;
+    tcache_register();
+}
+
+/* Pops a small object off this thread's cache, or returns NULL if that size is empty. */
+static void *tcache_pop_object(size_t class)
+{
+    void *obj = tcache.objects[class];
+    if (obj)
+    {
+        tcache.objects[class] = *(void **)obj;
+        tcache.object_counts[class]--;
+    }
+    return obj;
+}
+
+/* Takes a batch of small objects for an empty cache size under a single lock. */
+static void tcache_fill_objects(size_t class)
+{
+    size_t batch = tcache_limit / 2 ? tcache_limit / 2 : 1;
+    arena_t *arena = get_thread_arena();
+
+    pthread_mutex_lock(&arena->lock);
+    for (size_t i = 0; i < batch; i++)
+    {
+        void *obj = take_small_object(arena, class);
+        if (!obj)
+        {
+            break;
+        }
+        tcache_push_object(obj, class);
+    }
+    merge_thread_counts(arena);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/* Returns a list of cached small objects to their pages, holding one arena's lock for as long as the objects in a row come from it. */
+static void free_cached_objects(void *curr)
+{
+    arena_t *locked = NULL;
+    while (curr)
+    {
+        void *next = *(void **)curr;
+        arena_t *arena = &arenas[small_page(curr)->arena];
+        if (arena != locked)
+        {
+            if (locked)
+            {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&arena->lock);
+            merge_thread_counts(arena);
+            locked = arena;
+        }
+
+        give_small_object(arena, curr);
+        curr = next;
+    }
+
+    if (locked)
+    {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+/* Returns the oldest half of a full small object cache size to its pages. */
+static void tcache_drain_objects(size_t class)
+{
+    size_t keep = tcache_limit / 2;
+    void *curr = tcache.objects[class];
+    void *last_kept = NULL;
+    for (size_t i = 0; i < keep && curr; i++)
+    {
+        last_kept = curr;
+        curr = *(void **)curr;
+    }
+
+    if (last_kept)
+    {
+        *(void **)last_kept = NULL;
+    }
+    else
+    {
+        tcache.objects[class] = NULL;
+    }
+    tcache.object_counts[class] = keep < tcache.object_counts[class] ? keep : tcache.object_counts[class];
+
+    free_cached_objects(curr);
+}
+
+/* Returns every chunk and small object in this thread's cache to the heap. */
+void flush_tcache()
+{
+    for (size_t i = 0; i < NUM_SMALL_BINS; i++)
+    {
+        node_t *cached = tcache.entries[i];
+        tcache.entries[i] = NULL;
+        tcache.counts[i] = 0;
+        free_cached_chunks(cached);
+    }
+    for (size_t i = 0; i < NUM_SMALL_CLASSES; i++)
+    {
+        void *cached = tcache.objects[i];
+        tcache.objects[i] = NULL;
+        tcache.object_counts[i] = 0;
+        free_cached_objects(cached);
+    }
+}
+
+/* Returns 1 if an allocated chunk is really sitting in this thread's cache. Walks the cache, so it is meant for audits. */
+int in_tcache(header_t *chunk)
+{
+    size_t index = bin_index(chunk_size(chunk));
+    if (index >= NUM_SMALL_BINS)
+    {
+        return 0;
+    }
+    for (node_t *curr = tcache.entries[index]; curr; curr = curr->next)
+    {
+        if ((header_t *)curr == chunk)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#pragma endregion Thread_Cache
+
+#pragma region Mmapped_Chunks
+
+static size_t page_size()
+{
+    static size_t size;
+    if (!size)
+    {
+        size = sysconf(_SC_PAGESIZE);
+    }
+    return size;
+}
+
+/* A mapped chunk's header may sit part way into its first page if it was aligned */
+static char *mapping_base(header_t *chunk)
+{
+    return (char *)((uintptr_t)chunk & ~(uintptr_t)(page_size() - 1));
+}
+
+static size_t mapping_size(header_t *chunk)
+{
+    uintptr_t end = ((uintptr_t)chunk + chunk_size(chunk) + page_size() - 1) & ~(uintptr_t)(page_size() - 1);
+    return (char *)end - mapping_base(chunk);
+}
+
+/* Gives a chunk of needed_size bytes its own mapping, with the payload aligned to alignment if that is more than ALIGN_TO. */
+static void *mmap_chunk(size_t needed_size, size_t alignment)
+{
+    size_t page = page_size();
+    size_t extra = alignment > ALIGN_TO ? alignment : 0;
+    // The header sits far enough into the first page for the payload after it to be aligned
+    size_t lead = ALIGN_TO - sizeof(header_t);
+    size_t map_size = (lead + needed_size + extra + page - 1) & ~(page - 1);
+
+    char *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        report_error(HEAP_OUT_OF_MEMORY, needed_size);
+        return NULL;
+    }
+
+    header_t *chunk = (header_t *)(base + lead);
+    if (extra)
+    {
+        // Move the header up so the payload is aligned and unmap the whole pages that leaves in front and behind
+        uintptr_t payload = ((uintptr_t)(base + sizeof(header_t)) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        chunk = (header_t *)payload - 1;
+        char *first_page = mapping_base(chunk);
+        char *end = (char *)((uintptr_t)((char *)chunk + needed_size + page - 1) & ~(uintptr_t)(page - 1));
+        if (first_page > base)
+        {
+            munmap(base, first_page - base);
+        }
+        if (end < base + map_size)
+        {
+            munmap(end, base + map_size - end);
+        }
+        map_size = end - first_page;
+    }
+
+    // The chunk gets the rest of the mapping, less whatever doesn't make up a whole ALIGN_TO at the end
+    size_t size = (mapping_base(chunk) + map_size - (char *)chunk) & ~(ALIGN_TO - 1);
+    chunk->size_flags = size | CHUNK_IN_USE | PREV_IN_USE | CHUNK_MMAPPED | CHUNK_ZEROED;
+    SET_MAGIC(chunk, MAGIC_NUMBER);
+
+    __atomic_add_fetch(&mmapped_chunks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mmapped_bytes, map_size, __ATOMIC_RELAXED);
+    thread_mallocs++;
+    return chunk + 1;
+}
+
+/* Hands a mapped chunk back to the OS. Like glibc, a freed mapping raises the threshold so a program that keeps reusing buffers this big gets them from the heap instead. */
+static void munmap_chunk(header_t *chunk)
+{
+    size_t size = chunk_size(chunk);
+    if (mmap_threshold_dynamic && size > mmap_threshold && size <= MMAP_THRESHOLD_MAX)
+    {
+        __atomic_store_n(&mmap_threshold, size, __ATOMIC_RELAXED);
+    }
+
+    size_t map_size = mapping_size(chunk);
+    __atomic_sub_fetch(&mmapped_chunks, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mmapped_bytes, map_size, __ATOMIC_RELAXED);
+    munmap(mapping_base(chunk), map_size);
+}
+
+/* Resizes a mapped chunk with mremap, which can move it without copying. Returns NULL if that isn't possible. */
+static void *remap_chunk(header_t *chunk, size_t needed_size)
+{
+#ifdef __linux__
+    char *base = mapping_base(chunk);
+    size_t lead = (char *)chunk - base;
+    size_t old_size = mapping_size(chunk);
+    size_t new_size = (lead + needed_size + page_size() - 1) & ~(page_size() - 1);
+
+    char *new_base = mremap(base, old_size, new_size, MREMAP_MAYMOVE);
+    if (new_base == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    chunk = (header_t *)(new_base + lead);
+    set_chunk_size(chunk, (new_size - lead) & ~(ALIGN_TO - 1));
+    chunk->size_flags &= ~CHUNK_ZEROED;
+    __atomic_add_fetch(&mmapped_bytes, new_size - old_size, __ATOMIC_RELAXED);
+    return chunk + 1;
+#else
+    return NULL;
+#endif
+}
+
+#pragma endregion Mmapped_Chunks
+
+#ifdef MF_DEBUG
+#pragma region Hardening
+
+static void release(void *ptr);
+
+// Ring of guarded blocks freed most recently, oldest at quarantine_head
+static void *quarantine[QUARANTINE_SLOTS];
+static size_t quarantine_head;
+static size_t quarantine_count;
+static size_t quarantine_bytes;
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *heap_corruption_string(heap_corruption_t problem)
+{
+    switch (problem)
+    {
+    case HEAP_DOUBLE_FREE:
+        return "DOUBLE FREED BLOCK";
+    case HEAP_BAD_MAGIC:
+        return "BLOCK WITH A BAD MAGIC NUMBER";
+    case HEAP_OVERRUN:
+        return "OVERRUN BLOCK";
+    case HEAP_WRITE_AFTER_FREE:
+        return "BLOCK WRITTEN AFTER FREE";
+    }
+    return "UNKNOWN CORRUPTION";
+}
+
+/* Sets the function called after a corrupted block is reported. Returns the previous one. NULL aborts instead. */
+heap_corruption_hook_t set_heap_corruption_hook(heap_corruption_hook_t hook)
+{
+    heap_corruption_hook_t prev_hook = corruption_hook;
+    corruption_hook = hook;
+    return prev_hook;
+}
+
+/* Prints the chunk the same way audit() shows one, then hands it to the corruption hook or aborts. */
+static void report_corruption(heap_corruption_t problem, header_t *chunk)
+{
+    fprintf(stderr, "\x1b[31m");
+    fprintf(stderr, "--------------------\n");
+    fprintf(stderr, "%s\n", heap_corruption_string(problem));
+    fprintf(stderr, "ADDRESS: %" PRId64 "\n", (int64_t)((uint64_t)chunk - start));
+    fprintf(stderr, "SIZE: %zu\n", chunk_size(chunk));
+    fprintf(stderr, "--------------------\n");
+    fprintf(stderr, "\x1b[0m");
+
+    if (!corruption_hook)
+    {
+        abort();
+    }
+    corruption_hook(problem, chunk + 1);
+}
+
+/* Returns how much to ask the heap for so a block of size bytes has room for its canary. */
+static size_t guard_size(size_t size)
+{
+    return guard_blocks && size && size <= MAX_REQUEST_SIZE ? size + CANARY_SIZE : size;
+}
+
+/* Marks a new block as held by the program and, while guarding, fills everything after its size bytes with canary. */
+static void *arm_block(void *ptr, size_t size)
+{
+    if (!ptr || is_small_object(ptr))
+    {
+        return ptr;
+    }
+
+    header_t *chunk = (header_t *)ptr - 1;
+    size_t guarded = 0;
+    if (guard_blocks)
+    {
+        char *canary = (char *)chunk_footer(chunk);
+        memset((char *)ptr + size, CANARY_BYTE, canary - ((char *)ptr + size));
+        *(size_t *)canary = CANARY_VALUE ^ size;
+        guarded = CHUNK_GUARDED;
+    }
+    update_flags(chunk, guarded, CHUNK_FREED | CHUNK_GUARDED);
+    return ptr;
+}
+
+/* Returns 1 if the canary word and the slack in front of it are untouched. */
+static int canary_intact(header_t *chunk)
+{
+    char *canary = (char *)chunk_footer(chunk);
+    size_t size = *(size_t *)canary ^ CANARY_VALUE;
+    if (size > chunk_size(chunk) - sizeof(header_t) - CANARY_SIZE)
+    {
+        return 0;
+    }
+
+    for (unsigned char *byte = (unsigned char *)(chunk + 1) + size; byte < (unsigned char *)canary; byte++)
+    {
+        if (*byte != CANARY_BYTE)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns 1 if nothing has written to a quarantined block since it was poisoned. */
+static int still_poisoned(header_t *chunk)
+{
+    unsigned char *end = (unsigned char *)chunk + chunk_size(chunk);
+    for (unsigned char *byte = (unsigned char *)(chunk + 1); byte < end; byte++)
+    {
+        if (*byte != POISON_BYTE)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns 1 if ptr is a block the program still holds. Otherwise reports what is wrong with it and returns 0. Small objects have no header to check. */
+static int held_block(void *ptr)
+{
+    if (is_small_object(ptr))
+    {
+        return 1;
+    }
+
+    header_t *chunk = (header_t *)ptr - 1;
+    if (!(chunk->size_flags & CHUNK_IN_USE) || (chunk->size_flags & CHUNK_FREED))
+    {
+        report_corruption(HEAP_DOUBLE_FREE, chunk);
+        return 0;
+    }
+    if (chunk->magic != MAGIC_NUMBER)
+    {
+        report_corruption(HEAP_BAD_MAGIC, chunk);
+        return 0;
+    }
+    if ((chunk->size_flags & CHUNK_GUARDED) && !canary_intact(chunk))
+    {
+        report_corruption(HEAP_OVERRUN, chunk);
+        return 0;
+    }
+    return 1;
+}
+
+/* Returns 1 if realloc has to move the block instead of resizing it where it is. */
+static int must_move(header_t *chunk)
+{
+    return guard_blocks || (chunk->size_flags & CHUNK_GUARDED);
+}
+
+/* Releases blocks taken out of the quarantine, unless something wrote to them while they were in it. */
+static void release_quarantined(void **blocks, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        header_t *chunk = (header_t *)blocks[i] - 1;
+        if (!still_poisoned(chunk))
+        {
+            // The program is done with it either way, so it still goes back to the heap if the hook returns
+            report_corruption(HEAP_WRITE_AFTER_FREE, chunk);
+        }
+        release(blocks[i]);
+    }
+}
+
+/* Adds a freed block to the quarantine and releases the oldest ones to keep it within quarantine_limit. Returns 0 if the block is too big to hold. */
+static int quarantine_block(header_t *chunk)
+{
+    size_t size = chunk_size(chunk);
+    if (size > quarantine_limit)
+    {
+        return 0;
+    }
+
+    void *evicted[QUARANTINE_SLOTS];
+    size_t num_evicted = 0;
+
+    pthread_mutex_lock(&quarantine_lock);
+    while (quarantine_count && (quarantine_count == QUARANTINE_SLOTS || quarantine_bytes + size > quarantine_limit))
+    {
+        void *oldest = quarantine[quarantine_head];
+        quarantine_head = (quarantine_head + 1) % QUARANTINE_SLOTS;
+        quarantine_count--;
+        quarantine_bytes -= chunk_size((header_t *)oldest - 1);
+        evicted[num_evicted++] = oldest;
+    }
+    quarantine[(quarantine_head + quarantine_count) % QUARANTINE_SLOTS] = chunk + 1;
+    quarantine_count++;
+    quarantine_bytes += size;
+    pthread_mutex_unlock(&quarantine_lock);
+
+    release_quarantined(evicted, num_evicted);
+    return 1;
+}
+
+/* Releases every block in the quarantine, checking each one for writes after it was freed. */
+void flush_quarantine()
+{
+    void *blocks[QUARANTINE_SLOTS];
+
+    pthread_mutex_lock(&quarantine_lock);
+    size_t count = quarantine_count;
+    for (size_t i = 0; i < count; i++)
+    {
+        blocks[i] = quarantine[(quarantine_head + i) % QUARANTINE_SLOTS];
+    }
+    quarantine_head = 0;
+    quarantine_count = 0;
+    quarantine_bytes = 0;
+    pthread_mutex_unlock(&quarantine_lock);
+
+    release_quarantined(blocks, count);
+}
+
+/* Checks a block the program is freeing and marks it freed. Guarded heap blocks are poisoned and quarantined. Returns 1 if the caller should release it now. */
+static int disarm_block(void *ptr)
+{
+    if (!held_block(ptr))
+    {
+        return 0;
+    }
+    if (is_small_object(ptr))
+    {
+        return 1;
+    }
+
+    header_t *chunk = (header_t *)ptr - 1;
+    update_flags(chunk, CHUNK_FREED, 0);
+
+    // A mapping is gone the moment it is freed, so touching it afterwards faults without any help
+    if (!(chunk->size_flags & CHUNK_GUARDED) || (chunk->size_flags & CHUNK_MMAPPED))
+    {
+        return 1;
+    }
+
+    memset(ptr, POISON_BYTE, chunk_size(chunk) - sizeof(header_t));
+    return !quarantine_block(chunk);
+}
+
+#pragma endregion Hardening
+#endif
+
+#pragma region Profiling
+
+// Mean bytes between samples, 0 while profiling is off
+static size_t sample_interval;
+// What the samples were taken at, kept after profile_stop so they can still be scaled up
+static size_t profile_interval;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static profile_site_t profile_sites[PROFILE_SITES];
+static size_t num_sites;
+static profile_sample_t profile_samples[PROFILE_SAMPLES];
+static size_t live_samples;
+static uint64_t dropped_samples;
+// Bytes this thread can still allocate before its next sample. It is all the allocation path touches while profiling is off
+static __thread int64_t sample_countdown;
+// Set once the countdown was drawn from the interval rather than just set to look again later
+static __thread int sample_armed;
+static __thread uint64_t sample_seed;
+// Set while taking a backtrace, which allocates the first time it loads the unwinder
+static __thread int in_profiler;
+
+/* Draws the bytes until the next sample from an exponential distribution with the interval as its mean, so every byte is equally likely to be sampled whatever the program's allocation pattern. */
+static int64_t next_sample_distance(size_t interval)
+{
+    if (!sample_seed)
+    {
+        sample_seed = ((uintptr_t)&sample_seed ^ trace_now()) | 1;
+    }
+    sample_seed ^= sample_seed >> 12;
+    sample_seed ^= sample_seed << 25;
+    sample_seed ^= sample_seed >> 27;
+
+    // Uniform in (0, 1], never 0 so the log stays finite
+    double uniform = (double)(((sample_seed * 0x2545f4914f6cdd1dULL) >> 11) + 1) / ((uint64_t)1 << 53);
+    double distance = -log(uniform) * interval;
+    return distance < (double)INT64_MAX / 2 ? (int64_t)distance : INT64_MAX / 2;
+}
+
+/* Runs when this thread's countdown goes negative. Returns 1 if the allocation that took it there is to be sampled. */
+static int sample_due()
+{
+    if (in_profiler)
+    {
+        return 0;
+    }
+
+    size_t interval = __atomic_load_n(&sample_interval, __ATOMIC_RELAXED);
+    if (!interval)
+    {
+        sample_countdown = PROFILE_RECHECK_BYTES;
+        sample_armed = 0;
+        return 0;
+    }
+
+    // A countdown that was only a recheck started part way through, so it doesn't count
+    int due = sample_armed;
+    sample_countdown = next_sample_distance(interval);
+    sample_armed = 1;
+    return due;
+}
+
+/* Counts an allocation of size bytes against this thread's countdown. With profiling off this is one decrement and a branch that is almost never taken. */
+static inline int take_sample(size_t size)
+{
+    return __builtin_expect((sample_countdown -= (int64_t)size) < 0, 0) && sample_due();
+}
+
+static size_t sample_home(void *ptr)
+{
+    return (((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL >> 32) & (PROFILE_SAMPLES - 1);
+}
+
+/* Returns the site for a call stack, adding it if it is new. Returns NULL if the table is full. The caller must hold profile_lock. */
+static profile_site_t *find_site(void **stack, size_t depth)
+{
+    uint64_t hash = depth;
+    for (size_t i = 0; i < depth; i++)
+    {
+        hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001b3ULL;
+    }
+
+    for (size_t slot = hash & (PROFILE_SITES - 1);; slot = (slot + 1) & (PROFILE_SITES - 1))
+    {
+        profile_site_t *site = &profile_sites[slot];
+        // Sites are only ever emptied all at once by profile_start
+        if (!site->total_count)
+        {
+            if (num_sites >= PROFILE_SITES / 4 * 3)
+            {
+                return NULL;
+            }
+            memcpy(site->stack, stack, depth * sizeof(void *));
+            site->depth = depth;
+            num_sites++;
+            return site;
+        }
+        if (site->depth == depth && !memcmp(site->stack, stack, depth * sizeof(void *)))
+        {
+            return site;
+        }
+    }
+}
+
+/* Takes a backtrace for a sampled allocation of size bytes at ptr and flags its chunk so freeing it drops the sample. */
+static __attribute__((noinline)) void record_sample(void *ptr, size_t size)
+{
+    void *stack[PROFILE_DEPTH + PROFILE_SKIP_FRAMES];
+    in_profiler = 1;
+    int frames = backtrace(stack, PROFILE_DEPTH + PROFILE_SKIP_FRAMES);
+    in_profiler = 0;
+    size_t depth = frames > PROFILE_SKIP_FRAMES ? frames - PROFILE_SKIP_FRAMES : 0;
+
+    pthread_mutex_lock(&profile_lock);
+    profile_site_t *site = live_samples < PROFILE_SAMPLES / 4 * 3 ? find_site(stack + PROFILE_SKIP_FRAMES, depth) : NULL;
+    if (!site)
+    {
+        dropped_samples++;
+        pthread_mutex_unlock(&profile_lock);
+        return;
+    }
+
+    site->total_count++;
+    site->total_bytes += size;
+    site->live_count++;
+    site->live_bytes += size;
+
+    size_t slot = sample_home(ptr);
+    while (profile_samples[slot].ptr)
+    {
+        slot = (slot + 1) & (PROFILE_SAMPLES - 1);
+    }
+    profile_samples[slot] = (profile_sample_t){ptr, size, site - profile_sites};
+    live_samples++;
+    pthread_mutex_unlock(&profile_lock);
+
+    update_flags((header_t *)ptr - 1, CHUNK_SAMPLED, 0);
+}
+
+/* Drops the sample of a chunk that is being freed. It may be gone already if profile_start cleared the tables since. */
+static void forget_sample(header_t *chunk)
+{
+    void *ptr = chunk + 1;
+    pthread_mutex_lock(&profile_lock);
+
+    size_t slot = sample_home(ptr);
+    while (profile_samples[slot].ptr && profile_samples[slot].ptr != ptr)
+    {
+        slot = (slot + 1) & (PROFILE_SAMPLES - 1);
+    }
+    if (profile_samples[slot].ptr)
+    {
+        profile_site_t *site = &profile_sites[profile_samples[slot].site];
+        site->live_count--;
+        site->live_bytes -= profile_samples[slot].size;
+        live_samples--;
+
+        // Shift later samples back into the hole unless that would put one before its home slot
+        size_t hole = slot;
+        for (size_t next = (hole + 1) & (PROFILE_SAMPLES - 1); profile_samples[next].ptr; next = (next + 1) & (PROFILE_SAMPLES - 1))
+        {
+            size_t home = sample_home(profile_samples[next].ptr);
+            if (((next - home) & (PROFILE_SAMPLES - 1)) >= ((next - hole) & (PROFILE_SAMPLES - 1)))
+            {
+                profile_samples[hole] = profile_samples[next];
+                hole = next;
+            }
+        }
+        profile_samples[hole].ptr = NULL;
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+    update_flags(chunk, 0, CHUNK_SAMPLED);
+}
+
+/* Starts sampling one allocation in about every interval bytes, throwing away any samples from before. Returns 0 or -1 with errno set. */
+int profile_start(size_t interval)
+{
+    if (!interval)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Get the unwinder loaded now rather than in the middle of the first sample
+    void *frame;
+    in_profiler = 1;
+    backtrace(&frame, 1);
+    in_profiler = 0;
+
+    pthread_mutex_lock(&profile_lock);
+    memset(profile_sites, 0, sizeof(profile_sites));
+    memset(profile_samples, 0, sizeof(profile_samples));
+    num_sites = 0;
+    live_samples = 0;
+    dropped_samples = 0;
+    profile_interval = interval;
+    __atomic_store_n(&sample_interval, interval, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&profile_lock);
+
+    // This thread starts straight away, the others the next time their countdown runs out
+    sample_countdown = next_sample_distance(interval);
+    sample_armed = 1;
+    return 0;
+}
+
+/* Stops taking new samples. The ones already taken stay until they are freed or profile_start runs again. */
+void profile_stop()
+{
+    __atomic_store_n(&sample_interval, 0, __ATOMIC_RELAXED);
+}
+
+profile_info_t profile_info()
+{
+    profile_info_t info = {0};
+    pthread_mutex_lock(&profile_lock);
+    info.interval = profile_interval;
+    info.running = sample_interval != 0;
+    info.sites = num_sites;
+    info.live_samples = live_samples;
+    info.dropped = dropped_samples;
+    for (size_t i = 0; i < PROFILE_SITES; i++)
+    {
+        info.samples += profile_sites[i].total_count;
+        info.sampled_bytes += profile_sites[i].total_bytes;
+        info.live_bytes += profile_sites[i].live_bytes;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    return info;
+}
+
+/* Scales sampled bytes up to an estimate of all the bytes allocated at a site. An allocation of n bytes is sampled with probability 1 - exp(-n / interval). */
+static uint64_t unsample(uint64_t count, uint64_t bytes, size_t interval)
+{
+    if (!count)
+    {
+        return 0;
+    }
+    double average = (double)bytes / count;
+    return (uint64_t)(bytes / (1 - exp(-average / interval)));
+}
+
+static int write_all(int fd, const char *buffer, size_t length)
+{
+    while (length)
+    {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/* Writes the function a return address is in if the dynamic symbol table has it, otherwise the file and offset for addr2line. */
+static int frame_name(char *buffer, size_t size, void *addr)
+{
+    Dl_info info;
+    if (!dladdr(addr, &info))
+    {
+        return snprintf(buffer, size, "0x%" PRIxPTR, (uintptr_t)addr);
+    }
+    if (info.dli_sname)
+    {
+        return snprintf(buffer, size, "%s", info.dli_sname);
+    }
+    const char *file = strrchr(info.dli_fname, '/');
+    return snprintf(buffer, size, "%s+0x%tx", file ? file + 1 : info.dli_fname, (char *)addr - (char *)info.dli_fbase);
+}
+
+/* Copies /proc/self/maps after the samples so pprof can tell which file each address is in. */
+static int write_mappings(int fd)
+{
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps < 0)
+    {
+        return -1;
+    }
+
+    char buffer[4096];
+    ssize_t length;
+    int result = write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+    while (!result && (length = read(maps, buffer, sizeof(buffer))) > 0)
+    {
+        result = write_all(fd, buffer, length);
+    }
+    close(maps);
+    return result;
+}
+
+/* Writes the profile to fd in the format asked for. Returns 0 or -1 with errno set. */
+int profile_write(int fd, profile_format_t format)
+{
+    // Formatting and writing never allocate, so the program's own allocations can't change the tables under this
+    char line[8192];
+    int result = 0;
+    pthread_mutex_lock(&profile_lock);
+
+    if (format == PROFILE_PPROF)
+    {
+        uint64_t totals[4] = {0};
+        for (size_t i = 0; i < PROFILE_SITES; i++)
+        {
+            totals[0] += profile_sites[i].live_count;
+            totals[1] += profile_sites[i].live_bytes;
+            totals[2] += profile_sites[i].total_count;
+            totals[3] += profile_sites[i].total_bytes;
+        }
+        // pprof scales the samples up itself from the interval in the header
+        int length = snprintf(line, sizeof(line), "heap profile: %6" PRIu64 ": %8" PRIu64 " [%6" PRIu64 ": %8" PRIu64 "] @ heap_v2/%zu\n",
+                              totals[0], totals[1], totals[2], totals[3], profile_interval);
+        result = write_all(fd, line, length);
+    }
+
+    for (size_t i = 0; i < PROFILE_SITES && !result; i++)
+    {
+        profile_site_t *site = &profile_sites[i];
+        if (!site->total_count || (format == PROFILE_FOLDED_LIVE && !site->live_count))
+        {
+            continue;
+        }
+
+        size_t length = 0;
+        if (format == PROFILE_PPROF)
+        {
+            length = snprintf(line, sizeof(line), "%6" PRIu64 ": %8" PRIu64 " [%6" PRIu64 ": %8" PRIu64 "] @",
+                              site->live_count, site->live_bytes, site->total_count, site->total_bytes);
+            for (size_t j = 0; j < site->depth; j++)
+            {
+                length += snprintf(line + length, sizeof(line) - length, " 0x%" PRIxPTR, (uintptr_t)site->stack[j]);
+            }
+            line[length++] = '\n';
+        }
+        else
+        {
+            // Outermost frame first, as many as fit with room left for the byte count
+            for (size_t j = site->depth; j > 0; j--)
+            {
+                char frame[256];
+                int frame_length = frame_name(frame, sizeof(frame), site->stack[j - 1]);
+                if (frame_length < 0 || (size_t)frame_length >= sizeof(frame) || length + frame_length + 32 > sizeof(line))
+                {
+                    break;
+                }
+                if (length)
+                {
+                    line[length++] = ';';
+                }
+                memcpy(line + length, frame, frame_length);
+                length += frame_length;
+            }
+            if (!length)
+            {
+                length = snprintf(line, sizeof(line), "[unknown]");
+            }
+
+            uint64_t bytes = format == PROFILE_FOLDED ? unsample(site->total_count, site->total_bytes, profile_interval)
+                                                      : unsample(site->live_count, site->live_bytes, profile_interval);
+            length += snprintf(line + length, sizeof(line) - length, " %" PRIu64 "\n", bytes);
+        }
+        result = write_all(fd, line, length);
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+    if (!result && format == PROFILE_PPROF)
+    {
+        result = write_mappings(fd);
+    }
+    return result;
+}
+
+#pragma endregion Profiling
+
+/* Takes the locks the heap holds outside its arenas, so fork can't copy one some other thread is holding. None of them
+   is ever held while waiting for an arena, so they are safe to take before the arenas' locks. */
+void lock_heap_globals()
+{
+    pthread_mutex_lock(&trace_lock);
+    pthread_mutex_lock(&profile_lock);
+#ifdef MF_DEBUG
+    pthread_mutex_lock(&quarantine_lock);
+#endif
+}
+
+void unlock_heap_globals()
+{
+#ifdef MF_DEBUG
+    pthread_mutex_unlock(&quarantine_lock);
+#endif
+    pthread_mutex_unlock(&profile_lock);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Returns a small object, from this thread's cache if it can. Returns NULL once the zone is used up. */
+static void *small_malloc(size_t class)
+{
+    if (tcache_limit)
+    {
+        if (!tcache.objects[class])
+        {
+            tcache_fill_objects(class);
+        }
+
+        void *obj = tcache_pop_object(class);
+        thread_mallocs += obj != NULL;
+        return obj;
+    }
+
+    arena_t *arena = get_thread_arena();
+    pthread_mutex_lock(&arena->lock);
+    void *obj = take_small_object(arena, class);
+    thread_mallocs += obj != NULL;
+    merge_thread_counts(arena);
+    pthread_mutex_unlock(&arena->lock);
+    return obj;
+}
+
+/* Returns a small object to this thread's cache, or straight to its page if the caches are off. */
+static void small_free(void *ptr)
+{
+    small_page_t *page = small_page(ptr);
+    size_t class = page->size / ALIGN_TO - 1;
+    thread_frees++;
+
+    if (tcache_limit)
+    {
+        if (tcache.object_counts[class] >= tcache_limit)
+        {
+            tcache_drain_objects(class);
+        }
+        tcache_push_object(ptr, class);
+        return;
+    }
+
+    arena_t *arena = &arenas[page->arena];
+    pthread_mutex_lock(&arena->lock);
+    give_small_object(arena, ptr);
+    merge_thread_counts(arena);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/* Adds an allocation of size bytes to this thread's totals of bytes asked for and bytes handed out, headers included. */
+static void *count_bytes(void *ptr, size_t size)
+{
+    if (ptr)
+    {
+        thread_requested += size;
+        thread_granted += is_small_object(ptr) ? small_page(ptr)->size : chunk_size((header_t *)ptr - 1);
+    }
+    return ptr;
+}
+
+static void *allocate_chunk(size_t size);
+
+/* my_malloc without tracing, so the other entry points can record themselves as one call. */
+static void *allocate(size_t size)
+{
+    // If they enter a negative number the size will overflow to a huge number so this will fire
+    if (size > MAX_REQUEST_SIZE)
+    {
+        report_error(HEAP_SIZE_TOO_LARGE, size);
+        return NULL;
+    }
+    // Not sure if this is supposed to happen but it makes sense to deny a request of size 0
+    else if (size == 0)
+    {
+        report_error(HEAP_ZERO_SIZE, size);
+        return NULL;
+    }
+
+    // Small requests get an object with no header, unless there are no pages left to put it in or it needs a canary
+    if (size <= small_object_limit && size <= SMALL_OBJECT_LIMIT && small_zone && !GUARDING)
+    {
+        void *obj = small_malloc((size - 1) / ALIGN_TO);
+        if (obj)
+        {
+            return count_bytes(obj, size);
+        }
+    }
+
+    return allocate_chunk(size);
+}
+
+/* allocate for a size already known to be valid, always with a chunk and its header rather than a small object. */
+static void *allocate_chunk(size_t size)
+{
+    size_t needed_size = align(size);
+    if (needed_size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+    {
+        return count_bytes(mmap_chunk(needed_size, 0), size);
+    }
+    size_t index = bin_index(needed_size);
+
+    // Small chunks come out of this thread's cache without taking a lock
+    if (index < NUM_SMALL_BINS && tcache_limit)
+    {
+        if (!tcache.entries[index])
+        {
+            tcache_fill(index, needed_size);
+        }
+
+        header_t *cached = tcache_pop(index);
+        if (cached)
+        {
+            thread_mallocs++;
+            return count_bytes(cached + 1, size);
+        }
+    }
+
+    arena_t *arena = get_thread_arena();
+    pthread_mutex_lock(&arena->lock);
+    void *ptr = count_bytes(heap_malloc(arena, needed_size), size);
+    thread_mallocs += ptr != NULL;
+    merge_thread_counts(arena);
+    pthread_mutex_unlock(&arena->lock);
+
+    return ptr;
+}
+
+/* allocate for a block the profiler is going to sample. It gets a header even if it is small, so the CHUNK_SAMPLED flag has somewhere to go. */
+static void *allocate_sampled(size_t size)
+{
+    return size && size <= MAX_REQUEST_SIZE ? allocate_chunk(size) : allocate(size);
+}
+
+/* Frees the allocated chunk starting at the pointer passed in. Small chunks go to this thread's cache, anything else back to its arena. */
+static void release(void *ptr)
+{
+    // Small objects have no header to look at, their address alone says what they are
+    if (is_small_object(ptr))
+    {
+        small_free(ptr);
+        return;
+    }
+
+    header_t *hptr = (header_t *)ptr - 1;
+    CHECK_MAGIC(hptr);
+
+    if (hptr->size_flags & CHUNK_SAMPLED)
+    {
+        forget_sample(hptr);
+    }
+
+    // Whatever the program wrote means it can't count as fresh memory any more. Only the chunk's owner sets or
+    // reads the bit, so it can be tested without the lock, but clearing it rewrites the word PREV_IN_USE is in
+    if (hptr->size_flags & CHUNK_ZEROED)
+    {
+        update_flags(hptr, 0, CHUNK_ZEROED);
+    }
+    thread_frees++;
+
+    if (hptr->size_flags & CHUNK_MMAPPED)
+    {
+        munmap_chunk(hptr);
+        return;
+    }
+
+    // Any thread can free a chunk, it always goes back to the arena it came from
+    size_t index = bin_index(chunk_size(hptr));
+    if (index < NUM_SMALL_BINS && tcache_limit)
+    {
+        if (tcache.counts[index] >= tcache_limit)
+        {
+            tcache_drain(index);
+        }
+        tcache_push(hptr, index);
+        return;
+    }
+
+    // Don't fight the arena's own threads for its lock, let them pick it up on their next allocation
+    arena_t *arena = chunk_arena(hptr);
+    if (arena != get_thread_arena())
+    {
+        push_remote_free(arena, hptr);
+        return;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    if (coalesce_batch)
+    {
+        defer_free(arena, hptr);
+    }
+    else
+    {
+        heap_free(arena, hptr);
+    }
+    merge_thread_counts(arena);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/* Returns pointer to memory. Returns NULL if there is not enough space. */
+void *my_malloc(size_t size)
+{
+    int sampled = take_sample(size);
+    void *ptr = arm_block(sampled ? allocate_sampled(guard_size(size)) : allocate(guard_size(size)), size);
+    if (sampled && ptr)
+    {
+        record_sample(ptr, size);
+    }
+    if (ptr && is_tracing())
+    {
+        trace_call(TRACE_MALLOC, ptr, 0, size);
+    }
+    return ptr;
+}
+
+void my_free(void *ptr)
+{
+    if (is_tracing())
+    {
+        trace_call(TRACE_FREE, ptr, 0, 0);
+    }
+    if (disarm_block(ptr))
+    {
+        release(ptr);
+    }
+}
+
+#pragma region Resizing
+
+/* Cuts an allocated chunk down to needed_size bytes and frees the rest if it is big enough to be a chunk. The caller must hold the arena's lock. */
+static void shrink_chunk(arena_t *arena, header_t *chunk, size_t needed_size)
+{
+    size_t size = chunk_size(chunk);
+    if (size - needed_size < MIN_CHUNK_SIZE)
+    {
+        return;
+    }
+
+    header_t *tail = (header_t *)((char *)chunk + needed_size);
+    tail->size_flags = (size - needed_size) | CHUNK_IN_USE | PREV_IN_USE | (chunk->size_flags & ARENA_MASK);
+    SET_MAGIC(tail, MAGIC_NUMBER);
+    set_chunk_size(chunk, needed_size);
+
+    heap_free(arena, tail);
+}
+
+/* Grows an allocated chunk to needed_size bytes by absorbing the free chunk after it. Returns 0 if that isn't possible. The caller must hold the arena's lock. */
+static int grow_chunk_in_place(arena_t *arena, header_t *chunk, size_t needed_size)
+{
+    header_t *next = next_chunk(chunk);
+    size_t size = chunk_size(chunk);
+    if ((next->size_flags & CHUNK_IN_USE) || size + chunk_size(next) < needed_size)
+    {
+        return 0;
+    }
+
+    remove_from_bin(arena, (node_t *)next);
+    set_chunk_size(chunk, size + chunk_size(next));
+    next_chunk(chunk)->size_flags |= PREV_IN_USE;
+    arena->layout_changes++;
+
+    // Give back whatever wasn't needed
+    shrink_chunk(arena, chunk, needed_size);
+    return 1;
+}
+
+/* Shrinks a heap chunk, or grows it into a free neighbour, without moving it. Returns 0 if it has to move. */
+static int resize_in_place(header_t *hptr, size_t needed_size)
+{
+    arena_t *arena = chunk_arena(hptr);
+
+    // Shrinking or growing into a free neighbour never moves the data
+    pthread_mutex_lock(&arena->lock);
+    hptr->size_flags &= ~CHUNK_ZEROED;
+    int resized = 1;
+    if (needed_size <= chunk_size(hptr))
+    {
+        shrink_chunk(arena, hptr, needed_size);
+    }
+    else
+    {
+        resized = grow_chunk_in_place(arena, hptr, needed_size);
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    return resized;
+}
+
+/* Resizes an allocation, in place if it can, otherwise by moving it. Returns NULL and leaves ptr alone if there isn't room. */
+void *my_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+    {
+        return my_malloc(size);
+    }
+    if (size == 0)
+    {
+        my_free(ptr);
+        return NULL;
+    }
+    if (size > MAX_REQUEST_SIZE)
+    {
+        report_error(HEAP_SIZE_TOO_LARGE, size);
+        return NULL;
+    }
+
+    if (!held_block(ptr))
+    {
+        return NULL;
+    }
+
+    size_t old_size = my_malloc_usable_size(ptr);
+    void *new_ptr = NULL;
+    if (is_small_object(ptr))
+    {
+        // Small objects never grow in place, but one that is shrinking can stay where it is
+        new_ptr = size <= old_size ? ptr : NULL;
+    }
+    else
+    {
+        header_t *hptr = (header_t *)ptr - 1;
+        CHECK_MAGIC(hptr);
+
+        size_t needed_size = align(size);
+        if (must_move(hptr))
+        {
+            // Guarded blocks always move so the old copy gets poisoned and quarantined
+            new_ptr = NULL;
+        }
+        else if (hptr->size_flags & CHUNK_MMAPPED)
+        {
+            // Mappings stay mappings while they're over the threshold, otherwise they move into the heap below.
+            // Sampled ones are copied instead, since mremap could move them out from under their sample
+            if (needed_size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) && !(hptr->size_flags & CHUNK_SAMPLED))
+            {
+                new_ptr = remap_chunk(hptr, needed_size);
+            }
+        }
+        else
+        {
+            new_ptr = resize_in_place(hptr, needed_size) ? ptr : NULL;
+        }
+    }
+
+    if (!new_ptr)
+    {
+        // Copying is the last resort
+        int sampled = take_sample(size);
+        new_ptr = arm_block(sampled ? allocate_sampled(guard_size(size)) : allocate(guard_size(size)), size);
+        if (!new_ptr)
+        {
+            return NULL;
+        }
+        if (sampled)
+        {
+            record_sample(new_ptr, size);
+        }
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        if (disarm_block(ptr))
+        {
+            release(ptr);
+        }
+    }
+
+    if (is_tracing())
+    {
+        trace_call(TRACE_REALLOC, new_ptr, (int64_t)((uint64_t)ptr - start), size);
+    }
+    return new_ptr;
+}
+
+/* Returns how many bytes the allocation at ptr can hold, which may be more than was asked for. */
+size_t my_malloc_usable_size(void *ptr)
+{
+    if (is_small_object(ptr))
+    {
+        return small_page(ptr)->size;
+    }
+    header_t *hptr = (header_t *)ptr - 1;
+#ifdef MF_DEBUG
+    // Anything past what was asked for is canary, so none of it is usable
+    if (hptr->size_flags & CHUNK_GUARDED)
+    {
+        return *chunk_footer(hptr) ^ CANARY_VALUE;
+    }
+#endif
+    return chunk_size(hptr) - sizeof(header_t);
+}
+
+/* Returns memory for count objects of size bytes, all set to zero. */
+void *my_calloc(size_t count, size_t size)
+{
+    if (size && count > MAX_REQUEST_SIZE / size)
+    {
+        report_error(HEAP_SIZE_TOO_LARGE, count * size);
+        return NULL;
+    }
+
+    int sampled = take_sample(count * size);
+    void *ptr = sampled ? allocate_sampled(guard_size(count * size)) : allocate(guard_size(count * size));
+    if (!ptr)
+    {
+        return NULL;
+    }
+    if (is_tracing())
+    {
+        trace_call(TRACE_CALLOC, ptr, 0, count * size);
+    }
+
+    if (is_small_object(ptr))
+    {
+        memset(ptr, 0, small_page(ptr)->size);
+        return arm_block(ptr, count * size);
+    }
+
+    header_t *hptr = (header_t *)ptr - 1;
+    size_t payload = chunk_size(hptr) - sizeof(header_t);
+    if (hptr->size_flags & CHUNK_ZEROED)
+    {
+        // Still untouched since mmap apart from the free list and free tree links and maybe a footer
+        size_t links = sizeof(tree_node_t) - sizeof(header_t);
+        memset(ptr, 0, links < payload ? links : payload);
+        *chunk_footer(hptr) = 0;
+        update_flags(hptr, 0, CHUNK_ZEROED);
+    }
+    else
+    {
+        memset(ptr, 0, payload);
+    }
+
+    ptr = arm_block(ptr, count * size);
+    if (sampled)
+    {
+        record_sample(ptr, count * size);
+    }
+    return ptr;
 }
 
-void coalesce()
+/* Returns size bytes starting at a multiple of alignment, which has to be a power of two. */
+void *my_aligned_alloc(size_t alignment, size_t size)
 {
-    node_t *curr = start_of_free_list;
-    while (curr)
+    if (!alignment || (alignment & (alignment - 1)))
+    {
+        report_error(HEAP_BAD_ALIGNMENT, size);
+        return NULL;
+    }
+    if (alignment <= ALIGN_TO || size == 0)
+    {
+        return my_malloc(size);
+    }
+    if (size > MAX_REQUEST_SIZE)
+    {
+        report_error(HEAP_SIZE_TOO_LARGE, size);
+        return NULL;
+    }
+
+    // Ask for enough that an aligned address fits with room for a whole chunk in front of it, canary included
+    size_t padded_size = guard_size(size) + alignment + MIN_CHUNK_SIZE;
+    void *ptr = NULL;
+    if (align(padded_size) < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
     {
-        if ((uint64_t)curr + sizeof(node_t) + curr->size == (uint64_t)curr->next)
+        ptr = allocate(padded_size);
+        if (!ptr)
         {
-            // next item in heap = free block
-            node_t *temp = curr->next;
+            return NULL;
+        }
 
-            curr->next = temp->next;
-            curr->size = curr->size + temp->size + sizeof(node_t);
+        // A mapping has no neighbours to split the slack off into. One only comes back if the threshold was lowered since
+        if (!is_small_object(ptr) && (((header_t *)ptr - 1)->size_flags & CHUNK_MMAPPED))
+        {
+            release(ptr);
+            ptr = NULL;
         }
-        // Skip to next node_t if we didn't merge anything
-        else
+    }
+
+    // Big enough for its own mapping, which can be aligned without splitting anything off
+    if (!ptr)
+    {
+        ptr = arm_block(mmap_chunk(align(guard_size(size)), alignment), size);
+        if (ptr && is_tracing())
+        {
+            trace_call(TRACE_ALIGNED, ptr, alignment, size);
+        }
+        return ptr;
+    }
+
+    if (!((uintptr_t)ptr & (alignment - 1)))
+    {
+        if (is_tracing())
         {
-            curr = curr->next;
+            trace_call(TRACE_ALIGNED, ptr, alignment, size);
         }
+        return arm_block(ptr, size);
     }
+
+    header_t *hptr = (header_t *)ptr - 1;
+    arena_t *arena = chunk_arena(hptr);
+    uintptr_t aligned = ((uintptr_t)ptr + MIN_CHUNK_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    header_t *aligned_header = (header_t *)aligned - 1;
+
+    pthread_mutex_lock(&arena->lock);
+
+    // Split off the space in front as a chunk of its own and free it
+    size_t lead_size = (char *)aligned_header - (char *)hptr;
+    aligned_header->size_flags = (chunk_size(hptr) - lead_size) | CHUNK_IN_USE | PREV_IN_USE | (hptr->size_flags & ARENA_MASK);
+    SET_MAGIC(aligned_header, MAGIC_NUMBER);
+    set_chunk_size(hptr, lead_size);
+    heap_free(arena, hptr);
+
+    // Then give back whatever is left over after it
+    shrink_chunk(arena, aligned_header, align(guard_size(size)));
+
+    pthread_mutex_unlock(&arena->lock);
+
+    if (is_tracing())
+    {
+        trace_call(TRACE_ALIGNED, (void *)aligned, alignment, size);
+    }
+    return arm_block((void *)aligned, size);
 }
 
-/* Returns pointer to memory. Returns NULL if there is not enough space. */
-void *my_malloc(size_t size)
+/* Same as my_aligned_alloc but POSIX flavoured. Returns 0 or an errno value. */
+int my_posix_memalign(void **memptr, size_t alignment, size_t size)
 {
-    // If there are no free chunks
-    if (!start_of_free_list)
+    if (!alignment || alignment % sizeof(void *) || (alignment & (alignment - 1)))
     {
-        printf("There are no free chunks!\n");
-        return NULL;
+        return EINVAL;
+    }
+
+    void *ptr = my_aligned_alloc(alignment, size);
+    if (!ptr)
+    {
+        return ENOMEM;
+    }
+
+    *memptr = ptr;
+    return 0;
+}
+
+#pragma endregion Resizing
+
+/* Maps a new region. With huge pages on it is rounded up to whole huge pages and aligned to them so the kernel can back it with huge pages, and region_size is updated to match. */
+static void *map_region(size_t *region_size)
+{
+#ifdef __linux__
+    if (huge_pages != HUGE_PAGES_OFF)
+    {
+        size_t size = (*region_size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+        if (huge_pages == HUGE_PAGES_HUGETLB)
+        {
+            void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+            if (base != MAP_FAILED)
+            {
+                *region_size = size;
+                return base;
+            }
+            // Nothing reserved in the huge page pool, so fall back to transparent huge pages
+        }
+#endif
+
+        // Over-map by one huge page and cut off whatever sticks out either side of the aligned part
+        char *base = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            return MAP_FAILED;
+        }
+        char *aligned = (char *)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (aligned > base)
+        {
+            munmap(base, aligned - base);
+        }
+        if (base + HUGE_PAGE_SIZE > aligned)
+        {
+            munmap(aligned + size, base + HUGE_PAGE_SIZE - aligned);
+        }
+
+#ifdef MADV_HUGEPAGE
+        madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+        *region_size = size;
+        return aligned;
     }
+#endif
+
+    return mmap(NULL, *region_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+}
+
+/* Sets up a fresh region as one free chunk followed by a fencepost. Returns the free chunk. */
+static node_t *init_region(arena_t *arena, region_t *region)
+{
+    size_t arena_bits = arena->index << ARENA_SHIFT;
+    node_t *chunk = (node_t *)first_chunk(region);
+    // The gap in front of the first chunk and the fencepost header after the last make up ALIGN_TO bytes between them.
+    // mmap hands out zeroed pages, which my_calloc can use without clearing them again
+    chunk->size_flags = (region->size - ALIGN_TO) | PREV_IN_USE | CHUNK_ZEROED | arena_bits;
+
+    // The fencepost is an empty allocated chunk that stops coalescing running off the end
+    header_t *fencepost = next_chunk((header_t *)chunk);
+    fencepost->size_flags = CHUNK_IN_USE | arena_bits;
+    SET_MAGIC(fencepost, MAGIC_NUMBER);
+
+    mark_free(chunk);
+    add_to_bin(arena, chunk);
+    return chunk;
+}
 
-    // If they enter a negative number the size will overflow to the max integer so this will fire
-    if (size > SIZE_OF_HEAP)
+/* Maps a new region for an arena big enough for needed_size. Returns its free chunk or NULL. The caller must hold the arena's lock. */
+node_t *grow_heap(arena_t *arena, size_t needed_size)
+{
+    if (arena->num_regions == MAX_REGIONS)
     {
-        printf("REQUESTED SIZE EXCEEDS HEAP SIZE\n");
-        printf("Did you try to allocate a negative size?\n");
         return NULL;
     }
-    // Not sure if this is supposed to happen but it makes sense to deny a request of size 0
-    else if (size == 0)
+
+    // Round up to whole pages so the mapping isn't wasted, leaving room for the fencepost and the gap in front of the first chunk
+    size_t region_size = arena->next_region_size;
+    if (needed_size + ALIGN_TO > region_size)
+    {
+        region_size = SIZE_OF_HEAP * ((needed_size + ALIGN_TO + SIZE_OF_HEAP - 1) / SIZE_OF_HEAP);
+    }
+
+    void *base = map_region(&region_size);
+    if (base == MAP_FAILED)
     {
-        printf("REFUSING TO ALLOCATE SIZE 0\n");
         return NULL;
     }
+    arena->next_region_size = 2 * region_size;
 
-    size_t needed_size = align(size);
+    // Keep the regions sorted by address so walking them goes through the heap in order
+    size_t i = arena->num_regions;
+    while (i > 0 && arena->regions[i - 1].base > base)
+    {
+        arena->regions[i] = arena->regions[i - 1];
+        i--;
+    }
+    arena->regions[i].base = base;
+    arena->regions[i].size = region_size;
+    arena->num_regions++;
 
-    // WORST FIT
-    // Search for biggest chunk for worst fit
-    node_t *curr = start_of_free_list;
-    node_t *biggest_chunk_prev = curr;
-    node_t *biggest_chunk = curr;
-    while (curr)
+    return init_region(arena, &arena->regions[i]);
+}
+
+static void forget_failures();
+
+/* Hands back every region of a heap that is being set up again, and empties the small pages and this thread's caches so nothing from it can be handed out later. Other threads' caches can't be reached, so no other thread may be using the heap. */
+static void release_heap()
+{
+#ifdef MF_DEBUG
+    flush_quarantine();
+#endif
+    flush_tcache();
+    thread_mallocs = 0;
+    thread_frees = 0;
+    thread_requested = 0;
+    thread_granted = 0;
+
+    for (size_t i = 0; i < num_arenas; i++)
     {
-        if (curr->next && curr->next->size > biggest_chunk->size)
+        for (size_t j = 0; j < arenas[i].num_regions; j++)
         {
-            biggest_chunk_prev = curr;
-            biggest_chunk = curr->next;
+            munmap(arenas[i].regions[j].base, arenas[i].regions[j].size);
         }
-        curr = curr->next;
     }
 
-    // If there is no chunk big enough return NULL
-    if (needed_size > biggest_chunk->size + sizeof(node_t))
+    // The zone stays reserved, but its pages go back so they come out zeroed when they are handed out again
+    if (small_zone && small_zone_used)
     {
-        printf("NO CHUNK BIG ENOUGH\n");
-        return NULL;
+        madvise(small_zone, small_zone_used, MADV_DONTNEED);
     }
+    small_zone_used = 0;
+}
 
-    size_t prev_size = biggest_chunk->size;
-    node_t *prev_next = biggest_chunk->next;
+/* Sets up the heap with count arenas, or ARENAS_PER_CPU for every CPU if count is 0. Called again, it throws the old heap away first. */
+void init_heap_with_arenas(size_t count)
+{
+    if (start_of_heap)
+    {
+        release_heap();
+    }
 
-    // Split free chunk
-    // If the chunk to be split is the head
-    if (biggest_chunk == start_of_free_list)
+    if (!count)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = ARENAS_PER_CPU * (cpus > 0 ? (size_t)cpus : 1);
+    }
+    num_arenas = count < MAX_ARENAS ? count : MAX_ARENAS;
+
+    // The thread setting up the heap gets the first arena
+    thread_arena = &arenas[0];
+    next_arena = 1;
+
+    for (size_t i = 0; i < num_arenas; i++)
     {
-        // If the needed size requires the overhead space too
-        if (needed_size > biggest_chunk->size)
+        arena_t *arena = &arenas[i];
+        pthread_mutex_init(&arena->lock, NULL);
+        arena->index = i;
+        arena->num_regions = 0;
+        arena->remote_frees = NULL;
+        arena->pending = NULL;
+        arena->num_pending = 0;
+        arena->free_tree = NULL;
+        arena->rover = NULL;
+        arena->free_bytes = 0;
+        arena->num_free = 0;
+        arena->empty_pages = NULL;
+        arena->num_small_pages = 0;
+        arena->small_object_bytes = 0;
+        arena->mallocs = 0;
+        arena->frees = 0;
+        arena->requested_bytes = 0;
+        arena->granted_bytes = 0;
+        arena->layout_changes = 0;
+        arena->policy = policy;
+        arena->indexed = placements[policy].tree;
+        arena->dirty = 0;
+        arena->last_free_tick = 0;
+        arena->next_region_size = 2 * SIZE_OF_HEAP;
+        for (size_t j = 0; j < NUM_BINS; j++)
         {
-            start_of_free_list = biggest_chunk->next;
+            arena->bins[j] = NULL;
         }
-        else
+        for (size_t j = 0; j < NUM_BINS / 64; j++)
         {
-            start_of_free_list = (node_t *)((char *)biggest_chunk + needed_size);
-            start_of_free_list->size = prev_size - needed_size;
-            start_of_free_list->next = prev_next;
+            arena->bin_map[j] = 0;
+        }
+        for (size_t j = 0; j < NUM_SMALL_CLASSES; j++)
+        {
+            arena->small_pages[j] = NULL;
         }
     }
-    else
+    // Failures of a heap set up before are no use to this one's report
+    __atomic_store_n(&num_failures, 0, __ATOMIC_RELAXED);
+    forget_failures();
+    reserve_small_zone();
+
+    // The first arena starts with the original fixed size heap, the others map regions as they need them
+    start_of_heap = mmap(NULL, SIZE_OF_HEAP, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+
+    start = (uint64_t)start_of_heap;
+
+    arenas[0].regions[0].base = start_of_heap;
+    arenas[0].regions[0].size = SIZE_OF_HEAP;
+    arenas[0].num_regions = 1;
+    init_region(&arenas[0], &arenas[0].regions[0]);
+}
+
+void init_heap()
+{
+    init_heap_with_arenas(0);
+}
+
+#pragma region Trimming
+
+/* Removes a region whose only chunk is free and hands it back to the OS. The caller must hold the arena's lock. */
+static void unmap_region(arena_t *arena, size_t index)
+{
+    region_t region = arena->regions[index];
+    remove_from_bin(arena, (node_t *)first_chunk(&region));
+
+    for (size_t i = index; i + 1 < arena->num_regions; i++)
+    {
+        arena->regions[i] = arena->regions[i + 1];
+    }
+    arena->num_regions--;
+    arena->layout_changes++;
+
+    munmap(region.base, region.size);
+}
+
+/* Releases the whole pages inside a free chunk, leaving its links and footer alone. Returns how many bytes went. */
+static size_t release_chunk_pages(node_t *chunk)
+{
+    if (chunk->size_flags & CHUNK_TRIMMED)
+    {
+        return 0;
+    }
+
+    // Releasing part of a huge page would split it back into small ones
+    uintptr_t page = huge_pages != HUGE_PAGES_OFF ? HUGE_PAGE_SIZE : page_size();
+    uintptr_t first = ((uintptr_t)((tree_node_t *)chunk + 1) + page - 1) & ~(page - 1);
+    uintptr_t last = (uintptr_t)chunk_footer((header_t *)chunk) & ~(page - 1);
+    if (last <= first)
+    {
+        return 0;
+    }
+
+    int advice = MADV_DONTNEED;
+#ifdef MADV_FREE
+    if (trim_lazily)
+    {
+        advice = MADV_FREE;
+    }
+#endif
+    if (madvise((void *)first, last - first, advice))
+    {
+        return 0;
+    }
+
+    chunk->size_flags |= CHUNK_TRIMMED;
+    return last - first;
+}
+
+/* Gives an arena's free memory back to the OS, leaving the first pad bytes of it alone. The caller must hold the arena's lock. */
+static size_t trim_arena(arena_t *arena, size_t pad)
+{
+    size_t released = 0;
+    size_t kept = 0;
+
+    drain_remote_frees(arena);
+    merge_pending(arena);
+
+    // Regions that are entirely free go back whole, apart from the one start is measured from
+    for (size_t i = arena->num_regions; i > 0; i--)
     {
-        // If the needed size requires the overhead space too
-        if (needed_size > biggest_chunk->size)
+        region_t *region = &arena->regions[i - 1];
+        header_t *chunk = first_chunk(region);
+        if (chunk->size_flags & CHUNK_IN_USE || chunk_size(next_chunk(chunk)) || region->base == start_of_heap)
         {
-            biggest_chunk_prev->next = biggest_chunk->next;
+            continue;
         }
-        else
+        if (kept < pad)
         {
-            node_t *split_free_chunk = (node_t *)((char *)biggest_chunk + needed_size);
-            split_free_chunk->size = prev_size - needed_size;
-            biggest_chunk_prev->next = split_free_chunk;
+            kept += chunk_size(chunk);
+            continue;
         }
+        released += region->size;
+        unmap_region(arena, i - 1);
     }
 
-    // Create header_t
-    header_t *allocated_header_t = (header_t *)biggest_chunk;
-    allocated_header_t->size = needed_size - sizeof(header_t);
-    allocated_header_t->magic = MAGIC_NUMBER;
+    // Whatever is left gets the pages inside its free chunks released
+    for (size_t i = 0; i < NUM_BINS; i++)
+    {
+        for (node_t *chunk = arena->bins[i]; chunk; chunk = chunk->next)
+        {
+            if (kept < pad)
+            {
+                kept += chunk_size((header_t *)chunk);
+                continue;
+            }
+            released += release_chunk_pages(chunk);
+        }
+    }
 
-    // Cut big chunk down to size
-    header_t *allocated_address = (header_t *)biggest_chunk + 1;
+    arena->dirty = 0;
+    return released;
+}
 
-    return (void *)allocated_address;
+/* Returns free memory in every arena to the OS, keeping up to pad bytes of it per arena. Returns how many bytes were released. */
+size_t my_trim(size_t pad)
+{
+    size_t released = 0;
+    for (size_t i = 0; i < num_arenas; i++)
+    {
+        arena_t *arena = &arenas[i];
+        pthread_mutex_lock(&arena->lock);
+        released += trim_arena(arena, pad);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    return released;
 }
 
-/* Frees the allocated chunk starting at the pointer passed in. Orders and coalesces the free list afterwards. */
-void my_free(void *ptr)
+static pthread_t trim_thread;
+static pthread_mutex_t trim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trim_wake = PTHREAD_COND_INITIALIZER;
+static int trim_running;
+
+// The background trimmer checks the arenas this many times per decay period
+#define TRIM_TICKS_PER_DECAY 4
+
+/* Every tick, trims the arenas that haven't freed anything for a whole decay period. Busy arenas are skipped rather than waited for. */
+static void *background_trim(void *arg)
 {
-    header_t *hptr = (header_t *)ptr - 1;
-    assert(hptr->magic == MAGIC_NUMBER);
-    node_t *new_free_chunk = (node_t *)hptr;
+    size_t decay_ms = (size_t)arg;
+    size_t tick_ms = decay_ms / TRIM_TICKS_PER_DECAY ? decay_ms / TRIM_TICKS_PER_DECAY : 1;
+
+    pthread_mutex_lock(&trim_lock);
+    while (trim_running)
+    {
+        struct timespec wake_at;
+        clock_gettime(CLOCK_REALTIME, &wake_at);
+        wake_at.tv_sec += tick_ms / 1000;
+        wake_at.tv_nsec += (tick_ms % 1000) * 1000000;
+        if (wake_at.tv_nsec >= 1000000000)
+        {
+            wake_at.tv_sec++;
+            wake_at.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&trim_wake, &trim_lock, &wake_at);
+        if (!trim_running)
+        {
+            break;
+        }
+
+        uint64_t tick = __atomic_add_fetch(&trim_tick, 1, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < num_arenas; i++)
+        {
+            arena_t *arena = &arenas[i];
+            if (pthread_mutex_trylock(&arena->lock))
+            {
+                continue;
+            }
+            if (arena->dirty && tick - arena->last_free_tick >= TRIM_TICKS_PER_DECAY)
+            {
+                trim_arena(arena, 0);
+            }
+            pthread_mutex_unlock(&arena->lock);
+        }
+    }
+    pthread_mutex_unlock(&trim_lock);
+    return NULL;
+}
+
+/* Starts a thread that returns memory to the OS once it has sat free for about decay_ms. Returns 0 or an errno value. */
+int start_background_trim(size_t decay_ms)
+{
+    pthread_mutex_lock(&trim_lock);
+    if (trim_running)
+    {
+        pthread_mutex_unlock(&trim_lock);
+        return EBUSY;
+    }
+    trim_running = 1;
+    pthread_mutex_unlock(&trim_lock);
+
+    int error = pthread_create(&trim_thread, NULL, background_trim, (void *)decay_ms);
+    if (error)
+    {
+        trim_running = 0;
+    }
+    return error;
+}
 
-    // Edge case where there is no free list
-    if (!start_of_free_list)
+void stop_background_trim()
+{
+    pthread_mutex_lock(&trim_lock);
+    if (!trim_running)
     {
-        start_of_free_list = new_free_chunk;
-        start_of_free_list->next = NULL;
-        start_of_free_list->size = hptr->size - sizeof(header_t) + sizeof(node_t);
+        pthread_mutex_unlock(&trim_lock);
         return;
     }
+    trim_running = 0;
+    pthread_cond_signal(&trim_wake);
+    pthread_mutex_unlock(&trim_lock);
+
+    pthread_join(trim_thread, NULL);
+}
+
+#pragma endregion Trimming
+
+#pragma region Statistics
+
+/* Returns the size of an arena's biggest free chunk, headers included. The caller must hold the arena's lock. */
+static size_t largest_free_chunk(arena_t *arena)
+{
+    if (arena->indexed && arena->free_tree)
+    {
+        return arena->free_tree->max_size;
+    }
+
+    // Small bins hold one size each, so only a range bin needs searching
+    size_t index = last_nonempty_bin(arena);
+    size_t largest = 0;
+    for (node_t *curr = index < NUM_BINS ? arena->bins[index] : NULL; curr; curr = curr->next)
+    {
+        if (chunk_size((header_t *)curr) > largest)
+        {
+            largest = chunk_size((header_t *)curr);
+        }
+        if (index < NUM_SMALL_BINS)
+        {
+            break;
+        }
+    }
+    return largest;
+}
 
-    // Insert into free list at the right place so need for reordering
-    node_t *prev = start_of_free_list;
-    node_t *curr = start_of_free_list;
+/* Gathers the heap's running totals. Every arena is locked just long enough to read its own, so it is cheap enough to poll. */
+mallinfo_t my_mallinfo()
+{
+    mallinfo_t info = {0};
 
-    // Loop through list to find correct placement
-    while (curr < new_free_chunk)
+    // This thread's counts since it last took a lock would be missing otherwise
+    if (num_arenas)
     {
-        prev = curr;
-        curr = curr->next;
+        arena_t *own = get_thread_arena();
+        pthread_mutex_lock(&own->lock);
+        merge_thread_counts(own);
+        pthread_mutex_unlock(&own->lock);
     }
 
-    // If it is at the start
-    if (curr == start_of_free_list)
+    for (size_t i = 0; i < num_arenas; i++)
     {
-        // Add new free chunk to head of free list
-        new_free_chunk->next = start_of_free_list;
-        new_free_chunk->size = hptr->size - sizeof(header_t) + sizeof(node_t);
-        start_of_free_list = new_free_chunk;
+        arena_t *arena = &arenas[i];
+        pthread_mutex_lock(&arena->lock);
+        for (size_t j = 0; j < arena->num_regions; j++)
+        {
+            info.arena_bytes += arena->regions[j].size;
+        }
+        info.regions += arena->num_regions;
+        info.free_bytes += arena->free_bytes;
+        info.free_chunks += arena->num_free;
+        info.mallocs += arena->mallocs;
+        info.frees += arena->frees;
+        info.small_pages += arena->num_small_pages;
+        info.small_object_bytes += arena->small_object_bytes;
+        size_t largest = largest_free_chunk(arena);
+        info.largest_free = largest > info.largest_free ? largest : info.largest_free;
+        pthread_mutex_unlock(&arena->lock);
     }
-    else
+
+    // The fencepost and the gap in front of the first chunk take ALIGN_TO bytes of every region that are neither free nor handed out
+    info.in_use_bytes = info.arena_bytes - info.free_bytes - info.regions * ALIGN_TO;
+    info.mmapped_chunks = __atomic_load_n(&mmapped_chunks, __ATOMIC_RELAXED);
+    info.mmapped_bytes = __atomic_load_n(&mmapped_bytes, __ATOMIC_RELAXED);
+    info.failures = __atomic_load_n(&num_failures, __ATOMIC_RELAXED);
+    return info;
+}
+
+/* Writes my_mallinfo() into buffer as a JSON object, without allocating. Returns what snprintf does. */
+int my_mallinfo_json(char *buffer, size_t size)
+{
+    mallinfo_t info = my_mallinfo();
+    return snprintf(buffer, size,
+                    "{\"arena_bytes\": %zu, \"in_use_bytes\": %zu, \"free_bytes\": %zu, \"largest_free\": %zu, "
+                    "\"free_chunks\": %zu, \"regions\": %zu, \"mmapped_chunks\": %zu, \"mmapped_bytes\": %zu, "
+                    "\"small_pages\": %zu, \"small_object_bytes\": %zu, "
+                    "\"mallocs\": %" PRIu64 ", \"frees\": %" PRIu64 ", \"failures\": %" PRIu64 "}",
+                    info.arena_bytes, info.in_use_bytes, info.free_bytes, info.largest_free, info.free_chunks, info.regions,
+                    info.mmapped_chunks, info.mmapped_bytes, info.small_pages, info.small_object_bytes, info.mallocs, info.frees, info.failures);
+}
+
+#pragma endregion Statistics
+
+#pragma region Fragmentation_Report
+
+// Snapshots of the latest out of memory failures, written round robin
+static failure_snapshot_t failure_snapshots[FAILURE_SNAPSHOTS];
+static uint64_t num_snapshots;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the power of two bucket a chunk size falls in. */
+size_t report_bucket(size_t size)
+{
+    size_t log = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(size);
+    return log < REPORT_BUCKETS ? log : REPORT_BUCKETS - 1;
+}
+
+/* Adds a chunk to a histogram. */
+static void add_to_buckets(size_bucket_t *buckets, size_t size)
+{
+    size_bucket_t *bucket = &buckets[report_bucket(size)];
+    bucket->chunks++;
+    bucket->bytes += size;
+}
+
+/* Saves the shape of an arena's free chunks when an allocation from it runs out of memory. The caller must hold the arena's lock. */
+static void record_failure(arena_t *arena, size_t needed_size)
+{
+    failure_snapshot_t snapshot = {0};
+    snapshot.needed_size = needed_size;
+    snapshot.arena = arena->index;
+    snapshot.regions = arena->num_regions;
+    snapshot.free_bytes = arena->free_bytes;
+    snapshot.largest_free = largest_free_chunk(arena);
+    for (size_t i = 0; i < NUM_BINS; i++)
     {
-        prev->next = new_free_chunk;
-        new_free_chunk->next = curr;
-        new_free_chunk->size = hptr->size - sizeof(header_t) + sizeof(node_t);
+        for (node_t *curr = arena->bins[i]; curr; curr = curr->next)
+        {
+            add_to_buckets(snapshot.free_chunks, chunk_size((header_t *)curr));
+        }
     }
 
-    // Try to coalesce
-    coalesce();
+    pthread_mutex_lock(&snapshot_lock);
+    failure_snapshots[num_snapshots % FAILURE_SNAPSHOTS] = snapshot;
+    num_snapshots++;
+    pthread_mutex_unlock(&snapshot_lock);
 }
 
-void init_heap()
+/* Drops the failure snapshots of a heap that is starting over. */
+static void forget_failures()
 {
-    start_of_heap = mmap(NULL, SIZE_OF_HEAP, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    pthread_mutex_lock(&snapshot_lock);
+    memset(failure_snapshots, 0, sizeof(failure_snapshots));
+    num_snapshots = 0;
+    pthread_mutex_unlock(&snapshot_lock);
+}
 
-    start = (uint64_t)start_of_heap;
+/* Fills in histograms of free and allocated chunk sizes, how fragmented the heap is, how full each small object size is and the latest out of memory failures. Walks every region, locking one arena at a time. */
+void my_heap_report(heap_report_t *report)
+{
+    memset(report, 0, sizeof(*report));
+
+    // This thread's byte counts since it last took a lock would be missing otherwise
+    if (num_arenas)
+    {
+        arena_t *own = get_thread_arena();
+        pthread_mutex_lock(&own->lock);
+        merge_thread_counts(own);
+        pthread_mutex_unlock(&own->lock);
+    }
+
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        arena_t *arena = &arenas[a];
+        pthread_mutex_lock(&arena->lock);
+        for (size_t i = 0; i < arena->num_regions; i++)
+        {
+            for (header_t *chunk = first_chunk(&arena->regions[i]); chunk_size(chunk); chunk = next_chunk(chunk))
+            {
+                size_t size = chunk_size(chunk);
+                if (chunk->size_flags & CHUNK_IN_USE)
+                {
+                    add_to_buckets(report->allocated_chunks, size);
+                    report->allocated_bytes += size;
+                }
+                else
+                {
+                    add_to_buckets(report->free_chunks, size);
+                    report->free_bytes += size;
+                    report->largest_free = size > report->largest_free ? size : report->largest_free;
+                }
+            }
+        }
+        report->requested_bytes += arena->requested_bytes;
+        report->granted_bytes += arena->granted_bytes;
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    // Pages never move between arenas, so each one is read under the lock of the arena it belongs to
+    size_t zone_used = __atomic_load_n(&small_zone_used, __ATOMIC_RELAXED);
+    for (size_t used = 0; used < zone_used; used += SMALL_PAGE_SIZE)
+    {
+        small_page_t *page = (small_page_t *)(small_zone + used);
+        arena_t *arena = &arenas[page->arena];
+        pthread_mutex_lock(&arena->lock);
+        if (page->size)
+        {
+            size_t class = page->size / ALIGN_TO - 1;
+            size_t capacity = (SMALL_PAGE_SIZE - SMALL_PAGE_HEADER) / page->size;
+            report->small_pages[class]++;
+            report->small_objects[class] += capacity - page->num_free;
+            report->small_capacity[class] += capacity;
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
 
-    start_of_free_list = (node_t *)start_of_heap;
-    start_of_free_list->size = SIZE_OF_HEAP - sizeof(node_t);
-    start_of_free_list->next = NULL;
+    if (report->free_bytes)
+    {
+        report->external_fragmentation = 1 - (double)report->largest_free / report->free_bytes;
+    }
+    if (report->granted_bytes)
+    {
+        report->internal_fragmentation = 1 - (double)report->requested_bytes / report->granted_bytes;
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    report->failures = num_snapshots;
+    report->num_snapshots = num_snapshots < FAILURE_SNAPSHOTS ? num_snapshots : FAILURE_SNAPSHOTS;
+    for (size_t i = 0; i < report->num_snapshots; i++)
+    {
+        report->snapshots[i] = failure_snapshots[(num_snapshots - report->num_snapshots + i) % FAILURE_SNAPSHOTS];
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+}
 
-    printf("Heap initialized at address: %llu with size: %ld\n", (uint64_t)start_of_heap - start, SIZE_OF_HEAP);
-}
\ No newline at end of file
+#pragma endregion Fragmentation_Report
@@ -6,31 +6,510 @@
 #include <sys/mman.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+// Regions grow geometrically so this is plenty for any address space
+#define MAX_REGIONS 48
+
+// Matches what the platform malloc promises, so anything can be stored in a chunk
+#define ALIGN_TO ((size_t)16)
+
+// Chunks smaller than SMALL_BIN_LIMIT get an exact size bin, bigger ones a power of two bin
+#define SMALL_BIN_LIMIT 512
+#define SMALL_BIN_LIMIT_LOG 9
+#define NUM_SMALL_BINS (SMALL_BIN_LIMIT / ALIGN_TO)
+#define NUM_BINS 128
+
+// Arena index lives in the chunk's size word above this bit
+#define MAX_ARENAS 64
+#define ARENA_SHIFT 56
+#define ARENA_MASK ((size_t)(MAX_ARENAS - 1) << ARENA_SHIFT)
+// More arenas than CPUs so threads that get preempted while holding a lock block fewer others
+#define ARENAS_PER_CPU 4
+
+// Requests up to this many bytes get an object with no header from a small page of objects the same size
+#define SMALL_OBJECT_LIMIT 64
+#define NUM_SMALL_CLASSES (SMALL_OBJECT_LIMIT / 16)
+#define SMALL_PAGE_SIZE (16 * 1024)
+// Address space set aside for small pages. It is only backed by memory as pages get used
+#define SMALL_ZONE_SIZE ((size_t)1 << 30)
+
+// Most chunks of one small size a thread cache holds before it gives half back
+#define TCACHE_MAX_COUNT 16
+// Most free chunks good fit looks at before settling for the best of them
+#define GOOD_FIT_PROBES 8
+// Where mmap_threshold starts, and how far freeing big mappings can push it
+#define MMAP_THRESHOLD_DEFAULT (128 * 1024)
+#define MMAP_THRESHOLD_MAX (32 * 1024 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// Trace records are buffered this many at a time before being written out
+#define TRACE_BUFFER_RECORDS 4096
+#define TRACE_MAGIC "MFTRACE"
+#define TRACE_VERSION 1
+// Heap reports sort chunks into power of two sizes. Bucket i holds sizes from 2^i up to 2^(i+1)
+#define REPORT_BUCKETS 48
+// Out of memory failures the heap keeps a snapshot of, the newest replacing the oldest
+#define FAILURE_SNAPSHOTS 8
+// Mean bytes between profiler samples when nothing else is asked for
+#define PROFILE_INTERVAL_DEFAULT (512 * 1024)
+// Return addresses kept per sample, and frames of the profiler and the entry point left off the top
+#define PROFILE_DEPTH 32
+#define PROFILE_SKIP_FRAMES 2
+// Hash table sizes for call sites and for sampled allocations still held. Both powers of two, kept at most 3/4 full
+#define PROFILE_SITES 1024
+#define PROFILE_SAMPLES 4096
+// While profiling is off each thread looks again after allocating this many bytes
+#define PROFILE_RECHECK_BYTES (1024 * 1024)
+
+#ifdef MF_DEBUG
+// Debug builds fill the slack between a guarded block and its canary with CANARY_BYTE and freed blocks with POISON_BYTE
+#define CANARY_BYTE 0xfd
+#define POISON_BYTE 0xdd
+// Canary word at the end of a guarded chunk. It holds the size that was asked for xored with this
+#define CANARY_VALUE ((size_t)0xfdfdfdfd00000000)
+#define CANARY_SIZE sizeof(size_t)
+// Freed guarded blocks wait in a FIFO of this many bytes and entries before going back to the heap
+#define QUARANTINE_LIMIT (256 * 1024)
+#define QUARANTINE_SLOTS 1024
+#endif
 
 extern const size_t SIZE_OF_HEAP;
 extern const int MAGIC_NUMBER;
-extern const size_t ALIGN_TO;
+extern const int TCACHE_MAGIC;
+extern const int REMOTE_MAGIC;
+extern const int PENDING_MAGIC;
+extern const size_t MAX_REQUEST_SIZE;
+extern const size_t MIN_CHUNK_SIZE;
+extern const size_t TREE_MIN_CHUNK_SIZE;
+
+// Chunk sizes are multiples of 16 below 2^48, so the flags live in the bits of the size word they never use
+#define CHUNK_SIZE_MASK ((((size_t)1 << 48) - 1) & ~(size_t)0xf)
+#define CHUNK_IN_USE 0x1
+#define PREV_IN_USE 0x2
+// Payload is still zero from mmap, apart from the free list links and footer
+#define CHUNK_ZEROED 0x4
+// Chunk has a mapping of its own instead of living in a region
+#define CHUNK_MMAPPED 0x8
+// Free chunk whose whole pages have already been handed back with madvise
+#define CHUNK_TRIMMED ((size_t)1 << 48)
+// Allocated chunk the profiler holds a sample of, so freeing it knows to drop the sample
+#define CHUNK_SAMPLED ((size_t)1 << 51)
+#ifdef MF_DEBUG
+// Chunk ends in a canary word
+#define CHUNK_GUARDED ((size_t)1 << 49)
+// Freed by the program but still held by a thread cache, a pending list, a remote free stack or the quarantine
+#define CHUNK_FREED ((size_t)1 << 50)
+#endif
 
+/* Starts every chunk. One word holds the chunk's total size, header included, and its flags. */
 typedef struct __header_t
 {
-    size_t size;
-    int magic;
+#ifdef MF_DEBUG
+    // MAGIC_NUMBER while allocated, checked on every free. Release builds leave it out to keep the header one word
+    size_t magic;
+#endif
+    // The previous chunk's arena flips PREV_IN_USE here under its lock, so any other change to an allocated chunk's
+    // word has to hold that lock too, through update_flags
+    size_t size_flags;
 } header_t;
 
+/* A free chunk. It starts with the same fields as header_t and ends with a footer holding a copy of its size. */
 typedef struct __node_t
 {
-    size_t size;
+#ifdef MF_DEBUG
+    size_t magic;
+#endif
+    size_t size_flags;
+    // Free list of the chunk's size class
     struct __node_t *next;
+    struct __node_t *prev;
 } node_t;
 
-void *start_of_heap;
-node_t *start_of_free_list;
-uint64_t start;
+/* A free chunk big enough to also sit in its arena's free tree, a treap ordered by address or by size and then address. */
+typedef struct __tree_node_t
+{
+    node_t node;
+    struct __tree_node_t *left;
+    struct __tree_node_t *right;
+    // Size of the biggest chunk in this subtree, so searches can skip subtrees with nothing big enough
+    size_t max_size;
+} tree_node_t;
+
+/* Starts every small page. Objects in the page have no header, so this is where their size and arena come from. */
+typedef struct __small_page_t
+{
+    // Bytes in each object, or 0 while the page is empty and can take any size
+    size_t size;
+    size_t arena;
+    // Pages of the same size with objects to spare, or empty pages
+    struct __small_page_t *next;
+    struct __small_page_t *prev;
+    // Freed objects, linked through their first word
+    void *free_objects;
+    // Objects past this one have never been handed out
+    char *unused;
+    size_t num_free;
+} small_page_t;
+
+/* One mmap'd piece of the heap. Kept sorted by base address. */
+typedef struct __region_t
+{
+    void *base;
+    size_t size;
+} region_t;
+
+typedef enum __policy_t
+{
+    // Pop from the smallest size class that fits
+    POLICY_SEGREGATED_FIT,
+    // Always split the biggest free chunk
+    POLICY_WORST_FIT,
+    // Split the smallest free chunk that fits
+    POLICY_BEST_FIT,
+    // Split the lowest addressed free chunk that fits
+    POLICY_FIRST_FIT,
+    // First fit starting from where the last chunk was carved, wrapping around
+    POLICY_NEXT_FIT,
+    // Split the best of the first good_fit_probes chunks that fit, searching up from the smallest size class
+    POLICY_GOOD_FIT
+} policy_t;
+
+/* How an arena's tree of free chunks is ordered, if it keeps one. */
+typedef enum __tree_order_t
+{
+    TREE_NONE,
+    // Size then address, for best and worst fit
+    TREE_BY_SIZE,
+    // Address alone, for first and next fit
+    TREE_BY_ADDRESS
+} tree_order_t;
+
+/* How new regions are backed. Only the regions mapped after it changes are affected. */
+typedef enum __huge_pages_t
+{
+    HUGE_PAGES_OFF,
+    // Align regions to huge pages and madvise them so transparent huge pages can back them
+    HUGE_PAGES_ADVISE,
+    // Map regions from the reserved huge page pool, falling back to HUGE_PAGES_ADVISE when it is empty
+    HUGE_PAGES_HUGETLB
+} huge_pages_t;
+
+/* An independent heap with its own regions, bins and lock. Chunks remember which arena they came from. */
+typedef struct __arena_t
+{
+    pthread_mutex_t lock;
+    size_t index;
+    region_t regions[MAX_REGIONS];
+    size_t num_regions;
+    node_t *bins[NUM_BINS];
+    uint64_t bin_map[NUM_BINS / 64];
+    // Where chunks get placed
+    policy_t policy;
+    // Free chunks in a tree as well, ordered to suit the policy and kept only while it needs one
+    tree_node_t *free_tree;
+    tree_order_t indexed;
+    // Just past the last chunk carved, where next fit starts looking
+    void *rover;
+    // Small pages with objects to spare for each size, and pages with nothing in them
+    small_page_t *small_pages[NUM_SMALL_CLASSES];
+    small_page_t *empty_pages;
+    // Running totals for my_mallinfo. Free bytes include headers
+    size_t free_bytes;
+    size_t num_free;
+    size_t num_small_pages;
+    size_t small_object_bytes;
+    uint64_t mallocs;
+    uint64_t frees;
+    // Bytes asked for and bytes handed out, headers included, over every allocation from this arena
+    uint64_t requested_bytes;
+    uint64_t granted_bytes;
+    // Size of the next region to map. At least doubles every time the arena grows.
+    size_t next_region_size;
+    // Lock-free stack of chunks freed by threads that use other arenas
+    node_t *remote_frees;
+    // Chunks freed but not merged yet while coalescing is deferred
+    node_t *pending;
+    size_t num_pending;
+    // Set by frees since the last trim, and the background trim tick of the latest one
+    int dirty;
+    uint64_t last_free_tick;
+    // Counts merges and unmapped regions, which can leave a paused audit_step pointing into the middle of a chunk
+    uint64_t layout_changes;
+} arena_t;
+
+/* Why an allocation returned NULL. */
+typedef enum __heap_error_t
+{
+    HEAP_OK,
+    // Bigger than MAX_REQUEST_SIZE, usually a negative size that wrapped around
+    HEAP_SIZE_TOO_LARGE,
+    HEAP_ZERO_SIZE,
+    // No chunk was big enough and no more memory could be mapped
+    HEAP_OUT_OF_MEMORY,
+    HEAP_BAD_ALIGNMENT
+} heap_error_t;
+
+#ifdef MF_DEBUG
+/* What a debug build found wrong with a block the program handed back. */
+typedef enum __heap_corruption_t
+{
+    // Freed while it was already free, cached, pending or in quarantine
+    HEAP_DOUBLE_FREE,
+    // The header doesn't hold MAGIC_NUMBER, so either it was overwritten or the pointer never came from the heap
+    HEAP_BAD_MAGIC,
+    // Something was written past the end of the block
+    HEAP_OVERRUN,
+    // Something was written to the block while it sat in quarantine
+    HEAP_WRITE_AFTER_FREE
+} heap_corruption_t;
+
+/* Called after a corrupted block has been reported, instead of aborting. */
+typedef void (*heap_corruption_hook_t)(heap_corruption_t problem, void *ptr);
+#endif
+
+/* Heap totals from my_mallinfo. Byte counts include chunk headers. */
+typedef struct __mallinfo_t
+{
+    // Mapped for the arenas' regions
+    size_t arena_bytes;
+    // In chunks the program holds, or that are freed but still cached, pending or waiting on a remote free stack
+    size_t in_use_bytes;
+    size_t free_bytes;
+    size_t largest_free;
+    size_t free_chunks;
+    size_t regions;
+    // Chunks with mappings of their own, which are counted apart from the regions
+    size_t mmapped_chunks;
+    size_t mmapped_bytes;
+    // Small pages held by the arenas, and the bytes in their objects the program holds or threads have cached
+    size_t small_pages;
+    size_t small_object_bytes;
+    // Chunks handed out and given back. Counts a thread hasn't added to an arena yet show up once it next takes an arena's lock
+    uint64_t mallocs;
+    uint64_t frees;
+    // Calls that returned NULL
+    uint64_t failures;
+} mallinfo_t;
+
+/* Chunks of one power of two size range in a heap report. */
+typedef struct __size_bucket_t
+{
+    size_t chunks;
+    size_t bytes;
+} size_bucket_t;
+
+/* The free chunks of the arena an allocation ran out of memory in, as they were when it happened. */
+typedef struct __failure_snapshot_t
+{
+    // Chunk size that was needed, header included
+    size_t needed_size;
+    size_t arena;
+    size_t regions;
+    size_t free_bytes;
+    size_t largest_free;
+    size_bucket_t free_chunks[REPORT_BUCKETS];
+} failure_snapshot_t;
+
+/* Where the heap's memory is and how well it is used, from my_heap_report. Only chunks in the arenas' regions are counted. */
+typedef struct __heap_report_t
+{
+    // Cached, pending and remotely freed chunks still count as allocated
+    size_bucket_t free_chunks[REPORT_BUCKETS];
+    size_bucket_t allocated_chunks[REPORT_BUCKETS];
+    size_t free_bytes;
+    size_t allocated_bytes;
+    size_t largest_free;
+    // 1 - largest_free / free_bytes. Close to 1 means plenty is free but only in pieces too small to use
+    double external_fragmentation;
+    // Over every allocation so far. What was handed out beyond what was asked for went to headers and align() rounding
+    uint64_t requested_bytes;
+    uint64_t granted_bytes;
+    double internal_fragmentation;
+    // For each small object size: pages, objects held by the program or a thread cache, and objects the pages have room for
+    size_t small_pages[NUM_SMALL_CLASSES];
+    size_t small_objects[NUM_SMALL_CLASSES];
+    size_t small_capacity[NUM_SMALL_CLASSES];
+    // Out of memory failures in the arenas, with snapshots of the latest ones, oldest first
+    uint64_t failures;
+    size_t num_snapshots;
+    failure_snapshot_t snapshots[FAILURE_SNAPSHOTS];
+} heap_report_t;
+
+/* Called on every failed allocation with the error and the size that was asked for. */
+typedef void (*heap_log_hook_t)(heap_error_t error, size_t size);
+
+/* Small chunks freed by one thread, kept to serve its next allocations without locking. Cached chunks still look allocated to the heap. */
+typedef struct __tcache_t
+{
+    node_t *entries[NUM_SMALL_BINS];
+    size_t counts[NUM_SMALL_BINS];
+    // Small objects, linked through their first word
+    void *objects[NUM_SMALL_CLASSES];
+    size_t object_counts[NUM_SMALL_CLASSES];
+    int registered;
+} tcache_t;
+
+typedef enum __trace_op_t
+{
+    TRACE_MALLOC,
+    TRACE_FREE,
+    TRACE_REALLOC,
+    TRACE_CALLOC,
+    TRACE_ALIGNED
+} trace_op_t;
+
+/* Starts every trace file. Offsets in the records are relative to start as it was in the traced process. */
+typedef struct __trace_file_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t start;
+} trace_file_header_t;
+
+/* One allocation call. Offsets are relative to start, the same way audit() shows addresses. */
+typedef struct __trace_record_t
+{
+    // Nanoseconds since tracing started
+    uint64_t time;
+    int64_t offset;
+    // Old offset for a realloc, alignment for an aligned allocation
+    int64_t extra;
+    uint64_t size;
+    uint32_t thread;
+    uint32_t op;
+} trace_record_t;
+
+/* One call stack the profiler has sampled allocations from. Counts and bytes are of the samples themselves, not scaled up. */
+typedef struct __profile_site_t
+{
+    // Return addresses, innermost first
+    void *stack[PROFILE_DEPTH];
+    size_t depth;
+    uint64_t live_count;
+    uint64_t live_bytes;
+    uint64_t total_count;
+    uint64_t total_bytes;
+} profile_site_t;
+
+/* A sampled allocation the program still holds. ptr is NULL in an empty slot. */
+typedef struct __profile_sample_t
+{
+    void *ptr;
+    size_t size;
+    size_t site;
+} profile_sample_t;
+
+typedef enum __profile_format_t
+{
+    // gperftools heap profile text that pprof reads and symbolizes itself
+    PROFILE_PPROF,
+    // One line per call stack, outermost frame first, with the estimated bytes allocated there, for flamegraph.pl
+    PROFILE_FOLDED,
+    // The same with the estimated bytes still held
+    PROFILE_FOLDED_LIVE
+} profile_format_t;
+
+/* Profiler totals, counting samples rather than the allocations they stand for. */
+typedef struct __profile_info_t
+{
+    // Mean bytes between samples, 0 if profiling never started
+    size_t interval;
+    int running;
+    size_t sites;
+    uint64_t samples;
+    uint64_t sampled_bytes;
+    size_t live_samples;
+    uint64_t live_bytes;
+    // Samples left out because a table was full
+    uint64_t dropped;
+} profile_info_t;
+
+extern void *start_of_heap;
+extern uint64_t start;
+
+extern arena_t arenas[MAX_ARENAS];
+extern size_t num_arenas;
+// Policy new arenas start with. Change it with set_policy so the arenas get indexed to suit
+extern policy_t policy;
+extern size_t good_fit_probes;
+// Set to 0 to turn the thread caches off
+extern size_t tcache_limit;
+// Set to 0 to give every allocation a header. Anything above SMALL_OBJECT_LIMIT counts as SMALL_OBJECT_LIMIT
+extern size_t small_object_limit;
+extern char *small_zone;
+extern size_t small_zone_used;
+// Set above 0 to hold frees back and merge them in batches of this many
+extern size_t coalesce_batch;
+extern size_t mmap_threshold;
+extern int mmap_threshold_dynamic;
+extern size_t mmapped_chunks;
+extern size_t mmapped_bytes;
+extern int trim_lazily;
+extern huge_pages_t huge_pages;
+#ifdef MF_DEBUG
+// Set to 0 to stop putting canaries after new blocks and poisoning and quarantining freed ones
+extern int guard_blocks;
+extern size_t quarantine_limit;
+#endif
 
 size_t align(size_t raw);
-void coalesce();
+node_t *coalesce(arena_t *arena, node_t *chunk);
 void *my_malloc(size_t size);
 void my_free(void *ptr);
+void *my_realloc(void *ptr, size_t size);
+size_t my_malloc_usable_size(void *ptr);
+void *my_calloc(size_t count, size_t size);
+void *my_aligned_alloc(size_t alignment, size_t size);
+int my_posix_memalign(void **memptr, size_t alignment, size_t size);
 void init_heap();
+void init_heap_with_arenas(size_t count);
+void set_policy(policy_t new_policy);
+void set_arena_policy(arena_t *arena, policy_t new_policy);
+void flush_tcache();
+void lock_heap_globals();
+void unlock_heap_globals();
+void drain_all_remote_frees();
+void merge_all_pending();
+heap_error_t heap_last_error();
+const char *heap_error_string(heap_error_t error);
+heap_log_hook_t set_heap_log_hook(heap_log_hook_t hook);
+#ifdef MF_DEBUG
+const char *heap_corruption_string(heap_corruption_t problem);
+heap_corruption_hook_t set_heap_corruption_hook(heap_corruption_hook_t hook);
+void flush_quarantine();
+#endif
+int trace_start(const char *path);
+void trace_stop();
+int profile_start(size_t interval);
+void profile_stop();
+int profile_write(int fd, profile_format_t format);
+profile_info_t profile_info();
+size_t my_trim(size_t pad);
+int start_background_trim(size_t decay_ms);
+void stop_background_trim();
+mallinfo_t my_mallinfo();
+int my_mallinfo_json(char *buffer, size_t size);
+void my_heap_report(heap_report_t *report);
+size_t report_bucket(size_t size);
+node_t *grow_heap(arena_t *arena, size_t needed_size);
+size_t chunk_size(header_t *chunk);
+void set_chunk_size(header_t *chunk, size_t size);
+header_t *first_chunk(region_t *region);
+header_t *next_chunk(header_t *chunk);
+header_t *prev_chunk(header_t *chunk);
+size_t *chunk_footer(header_t *chunk);
+arena_t *chunk_arena(header_t *chunk);
+int is_small_object(void *ptr);
+small_page_t *small_page(void *ptr);
+int in_tcache(header_t *chunk);
+size_t bin_index(size_t chunk_size);
+void add_to_bin(arena_t *arena, node_t *chunk);
+void remove_from_bin(arena_t *arena, node_t *chunk);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,253 @@
+#include "malloc_free.h"
+
+/*
+ * Standard allocator entry points on top of my_malloc and my_free, built into libmalloc_free.so so
+ * any program can be run with LD_PRELOAD=./libmalloc_free.so and allocate from this heap instead.
+ */
+
+// Enough for whatever the C library allocates while the heap itself is being set up
+#define BOOTSTRAP_SIZE 16384
+// Room in front of each bootstrap block for its size that keeps the block aligned
+#define BOOTSTRAP_PREFIX 16
+
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+static int heap_ready;
+// Set on the thread running init_heap so anything it allocates comes from the bootstrap buffer
+static __thread int bootstrapping;
+
+static char bootstrap_buffer[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+static const char *profile_path;
+static profile_format_t profile_format;
+
+#pragma region Bootstrap
+
+/* Hands out memory from the static buffer. Each block is preceded by its size so realloc can copy it later. */
+static void *bootstrap_malloc(size_t size)
+{
+    size_t needed = BOOTSTRAP_PREFIX + ((size + 15) & ~(size_t)15);
+    if (size > BOOTSTRAP_SIZE || bootstrap_used + needed > BOOTSTRAP_SIZE)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    char *block = bootstrap_buffer + bootstrap_used;
+    *(size_t *)block = size;
+    bootstrap_used += needed;
+    return block + BOOTSTRAP_PREFIX;
+}
+
+static int is_bootstrap(void *ptr)
+{
+    return (char *)ptr >= bootstrap_buffer && (char *)ptr < bootstrap_buffer + BOOTSTRAP_SIZE;
+}
+
+/* Keep every lock in the heap held across fork so the child doesn't inherit one some other thread was holding. */
+static void lock_all_arenas()
+{
+    lock_heap_globals();
+    for (size_t i = 0; i < num_arenas; i++)
+    {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+}
+
+static void unlock_all_arenas()
+{
+    for (size_t i = num_arenas; i > 0; i--)
+    {
+        pthread_mutex_unlock(&arenas[i - 1].lock);
+    }
+    unlock_heap_globals();
+}
+
+/* Writes the profile asked for with MALLOC_FREE_PROFILE when the program exits. */
+static void write_profile()
+{
+    int fd = open(profile_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        profile_write(fd, profile_format);
+        close(fd);
+    }
+}
+
+static void setup_heap()
+{
+    bootstrapping = 1;
+
+    // MALLOC_FREE_HUGE_PAGES=advise|hugetlb backs the regions mapped as the heap grows with huge pages
+    const char *huge = getenv("MALLOC_FREE_HUGE_PAGES");
+    if (huge && !strcmp(huge, "advise"))
+    {
+        huge_pages = HUGE_PAGES_ADVISE;
+    }
+    else if (huge && !strcmp(huge, "hugetlb"))
+    {
+        huge_pages = HUGE_PAGES_HUGETLB;
+    }
+
+    init_heap();
+    pthread_atfork(lock_all_arenas, unlock_all_arenas, unlock_all_arenas);
+
+    // MALLOC_FREE_TRACE=<file> records the program's allocations for replay.exe
+    const char *trace_path = getenv("MALLOC_FREE_TRACE");
+    if (trace_path && !trace_start(trace_path))
+    {
+        atexit(trace_stop);
+    }
+
+    // MALLOC_FREE_PROFILE=<file> samples allocations and writes a pprof heap profile there at exit, or folded stacks
+    // with MALLOC_FREE_PROFILE_FORMAT=folded. MALLOC_FREE_PROFILE_INTERVAL=<bytes> sets the mean bytes between samples
+    profile_path = getenv("MALLOC_FREE_PROFILE");
+    if (profile_path)
+    {
+        const char *format = getenv("MALLOC_FREE_PROFILE_FORMAT");
+        const char *interval = getenv("MALLOC_FREE_PROFILE_INTERVAL");
+        profile_format = format && !strcmp(format, "folded") ? PROFILE_FOLDED : PROFILE_PPROF;
+        if (!profile_start(interval ? strtoul(interval, NULL, 10) : PROFILE_INTERVAL_DEFAULT))
+        {
+            atexit(write_profile);
+        }
+    }
+
+    // MALLOC_FREE_TRIM_DECAY_MS=<ms> hands memory that has sat free that long back to the OS
+    const char *decay = getenv("MALLOC_FREE_TRIM_DECAY_MS");
+    if (decay)
+    {
+        start_background_trim(strtoul(decay, NULL, 10));
+    }
+    bootstrapping = 0;
+    __atomic_store_n(&heap_ready, 1, __ATOMIC_RELEASE);
+}
+
+/* Returns 1 once the heap can be used, or 0 if the caller is inside setup_heap and has to use the bootstrap buffer. */
+static int ensure_heap()
+{
+    if (__atomic_load_n(&heap_ready, __ATOMIC_ACQUIRE))
+    {
+        return 1;
+    }
+    if (bootstrapping)
+    {
+        return 0;
+    }
+    pthread_once(&heap_once, setup_heap);
+    return 1;
+}
+
+#pragma endregion Bootstrap
+
+#pragma region Entry_Points
+
+// The standard functions have to hand out something freeable for size 0, unlike my_malloc
+void *malloc(size_t size)
+{
+    if (!ensure_heap())
+    {
+        return bootstrap_malloc(size);
+    }
+    return my_malloc(size ? size : 1);
+}
+
+void free(void *ptr)
+{
+    // Bootstrap memory is never reused
+    if (!ptr || is_bootstrap(ptr))
+    {
+        return;
+    }
+    my_free(ptr);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if (!ensure_heap())
+    {
+        // The static buffer starts out zeroed and is never reused
+        if (size && count > BOOTSTRAP_SIZE / size)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+        return bootstrap_malloc(count * size);
+    }
+    if (!count || !size)
+    {
+        count = size = 1;
+    }
+    return my_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+    {
+        return malloc(size);
+    }
+    if (is_bootstrap(ptr))
+    {
+        // Move it onto the heap proper
+        size_t old_size = *(size_t *)((char *)ptr - BOOTSTRAP_PREFIX);
+        void *new_ptr = malloc(size);
+        if (new_ptr)
+        {
+            memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        }
+        return new_ptr;
+    }
+    return my_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (!ensure_heap())
+    {
+        return ENOMEM;
+    }
+    return my_posix_memalign(memptr, alignment, size ? size : 1);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    if (!ensure_heap())
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return my_aligned_alloc(alignment, size ? size : 1);
+}
+
+// The C library's own versions of these would allocate from its heap, which free can't take back
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    return memalign(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (!ptr)
+    {
+        return 0;
+    }
+    // Bootstrap blocks have their size in front of them rather than a chunk header
+    if (is_bootstrap(ptr))
+    {
+        return *(size_t *)((char *)ptr - BOOTSTRAP_PREFIX);
+    }
+    return my_malloc_usable_size(ptr);
+}
+
+#pragma endregion Entry_Points
@@ -0,0 +1,258 @@
+#include <string.h>
+#include <sys/stat.h>
+#include "malloc_free.h"
+#include "audit.h"
+
+/*
+ * Replays a trace written by trace_start against my_malloc and the C library's malloc as fast as it can.
+ * Calls are replayed on one thread in the order they were recorded.
+ *
+ * ./replay.exe <trace> [--allocator my_malloc|glibc|both] [--audit-at N]
+ *
+ * --audit-at N stops my_malloc after the first N records and prints audit() for the heap at that point.
+ */
+
+typedef struct allocator_t
+{
+    const char *name;
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    void *(*realloc)(void *, size_t);
+    void *(*calloc)(size_t, size_t);
+    void *(*aligned_alloc)(size_t, size_t);
+} allocator_t;
+
+static const allocator_t allocators[] = {
+    {"my_malloc", my_malloc, my_free, my_realloc, my_calloc, my_aligned_alloc},
+    {"glibc", malloc, free, realloc, calloc, aligned_alloc},
+};
+
+#pragma region Offset_Map
+
+// Open addressing from a traced offset to the pointer the replay got for it
+typedef struct offset_map_t
+{
+    int64_t *offsets;
+    void **ptrs;
+    size_t capacity;
+    size_t count;
+} offset_map_t;
+
+#define EMPTY_OFFSET INT64_MIN
+
+/* The map lives in its own mapping so it doesn't disturb either heap being measured */
+static void map_init(offset_map_t *map, size_t capacity)
+{
+    map->offsets = mmap(NULL, capacity * sizeof(int64_t), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    map->ptrs = mmap(NULL, capacity * sizeof(void *), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    assert(map->offsets != MAP_FAILED && map->ptrs != MAP_FAILED);
+    map->capacity = capacity;
+    map->count = 0;
+    for (size_t i = 0; i < capacity; i++)
+    {
+        map->offsets[i] = EMPTY_OFFSET;
+    }
+}
+
+static void map_destroy(offset_map_t *map)
+{
+    munmap(map->offsets, map->capacity * sizeof(int64_t));
+    munmap(map->ptrs, map->capacity * sizeof(void *));
+}
+
+static size_t map_slot(offset_map_t *map, int64_t offset)
+{
+    size_t slot = ((uint64_t)offset * 0x9e3779b97f4a7c15ull) & (map->capacity - 1);
+    while (map->offsets[slot] != EMPTY_OFFSET && map->offsets[slot] != offset)
+    {
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    return slot;
+}
+
+static void map_put(offset_map_t *map, int64_t offset, void *ptr);
+
+static void map_grow(offset_map_t *map)
+{
+    offset_map_t old = *map;
+    map_init(map, 2 * old.capacity);
+    for (size_t i = 0; i < old.capacity; i++)
+    {
+        if (old.offsets[i] != EMPTY_OFFSET)
+        {
+            map_put(map, old.offsets[i], old.ptrs[i]);
+        }
+    }
+    map_destroy(&old);
+}
+
+static void map_put(offset_map_t *map, int64_t offset, void *ptr)
+{
+    if (2 * (map->count + 1) > map->capacity)
+    {
+        map_grow(map);
+    }
+    size_t slot = map_slot(map, offset);
+    if (map->offsets[slot] == EMPTY_OFFSET)
+    {
+        map->count++;
+    }
+    map->offsets[slot] = offset;
+    map->ptrs[slot] = ptr;
+}
+
+/* Removes offset and returns its pointer, or NULL if the trace never allocated it. */
+static void *map_take(offset_map_t *map, int64_t offset)
+{
+    size_t slot = map_slot(map, offset);
+    if (map->offsets[slot] == EMPTY_OFFSET)
+    {
+        return NULL;
+    }
+    void *ptr = map->ptrs[slot];
+    map->offsets[slot] = EMPTY_OFFSET;
+    map->count--;
+
+    // Shift the rest of the run back so lookups never stop early at the hole
+    size_t hole = slot;
+    for (size_t next = (slot + 1) & (map->capacity - 1); map->offsets[next] != EMPTY_OFFSET; next = (next + 1) & (map->capacity - 1))
+    {
+        size_t home = ((uint64_t)map->offsets[next] * 0x9e3779b97f4a7c15ull) & (map->capacity - 1);
+        if (((next - home) & (map->capacity - 1)) >= ((next - hole) & (map->capacity - 1)))
+        {
+            map->offsets[hole] = map->offsets[next];
+            map->ptrs[hole] = map->ptrs[next];
+            map->offsets[next] = EMPTY_OFFSET;
+            hole = next;
+        }
+    }
+    return ptr;
+}
+
+#pragma endregion Offset_Map
+
+#pragma region Replaying
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Replays the first limit records. Returns how many had to be skipped because they freed memory allocated before the trace began. */
+static size_t replay(const allocator_t *allocator, const trace_record_t *records, size_t limit)
+{
+    offset_map_t map;
+    map_init(&map, 1024);
+    size_t skipped = 0;
+
+    for (size_t i = 0; i < limit; i++)
+    {
+        const trace_record_t *record = &records[i];
+        void *ptr = NULL;
+        switch (record->op)
+        {
+        case TRACE_MALLOC:
+            ptr = allocator->malloc(record->size);
+            break;
+        case TRACE_CALLOC:
+            ptr = allocator->calloc(1, record->size);
+            break;
+        case TRACE_ALIGNED:
+            ptr = allocator->aligned_alloc(record->extra, record->size);
+            break;
+        case TRACE_REALLOC:
+            ptr = map_take(&map, record->extra);
+            skipped += !ptr;
+            ptr = allocator->realloc(ptr, record->size);
+            break;
+        case TRACE_FREE:
+            ptr = map_take(&map, record->offset);
+            if (ptr)
+            {
+                allocator->free(ptr);
+            }
+            else
+            {
+                skipped++;
+            }
+            continue;
+        }
+        assert(ptr);
+        map_put(&map, record->offset, ptr);
+    }
+
+    map_destroy(&map);
+    return skipped;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <trace> [--allocator my_malloc|glibc|both] [--audit-at N]\n", argv[0]);
+        return 1;
+    }
+
+    const char *which = "both";
+    long audit_at = -1;
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "--allocator"))
+        {
+            which = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "--audit-at"))
+        {
+            audit_at = atol(argv[i + 1]);
+        }
+    }
+
+    // Map the whole trace so reading it doesn't allocate from either heap
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(trace_file_header_t))
+    {
+        fprintf(stderr, "can't read trace %s\n", argv[1]);
+        return 1;
+    }
+    void *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(file != MAP_FAILED);
+
+    const trace_file_header_t *header = file;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) || header->version != TRACE_VERSION || header->record_size != sizeof(trace_record_t))
+    {
+        fprintf(stderr, "%s is not a version %d trace\n", argv[1], TRACE_VERSION);
+        return 1;
+    }
+    const trace_record_t *records = (const trace_record_t *)(header + 1);
+    size_t num_records = (st.st_size - sizeof(trace_file_header_t)) / sizeof(trace_record_t);
+
+    init_heap();
+
+    if (audit_at >= 0)
+    {
+        size_t limit = (size_t)audit_at < num_records ? (size_t)audit_at : num_records;
+        replay(&allocators[0], records, limit);
+        printf("HEAP AFTER %zu OF %zu RECORDS\n", limit, num_records);
+        audit();
+        return 0;
+    }
+
+    printf("allocator,records,skipped,seconds,ops_per_sec\n");
+    for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++)
+    {
+        if (strcmp(which, "both") && strcmp(which, allocators[a].name))
+        {
+            continue;
+        }
+        uint64_t begin = now_ns();
+        size_t skipped = replay(&allocators[a], records, num_records);
+        double seconds = (now_ns() - begin) / 1e9;
+        printf("%s,%zu,%zu,%.6f,%.0f\n", allocators[a].name, num_records, skipped, seconds, seconds > 0 ? num_records / seconds : 0);
+    }
+    return 0;
+}
+
+#pragma endregion Replaying
@@ -0,0 +1,201 @@
+#include "slab.h"
+
+#pragma region Slab_Lists
+
+static void push_slab(slab_t **list, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+    {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void remove_slab(slab_t **list, slab_t *slab)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        *list = slab->next;
+    }
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/* Frees every slab on a list back to the heap. */
+static void free_slabs(slab_t *slab)
+{
+    while (slab)
+    {
+        slab_t *next = slab->next;
+        my_free(slab);
+        slab = next;
+    }
+}
+
+#pragma endregion Slab_Lists
+
+/* Takes a new slab from the heap, aligned to its size so slab_free can find it from any object in it. */
+static slab_t *new_slab(slab_cache_t *cache)
+{
+    slab_t *slab = my_aligned_alloc(cache->slab_size, cache->slab_size);
+    if (!slab)
+    {
+        return NULL;
+    }
+
+    slab->cache = cache;
+    slab->free_objects = NULL;
+    slab->unused = (char *)slab + cache->first_offset;
+    slab->num_free = cache->objs_per_slab;
+    return slab;
+}
+
+/* Makes a cache of obj_size byte objects aligned to align, which has to be a power of two. Returns NULL if it can't. */
+slab_cache_t *slab_create(size_t obj_size, size_t align)
+{
+    if (!obj_size || obj_size > MAX_REQUEST_SIZE || (align & (align - 1)))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Every object has to be able to hold the free list link
+    if (align < sizeof(void *))
+    {
+        align = sizeof(void *);
+    }
+    size_t stride = obj_size < sizeof(void *) ? sizeof(void *) : obj_size;
+    stride = (stride + align - 1) & ~(align - 1);
+
+    // Objects smaller than a cache line get a power of two stride so none of them straddle two lines
+    if (stride < CACHE_LINE)
+    {
+        size_t pow2 = sizeof(void *);
+        while (pow2 < stride)
+        {
+            pow2 <<= 1;
+        }
+        stride = pow2;
+    }
+
+    // The first object starts on its own cache line after the slab_t
+    size_t first_align = align > CACHE_LINE ? align : CACHE_LINE;
+    size_t first_offset = (sizeof(slab_t) + first_align - 1) & ~(first_align - 1);
+
+    size_t slab_size = SLAB_SIZE;
+    while (slab_size < first_offset + SLAB_MIN_OBJECTS * stride)
+    {
+        slab_size <<= 1;
+    }
+
+    slab_cache_t *cache = my_malloc(sizeof(slab_cache_t));
+    if (!cache)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->obj_size = obj_size;
+    cache->stride = stride;
+    cache->first_offset = first_offset;
+    cache->slab_size = slab_size;
+    cache->objs_per_slab = (slab_size - first_offset) / stride;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    return cache;
+}
+
+/* Gives every slab back to the heap. Objects still allocated from the cache go with them. */
+void slab_destroy(slab_cache_t *cache)
+{
+    free_slabs(cache->partial);
+    free_slabs(cache->full);
+    free_slabs(cache->empty);
+    pthread_mutex_destroy(&cache->lock);
+    my_free(cache);
+}
+
+/* Returns one object from the cache in constant time, or NULL if the heap is out of memory. */
+void *slab_alloc(slab_cache_t *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    slab_t *slab = cache->partial;
+    if (!slab)
+    {
+        slab = cache->empty ? cache->empty : new_slab(cache);
+        cache->empty = NULL;
+        if (!slab)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+        push_slab(&cache->partial, slab);
+    }
+
+    // Reuse a freed object first, otherwise carve the next one that was never used
+    void *obj = slab->free_objects;
+    if (obj)
+    {
+        slab->free_objects = *(void **)obj;
+    }
+    else
+    {
+        obj = slab->unused;
+        slab->unused += cache->stride;
+    }
+
+    if (!--slab->num_free)
+    {
+        remove_slab(&cache->partial, slab);
+        push_slab(&cache->full, slab);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return obj;
+}
+
+/* Returns an object to the cache it came from in constant time. */
+void slab_free(slab_cache_t *cache, void *obj)
+{
+    slab_t *slab = (slab_t *)((uintptr_t)obj & ~(uintptr_t)(cache->slab_size - 1));
+    assert(slab->cache == cache);
+    assert(((char *)obj - (char *)slab - cache->first_offset) % cache->stride == 0);
+
+    pthread_mutex_lock(&cache->lock);
+
+    *(void **)obj = slab->free_objects;
+    slab->free_objects = obj;
+    slab->num_free++;
+
+    if (slab->num_free == 1)
+    {
+        remove_slab(&cache->full, slab);
+        push_slab(&cache->partial, slab);
+    }
+    else if (slab->num_free == cache->objs_per_slab)
+    {
+        // Keep one empty slab around and give any others back to the heap
+        remove_slab(&cache->partial, slab);
+        if (cache->empty)
+        {
+            my_free(slab);
+        }
+        else
+        {
+            slab->free_objects = NULL;
+            slab->unused = (char *)slab + cache->first_offset;
+            cache->empty = slab;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
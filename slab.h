@@ -0,0 +1,48 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include "malloc_free.h"
+
+// Slabs are at least a page and hold at least this many objects
+#define SLAB_SIZE 4096
+#define SLAB_MIN_OBJECTS 8
+#define CACHE_LINE 64
+
+typedef struct __slab_cache_t slab_cache_t;
+
+/* One slab. It sits at the start of its own slab_size aligned block so an object finds it by masking its address. */
+typedef struct __slab_t
+{
+    slab_cache_t *cache;
+    struct __slab_t *next;
+    struct __slab_t *prev;
+    // Freed objects, linked through their first word
+    void *free_objects;
+    // Objects past this one have never been handed out
+    char *unused;
+    size_t num_free;
+} slab_t;
+
+/* Fixed size objects with no header each, packed into slabs taken from the heap. */
+struct __slab_cache_t
+{
+    pthread_mutex_t lock;
+    size_t obj_size;
+    // Distance between objects
+    size_t stride;
+    // Where the first object sits in a slab
+    size_t first_offset;
+    size_t slab_size;
+    size_t objs_per_slab;
+    // Slabs with some free objects, then ones with none, then one spare kept so a cache near a slab boundary doesn't thrash the heap
+    slab_t *partial;
+    slab_t *full;
+    slab_t *empty;
+};
+
+slab_cache_t *slab_create(size_t obj_size, size_t align);
+void slab_destroy(slab_cache_t *cache);
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *obj);
+
+#endif
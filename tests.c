@@ -1,7 +1,13 @@
 #include <stdbool.h>
+#include <sys/resource.h>
 #include "malloc_free.h"
 #include "main.h"
 #include "tests.h"
+#include "slab.h"
+#include "bump_arena.h"
+
+size_t MAX_CHUNKS;
+size_t CHUNK_SIZE;
 
 #pragma region Test_Helpers
 
@@ -38,34 +44,42 @@ void free_all_chunks()
     void *chunks_to_free[MAX_CHUNKS];
     int num_allocated_chunks = 0;
 
-    void *address = start_of_heap;
-    node_t *last_free = start_of_free_list;
-    while (address < start_of_heap + SIZE_OF_HEAP)
-    {
-        // If it is free
-        // check if it is in free list
-        if (address == last_free)
-        {
-            node_t *chunk = (node_t *)address;
+    // Cached, remotely freed, pending and quarantined chunks look allocated but are already free
+#ifdef MF_DEBUG
+    flush_quarantine();
+#endif
+    flush_tcache();
+    drain_all_remote_frees();
+    merge_all_pending();
 
-            // next free chunk
-            last_free = last_free->next;
-            // next chunk
-            address += (chunk->size + sizeof(node_t));
-        }
-        // else it must be allocated
-        else
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        arena_t *arena = &arenas[a];
+        for (size_t i = 0; i < arena->num_regions; i++)
         {
-            header_t *chunk = (header_t *)address;
-            // check magic number is right
-            assert(chunk->magic == MAGIC_NUMBER);
-
-            // can't free while inside this loop, so store the address for later
-            chunks_to_free[num_allocated_chunks] = chunk + 1;
-            num_allocated_chunks++;
-
-            // next chunk
-            address += (chunk->size + sizeof(header_t));
+            void *address = first_chunk(&arena->regions[i]);
+            // Stop at the fencepost
+            while (address < arena->regions[i].base + arena->regions[i].size - sizeof(header_t))
+            {
+                header_t *chunk = (header_t *)address;
+
+                // If it is allocated
+                if (chunk->size_flags & CHUNK_IN_USE)
+                {
+#ifdef MF_DEBUG
+                    // check magic number is right
+                    assert(chunk->magic == MAGIC_NUMBER);
+#endif
+
+                    // can't free while inside this loop, so store the address for later
+                    assert(num_allocated_chunks < MAX_CHUNKS);
+                    chunks_to_free[num_allocated_chunks] = chunk + 1;
+                    num_allocated_chunks++;
+                }
+
+                // next chunk
+                address += chunk_size(chunk);
+            }
         }
     }
     // Free them all
@@ -75,42 +89,300 @@ void free_all_chunks()
     }
 }
 
-/* Verifies that the each free list node_t's next pointer address is greater than the node_t's current address. */
-bool verify_sorted()
+/* Returns the first free chunk in address order, starting with the main thread's arena, or NULL if every chunk is allocated. */
+node_t *first_free_chunk()
+{
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        arena_t *arena = &arenas[a];
+        for (size_t i = 0; i < arena->num_regions; i++)
+        {
+            header_t *chunk = first_chunk(&arena->regions[i]);
+            while (chunk_size(chunk))
+            {
+                if (!(chunk->size_flags & CHUNK_IN_USE))
+                {
+                    return (node_t *)chunk;
+                }
+                chunk = next_chunk(chunk);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Counts the free chunks in every region. */
+size_t count_free_chunks()
 {
-    bool sorted = true;
-    node_t *curr = start_of_free_list;
-    while (curr)
+    size_t num_free_chunks = 0;
+    for (size_t a = 0; a < num_arenas; a++)
     {
-        if (curr->next && curr->next <= curr)
+        arena_t *arena = &arenas[a];
+        for (size_t i = 0; i < arena->num_regions; i++)
         {
-            sorted = false;
+            header_t *chunk = first_chunk(&arena->regions[i]);
+            while (chunk_size(chunk))
+            {
+                if (!(chunk->size_flags & CHUNK_IN_USE))
+                {
+                    num_free_chunks++;
+                }
+                chunk = next_chunk(chunk);
+            }
         }
+    }
+    return num_free_chunks;
+}
 
-        curr = curr->next;
+/* Verifies that each chunk's prev in use bit matches the chunk before it, that every free chunk's footer matches its size and that each region ends in a fencepost. */
+bool verify_boundary_tags()
+{
+    bool intact = true;
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        arena_t *arena = &arenas[a];
+        for (size_t i = 0; i < arena->num_regions; i++)
+        {
+            header_t *chunk = first_chunk(&arena->regions[i]);
+            int prev_in_use = PREV_IN_USE;
+            while (chunk_size(chunk))
+            {
+                if ((chunk->size_flags & PREV_IN_USE) != prev_in_use)
+                {
+                    intact = false;
+                }
+                if (!(chunk->size_flags & CHUNK_IN_USE) && *chunk_footer(chunk) != chunk_size(chunk))
+                {
+                    intact = false;
+                }
+                // A free chunk's footer has to lead straight back to it
+                if (!(chunk->size_flags & CHUNK_IN_USE) && prev_chunk(next_chunk(chunk)) != chunk)
+                {
+                    intact = false;
+                }
+
+                prev_in_use = (chunk->size_flags & CHUNK_IN_USE) ? PREV_IN_USE : 0;
+                chunk = next_chunk(chunk);
+            }
+
+            if ((void *)chunk != arena->regions[i].base + arena->regions[i].size - sizeof(header_t) || !(chunk->size_flags & CHUNK_IN_USE))
+            {
+                intact = false;
+            }
+        }
     }
 
-    return sorted;
+    return intact;
 }
 
-/* Verifies that no free list node_ts next pointer is equal to the address of the node_t plus it's size, which woullu mean they are adjacent. */
+/* Verifies that no free chunk is physically followed by another free chunk, which would mean they weren't coalesced. */
 bool verify_alternating()
 {
     bool alternating = true;
-    node_t *curr = start_of_free_list;
-    while (curr)
+    for (size_t a = 0; a < num_arenas; a++)
     {
-        if ((uint64_t)curr + curr->size + sizeof(node_t) == (uint64_t)curr->next)
+        arena_t *arena = &arenas[a];
+        for (size_t i = 0; i < arena->num_regions; i++)
         {
-            alternating = false;
+            header_t *chunk = first_chunk(&arena->regions[i]);
+            while (chunk_size(chunk))
+            {
+                if (!(chunk->size_flags & CHUNK_IN_USE) && !(next_chunk(chunk)->size_flags & CHUNK_IN_USE))
+                {
+                    alternating = false;
+                }
+                chunk = next_chunk(chunk);
+            }
         }
-
-        curr = curr->next;
     }
 
     return alternating;
 }
 
+/* Verifies that every free chunk is in the bin for its size in its own arena, and that bin_map matches which bins are empty. */
+bool verify_bins()
+{
+    size_t num_binned_chunks = 0;
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        arena_t *arena = &arenas[a];
+        for (size_t i = 0; i < NUM_BINS; i++)
+        {
+            bool marked = (arena->bin_map[i / 64] >> (i % 64)) & 1;
+            if (marked != (arena->bins[i] != NULL))
+            {
+                return false;
+            }
+
+            for (node_t *curr = arena->bins[i]; curr; curr = curr->next)
+            {
+                if (bin_index(chunk_size((header_t *)curr)) != i || chunk_arena((header_t *)curr) != arena)
+                {
+                    return false;
+                }
+                num_binned_chunks++;
+            }
+        }
+    }
+
+    return count_free_chunks() == num_binned_chunks;
+}
+
+/* Walks a free tree in order, checking every chunk is free, sorts after the one before it and knows the biggest chunk under it. Returns how many chunks it holds. */
+static size_t walk_free_tree(tree_order_t order, tree_node_t *node, tree_node_t **prev, bool *valid)
+{
+    if (!node)
+    {
+        return 0;
+    }
+
+    size_t count = walk_free_tree(order, node->left, prev, valid);
+    if (node->node.size_flags & CHUNK_IN_USE)
+    {
+        *valid = false;
+    }
+    size_t prev_size = *prev ? chunk_size((header_t *)*prev) : 0;
+    size_t size = chunk_size((header_t *)node);
+    if (*prev && (order == TREE_BY_ADDRESS ? *prev >= node : prev_size > size || (prev_size == size && *prev >= node)))
+    {
+        *valid = false;
+    }
+    *prev = node;
+    count += 1 + walk_free_tree(order, node->right, prev, valid);
+
+    size_t max_size = size;
+    if (node->left && node->left->max_size > max_size)
+    {
+        max_size = node->left->max_size;
+    }
+    if (node->right && node->right->max_size > max_size)
+    {
+        max_size = node->right->max_size;
+    }
+    if (node->max_size != max_size)
+    {
+        *valid = false;
+    }
+    return count;
+}
+
+/* Verifies each indexed arena's free tree is in order and holds exactly the free chunks big enough to be in it. */
+bool verify_free_tree()
+{
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        arena_t *arena = &arenas[a];
+        if (!arena->indexed)
+        {
+            if (arena->free_tree)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        size_t num_big_free_chunks = 0;
+        for (size_t i = 0; i < arena->num_regions; i++)
+        {
+            header_t *chunk = first_chunk(&arena->regions[i]);
+            while (chunk_size(chunk))
+            {
+                if (!(chunk->size_flags & CHUNK_IN_USE) && chunk_size(chunk) >= TREE_MIN_CHUNK_SIZE)
+                {
+                    num_big_free_chunks++;
+                }
+                chunk = next_chunk(chunk);
+            }
+        }
+
+        tree_node_t *prev = NULL;
+        bool valid = true;
+        if (walk_free_tree(arena->indexed, arena->free_tree, &prev, &valid) != num_big_free_chunks || !valid)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Finds what next fit should pick by walking every chunk: the lowest free one at or after rover that holds needed_size, or failing that the lowest one anywhere. */
+static header_t *walk_next_fit(arena_t *arena, size_t needed_size, void *rover)
+{
+    header_t *next = NULL;
+    header_t *first = NULL;
+    for (size_t i = 0; i < arena->num_regions; i++)
+    {
+        for (header_t *chunk = first_chunk(&arena->regions[i]); chunk_size(chunk); chunk = next_chunk(chunk))
+        {
+            if ((chunk->size_flags & CHUNK_IN_USE) || chunk_size(chunk) < needed_size)
+            {
+                continue;
+            }
+            if (!first || chunk < first)
+            {
+                first = chunk;
+            }
+            if ((void *)chunk >= rover && (!next || chunk < next))
+            {
+                next = chunk;
+            }
+        }
+    }
+    return next ? next : first;
+}
+
+/* Runs audit_step until it finishes a pass or finds something, without any limits. */
+audit_result_t finish_audit(audit_cursor_t *cursor)
+{
+    audit_result_t result;
+    do
+    {
+        result = audit_step(cursor, 0, 0);
+    } while (result.status == AUDIT_IN_PROGRESS);
+    return result;
+}
+
+/* Aligns and frees a block of every size whose padded request lands just below or just over the mmap threshold, then checks the heap survived. */
+void align_around_threshold(size_t alignment)
+{
+    int prev_dynamic = mmap_threshold_dynamic;
+    mmap_threshold_dynamic = 0;
+    for (size_t size = mmap_threshold - alignment - MIN_CHUNK_SIZE - 256; size < mmap_threshold; size += 8)
+    {
+        void *ptr = my_aligned_alloc(alignment, size);
+        assert(ptr && ((uintptr_t)ptr & (alignment - 1)) == 0);
+        memset(ptr, 'a', size);
+        my_free(ptr);
+    }
+    mmap_threshold_dynamic = prev_dynamic;
+
+    audit_cursor_t cursor = {0};
+    assert(finish_audit(&cursor).status == AUDIT_OK);
+    // Hand back the regions the blocks below the threshold grew the heap by, so later tests find the heap where they expect it
+#ifdef MF_DEBUG
+    flush_quarantine();
+#endif
+    my_trim(0);
+}
+
+/* Counts the regions in every arena. */
+size_t total_regions()
+{
+    size_t num_regions = 0;
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        num_regions += arenas[a].num_regions;
+    }
+    return num_regions;
+}
+
+/* Returns where the first chunk of the original heap starts. */
+void *heap_start()
+{
+    return (header_t *)(start_of_heap + ALIGN_TO) - 1;
+}
+
 #pragma endregion Test_Helpers
 
 #pragma region Tests
@@ -119,6 +391,8 @@ void test_free_chunk_reuse()
 {
     emphasis("TESTING FREE CHUNKS BEING REUSED AS MUCH AS POSSIBLE");
 
+    // These expectations are all about where worst fit places chunks
+    set_policy(POLICY_WORST_FIT);
     free_all_chunks();
     void *chunks[MAX_CHUNKS];
 
@@ -132,7 +406,7 @@ void test_free_chunk_reuse()
     chunks[0] = my_malloc(CHUNK_SIZE);
     printf("VERIFYING ADDRESS OF FIRST CHUNK AT START OF HEAP...\n");
     audit();
-    assert((header_t *)chunks[0] - 1 == start_of_heap);
+    assert((void *)((header_t *)chunks[0] - 1) == heap_start());
     free_all_chunks();
     passed();
 
@@ -148,7 +422,7 @@ void test_free_chunk_reuse()
     chunks[0] = my_malloc(CHUNK_SIZE);
     printf("VERIFYING ADDRESS OF FIRST CHUNK AT START OF HEAP...\n");
     audit();
-    assert((header_t *)chunks[0] - 1 == start_of_heap);
+    assert((void *)((header_t *)chunks[0] - 1) == heap_start());
     free_all_chunks();
     passed();
 
@@ -162,21 +436,22 @@ void test_free_chunk_reuse()
     my_free(chunks[1]);
     printf("VERIFYING THAT FREE LIST HEAD IS AT THE END OF FIRST ALLOCATED CHUNK...\n");
     audit();
-    assert(start_of_free_list == start_of_heap + align(SIZE_OF_HEAP / 4));
+    assert((void *)first_free_chunk() == heap_start() + align(SIZE_OF_HEAP / 4));
     printf("ALLOCATING ANOTHER CHUNK...\n");
     chunks[1] = my_malloc(CHUNK_SIZE);
     printf("VERIFYING THAT NEW CHUNK ADDRESS IS AT THE END OF FIRST ALLOCATED CHUNK...\n");
     audit();
-    assert((header_t *)chunks[1] - 1 == start_of_heap + align(SIZE_OF_HEAP / 4));
+    assert((void *)((header_t *)chunks[1] - 1) == heap_start() + align(SIZE_OF_HEAP / 4));
     free_all_chunks();
     passed();
 
+    set_policy(POLICY_SEGREGATED_FIT);
     success("ALL FREE CHUNK REUSE TESTS PASSED");
 }
 
-void test_sorted_free_list()
+void test_boundary_tags()
 {
-    emphasis("TESTING FREE LIST IS SORTED IN IN-MEMORY ORDER");
+    emphasis("TESTING BOUNDARY TAGS STAY INTACT");
 
     free_all_chunks();
     void *chunks[MAX_CHUNKS];
@@ -191,9 +466,9 @@ void test_sorted_free_list()
     my_free(chunks[0]);
     my_free(chunks[2]);
     my_free(chunks[4]);
-    printf("VERIFYING THAT THE FREE CHUNK LIST IS SORTED...\n");
+    printf("VERIFYING THAT THE BOUNDARY TAGS ARE INTACT...\n");
     audit();
-    assert(verify_sorted());
+    assert(verify_boundary_tags());
     free_all_chunks();
     passed();
 
@@ -214,33 +489,50 @@ void test_sorted_free_list()
     my_free(chunks[2]);
     my_free(chunks[0]);
     my_free(chunks[8]);
-    printf("VERIFYING THAT THE FREE CHUNK LIST IS SORTED...\n");
+    printf("VERIFYING THAT THE BOUNDARY TAGS ARE INTACT...\n");
     audit();
-    assert(verify_sorted());
+    assert(verify_boundary_tags());
     free_all_chunks();
     passed();
 
-    success("ALL SORTED FREE LIST TESTS PASSED");
+    printf("ALLOCATING 3 CHUNKS...\n");
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(CHUNK_SIZE);
+    printf("FREEING THE OUTER CHUNKS AND THEN THE MIDDLE ONE...\n");
+    my_free(chunks[0]);
+    my_free(chunks[2]);
+    my_free(chunks[1]);
+    printf("VERIFYING THE MIDDLE CHUNK MERGED WITH BOTH NEIGHBOURS...\n");
+    audit();
+    assert(verify_boundary_tags());
+    assert(count_free_chunks() == 1);
+    assert((void *)first_free_chunk() == heap_start());
+    passed();
+
+    success("ALL BOUNDARY TAG TESTS PASSED");
 }
 
 void test_splitting_free_chunks()
 {
     emphasis("TESTING FREE CHUNKS ARE SPLIT PROPERLY WHEN ALLOCATING");
 
+    // These expectations are all about where worst fit places chunks
+    set_policy(POLICY_WORST_FIT);
     free_all_chunks();
     void *chunks[MAX_CHUNKS];
 
     printf("ALLOCATING 1 CHUNK...\n");
-    node_t *prev_head_address = start_of_free_list;
+    node_t *prev_head_address = first_free_chunk();
     chunks[0] = my_malloc(CHUNK_SIZE);
     uint64_t expected = (uint64_t)prev_head_address + align(CHUNK_SIZE);
     printf("CHECKING ADDRESS OF FREE LIST HEAD...\n");
-    printf("EXPECTED: %llu, ACTUAL: %llu\n", expected - start, (uint64_t)start_of_free_list - start);
-    assert((uint64_t)start_of_free_list == expected);
+    printf("EXPECTED: %" PRIu64 ", ACTUAL: %" PRIu64 "\n", expected - start, (uint64_t)first_free_chunk() - start);
+    assert((uint64_t)first_free_chunk() == expected);
     free_all_chunks();
     passed();
 
-    prev_head_address = start_of_free_list;
+    prev_head_address = first_free_chunk();
     printf("ALLOCATING 1 CHUNK OF SIZE 1/2 OF HEAP SIZE...\n");
     chunks[0] = my_malloc(SIZE_OF_HEAP / 2);
     printf("ALLOCATING ANOTHER CHUNK OF STANDARD SIZE...\n");
@@ -248,28 +540,29 @@ void test_splitting_free_chunks()
     printf("VERIFYING THAT FREE LIST HEAD HAS MOVED UP BY TOTAL SIZE OF ALLOCATED CHUNKS...\n");
     expected = (uint64_t)prev_head_address + align(SIZE_OF_HEAP / 2) + align(CHUNK_SIZE);
     printf("CHECKING ADDRESS OF FREE LIST HEAD...\n");
-    printf("EXPECTED: %llu, ACTUAL: %llu\n", expected - start, (uint64_t)start_of_free_list - start);
+    printf("EXPECTED: %" PRIu64 ", ACTUAL: %" PRIu64 "\n", expected - start, (uint64_t)first_free_chunk() - start);
     audit();
-    assert((uint64_t)start_of_free_list == expected);
+    assert((uint64_t)first_free_chunk() == expected);
     printf("FREEING FIRST CHUNK...\n");
     my_free(chunks[0]);
-    prev_head_address = start_of_free_list;
+    prev_head_address = first_free_chunk();
     printf("ALLOCATING ANOTHER CHUNK OF STANDARD SIZE...\n");
     chunks[0] = my_malloc(CHUNK_SIZE);
     printf("VERIFYING THAT FREE LIST HEAD HAS MOVED UP BY SIZE OF ALLOCATED CHUNK...\n");
     expected = (uint64_t)prev_head_address + align(CHUNK_SIZE);
     printf("CHECKING ADDRESS OF FREE LIST HEAD...\n");
-    printf("EXPECTED: %llu, ACTUAL: %llu\n", expected - start, (uint64_t)start_of_free_list - start);
+    printf("EXPECTED: %" PRIu64 ", ACTUAL: %" PRIu64 "\n", expected - start, (uint64_t)first_free_chunk() - start);
     audit();
-    assert((uint64_t)start_of_free_list == expected);
+    assert((uint64_t)first_free_chunk() == expected);
     free_all_chunks();
     passed();
 
     printf("ALLOCATING 1 CHUNK THAT IS THE MAX CHUNK SIZE THE HEAP CAN HOLD...\n");
-    chunks[0] = my_malloc(SIZE_OF_HEAP - sizeof(header_t));
-    printf("VERIFYING FREE LIST HEAD IS NULL...\n");
+    // The fencepost at the end of the heap and the gap in front of the first chunk take up ALIGN_TO between them
+    chunks[0] = my_malloc(SIZE_OF_HEAP - ALIGN_TO - sizeof(header_t));
+    printf("VERIFYING THERE ARE NO FREE CHUNKS LEFT...\n");
     audit();
-    assert(start_of_free_list == NULL);
+    assert(first_free_chunk() == NULL);
     free_all_chunks();
     passed();
 
@@ -283,10 +576,11 @@ void test_splitting_free_chunks()
     chunks[0] = my_malloc(SIZE_OF_HEAP / 2);
     printf("VERIFYING THAT THERE IS ONLY 1 FREE CHUNK\n");
     audit();
-    assert(start_of_free_list->next == NULL);
+    assert(count_free_chunks() == 1);
     free_all_chunks();
     passed();
 
+    set_policy(POLICY_SEGREGATED_FIT);
     success("ALL SPLITTING FREE CHUNKS TESTS PASSED");
 }
 
@@ -307,7 +601,7 @@ void test_coalesce()
     free_all_chunks();
     printf("MAKING SURE THERE IS ONLY 1 CHUNK...\n");
     audit();
-    assert(start_of_free_list->next == NULL);
+    assert(count_free_chunks() == 1);
     passed();
 
     printf("ALLOCATING 5 CHUNKS...\n");
@@ -323,7 +617,7 @@ void test_coalesce()
     my_free(chunks[4]);
     printf("MAKING SURE THERE ARE ONLY 2 FREE CHUNKS...\n");
     audit();
-    assert(start_of_free_list->next->next == NULL);
+    assert(count_free_chunks() == 2);
     free_all_chunks();
     passed();
 
@@ -339,13 +633,69 @@ void test_coalesce()
     my_free(chunks[3]);
     printf("MAKING SURE THERE ARE ONLY 3 FREE CHUNKS...\n");
     audit();
-    assert(start_of_free_list->next->next->next == NULL);
+    assert(count_free_chunks() == 3);
     free_all_chunks();
     passed();
 
     success("ALL COALESCING TESTS PASSED");
 }
 
+void test_deferred_coalescing()
+{
+    emphasis("TESTING FREES BEING COALESCED IN BATCHES");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    arena_t *arena = &arenas[0];
+    coalesce_batch = 4;
+
+    printf("ALLOCATING 4 CHUNKS AND FREEING 3 OF THEM...\n");
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(CHUNK_SIZE);
+    chunks[3] = my_malloc(CHUNK_SIZE);
+    my_free(chunks[2]);
+    my_free(chunks[0]);
+    my_free(chunks[1]);
+    printf("VERIFYING THEY ARE PENDING AND NOTHING WAS MERGED...\n");
+    audit();
+    assert(arena->num_pending == 3);
+    assert(arena->pending == (node_t *)((header_t *)chunks[1] - 1) && arena->pending->next == (node_t *)((header_t *)chunks[0] - 1));
+    assert(((header_t *)chunks[0] - 1)->size_flags & CHUNK_IN_USE);
+    assert(count_free_chunks() == 1);
+    printf("FREEING THE LAST ONE TO REACH THE BATCH SIZE...\n");
+    my_free(chunks[3]);
+    printf("VERIFYING THEY WERE ALL MERGED INTO 1 FREE CHUNK...\n");
+    audit();
+    assert(arena->num_pending == 0);
+    assert(count_free_chunks() == 1);
+    assert(!(((header_t *)chunks[0] - 1)->size_flags & CHUNK_IN_USE));
+    passed();
+
+    printf("FILLING THE HEAP AND FREEING 2 CHUNKS NEXT TO EACH OTHER...\n");
+    coalesce_batch = 100;
+    size_t prev_num_regions = arena->num_regions;
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(chunk_size(next_chunk((header_t *)chunks[1] - 1)) - sizeof(header_t));
+    assert(count_free_chunks() == 0);
+    my_free(chunks[0]);
+    my_free(chunks[1]);
+    assert(arena->num_pending == 2);
+    printf("ALLOCATING A CHUNK ONLY THE 2 OF THEM MERGED CAN HOLD...\n");
+    chunks[3] = my_malloc(2 * CHUNK_SIZE);
+    printf("VERIFYING THE FAILED SEARCH MERGED THEM INSTEAD OF GROWING THE HEAP...\n");
+    audit();
+    assert(chunks[3] == chunks[0]);
+    assert(arena->num_pending == 0);
+    assert(arena->num_regions == prev_num_regions);
+    coalesce_batch = 0;
+    free_all_chunks();
+    passed();
+
+    success("ALL DEFERRED COALESCING TESTS PASSED");
+}
+
 void test_alternating_sequence()
 {
     emphasis("TESTING HEAP IS IN ALTERNATING SEQUENCE OF 1 FREE CHUNK AND 1 OR MORE ALLOCATED CHUNKS");
@@ -407,6 +757,8 @@ void test_worst_fit()
 {
     emphasis("TESTING WORST FIRST ALLOCATION");
 
+    // These expectations are all about where worst fit places chunks
+    set_policy(POLICY_WORST_FIT);
     free_all_chunks();
     void *chunks[MAX_CHUNKS];
 
@@ -452,78 +804,2172 @@ void test_worst_fit()
     free_all_chunks();
     passed();
 
+    set_policy(POLICY_SEGREGATED_FIT);
     success("ALL WORST FIT ALLOCATION TESTS PASSED");
 }
 
-void test_malloc_bad_size()
+void test_best_fit()
 {
-    emphasis("TESTING MALLOC RETURNS NULL ON BAD VALUE SIZE REQUESTS");
+    emphasis("TESTING BEST FIT ALLOCATION");
 
+    set_policy(POLICY_BEST_FIT);
     free_all_chunks();
     void *chunks[MAX_CHUNKS];
 
-    printf("REQUESTING 1 CHUNK THAT IS TWICE THE SIZE OF HEAP...\n");
-    chunks[0] = my_malloc(2 * SIZE_OF_HEAP);
-    printf("VERIFYING RETURN IS NULL...\n");
+    printf("ALLOCATING 3 CHUNKS. MIDDLE CHUNK IS HALF THE HEAP SIZE...\n");
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    chunks[1] = my_malloc(SIZE_OF_HEAP / 2);
+    chunks[2] = my_malloc(CHUNK_SIZE);
+    printf("FREEING MIDDLE CHUNK...\n");
+    my_free(chunks[1]);
+    printf("ALLOCATING 1 CHUNK...\n");
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING CHUNK WAS SPLIT FROM THE SMALLER FREE CHUNK AT THE END...\n");
     audit();
-    assert(chunks[0] == NULL);
+    assert(chunks[1] > chunks[2]);
+    free_all_chunks();
     passed();
 
-    printf("ALLOCATING 2 CHUNKS WITH SUM SLIGHTLY SMALLER THAN HEAP SIZE...\n");
-    chunks[0] = my_malloc((SIZE_OF_HEAP / 2) - (CHUNK_SIZE / 2));
-    chunks[1] = my_malloc((SIZE_OF_HEAP / 2) - (CHUNK_SIZE / 2));
-    printf("REQUESTING ADDITIONAL CHUNK WITH SIZE GREATER THAN REMAINING HEAP SIZE...\n");
+    printf("ALLOCATING A DOUBLE SIZE CHUNK AND 3 CHUNKS. FREEING THE FIRST AND THIRD...\n");
+    chunks[0] = my_malloc(2 * CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
     chunks[2] = my_malloc(CHUNK_SIZE);
-    printf("VERIFYING RETURN IS NULL...\n");
+    chunks[3] = my_malloc(CHUNK_SIZE);
+    my_free(chunks[0]);
+    my_free(chunks[2]);
+    printf("ALLOCATING 1 CHUNK...\n");
+    chunks[4] = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING IT FILLED THE HOLE IT FITS EXACTLY...\n");
     audit();
-    assert(chunks[2] == NULL);
+    assert(chunks[4] == chunks[2]);
     free_all_chunks();
     passed();
 
-    printf("REQUESTING 1 CHUNK OF SIZE -1...\n");
-    chunks[0] = my_malloc(-1);
-    printf("VERIFYING RETURN IS NULL...\n");
+    set_policy(POLICY_SEGREGATED_FIT);
+    success("ALL BEST FIT ALLOCATION TESTS PASSED");
+}
+
+void test_first_fit()
+{
+    emphasis("TESTING FIRST FIT ALLOCATION");
+
+    set_policy(POLICY_FIRST_FIT);
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+
+    printf("ALLOCATING A DOUBLE SIZE CHUNK AND 3 CHUNKS. FREEING THE FIRST AND THIRD...\n");
+    chunks[0] = my_malloc(2 * CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(CHUNK_SIZE);
+    chunks[3] = my_malloc(CHUNK_SIZE);
+    my_free(chunks[0]);
+    my_free(chunks[2]);
+    printf("ALLOCATING 1 CHUNK...\n");
+    chunks[4] = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING IT WAS SPLIT FROM THE LOWEST HOLE EVEN THOUGH IT IS BIGGER...\n");
     audit();
-    assert(chunks[0] == NULL);
+    assert(chunks[4] == chunks[0]);
+    printf("ALLOCATING 1 CHUNK...\n");
+    chunks[5] = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING IT SKIPPED WHAT WAS LEFT OF THE FIRST HOLE AND FILLED THE SECOND...\n");
+    audit();
+    assert(chunks[5] == chunks[2]);
+    printf("ALLOCATING 1 CHUNK...\n");
+    chunks[6] = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING CHUNK WAS ALLOCATED AT THE END...\n");
+    audit();
+    assert(chunks[6] > chunks[3]);
+    free_all_chunks();
     passed();
 
-    printf("REQUESTING LARGE NEGATIVE SIZE CHUNK...\n");
-    chunks[0] = my_malloc(-SIZE_OF_HEAP / 2);
-    printf("VERIFYING RETURN IS NULL...\n");
+    set_policy(POLICY_SEGREGATED_FIT);
+    success("ALL FIRST FIT ALLOCATION TESTS PASSED");
+}
+
+void test_next_fit()
+{
+    emphasis("TESTING NEXT FIT ALLOCATION");
+
+    set_policy(POLICY_NEXT_FIT);
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+
+    printf("ALLOCATING 5 CHUNKS. FREEING THE SECOND AND FOURTH...\n");
+    for (size_t i = 0; i < 5; i++)
+    {
+        chunks[i] = my_malloc(CHUNK_SIZE);
+    }
+    my_free(chunks[1]);
+    my_free(chunks[3]);
+    printf("ALLOCATING 1 CHUNK...\n");
+    chunks[5] = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING IT CARRIED ON FROM THE LAST CHUNK INSTEAD OF FILLING A HOLE...\n");
     audit();
-    assert(chunks[0] == NULL);
+    assert(chunks[5] > chunks[4]);
+    printf("ALLOCATING THE REST OF THE HEAP...\n");
+    chunks[6] = my_malloc(chunk_size(next_chunk((header_t *)chunks[5] - 1)) - sizeof(header_t));
+    assert(chunks[6] > chunks[5]);
+    printf("ALLOCATING 1 CHUNK...\n");
+    chunks[7] = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING IT WRAPPED AROUND TO THE FIRST HOLE...\n");
+    audit();
+    assert(chunks[7] == chunks[1]);
+    printf("ALLOCATING 1 CHUNK...\n");
+    chunks[8] = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING IT CARRIED ON TO THE SECOND HOLE...\n");
+    audit();
+    assert(chunks[8] == chunks[3]);
+    free_all_chunks();
     passed();
 
-    printf("REQUESTING SIZE 0 CHUNK...\n");
-    chunks[0] = my_malloc(0);
-    printf("VERIFYING RETURN IS NULL...\n");
+    set_policy(POLICY_SEGREGATED_FIT);
+    success("ALL NEXT FIT ALLOCATION TESTS PASSED");
+}
+
+void test_good_fit()
+{
+    emphasis("TESTING GOOD FIT ALLOCATION");
+
+    set_policy(POLICY_GOOD_FIT);
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    size_t prev_probes = good_fit_probes;
+
+    printf("ALLOCATING 2 CHUNKS OF DIFFERENT SIZES IN THE SAME SIZE CLASS WITH CHUNKS BETWEEN THEM...\n");
+    chunks[0] = my_malloc(3 * CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(4 * CHUNK_SIZE + CHUNK_SIZE / 2);
+    chunks[3] = my_malloc(CHUNK_SIZE);
+    assert(bin_index(align(3 * CHUNK_SIZE)) == bin_index(align(4 * CHUNK_SIZE + CHUNK_SIZE / 2)));
+    printf("FREEING THE SMALLER ONE, THEN THE BIGGER ONE...\n");
+    my_free(chunks[0]);
+    my_free(chunks[2]);
+    printf("ALLOCATING 1 CHUNK BOTH CAN HOLD...\n");
+    chunks[4] = my_malloc(3 * CHUNK_SIZE - CHUNK_SIZE / 4);
+    printf("VERIFYING IT LOOKED PAST THE FIRST ONE IT FOUND AND TOOK THE TIGHTER FIT...\n");
     audit();
-    assert(chunks[0] == NULL);
+    assert(chunks[4] == chunks[0]);
+    free_all_chunks();
     passed();
 
-    success("ALL MALLOC BAD SIZE TESTS PASSED");
+    printf("LETTING IT LOOK AT ONLY 1 CHUNK AND MAKING THE SAME HOLES...\n");
+    good_fit_probes = 1;
+    chunks[0] = my_malloc(3 * CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(4 * CHUNK_SIZE + CHUNK_SIZE / 2);
+    chunks[3] = my_malloc(CHUNK_SIZE);
+    my_free(chunks[0]);
+    my_free(chunks[2]);
+    printf("ALLOCATING 1 CHUNK BOTH CAN HOLD...\n");
+    chunks[4] = my_malloc(3 * CHUNK_SIZE - CHUNK_SIZE / 4);
+    printf("VERIFYING IT SETTLED FOR THE FIRST ONE IT FOUND...\n");
+    audit();
+    assert(chunks[4] == chunks[2]);
+    printf("ALLOCATING 1 CHUNK BIGGER THAN EITHER HOLE...\n");
+    chunks[5] = my_malloc(5 * CHUNK_SIZE);
+    printf("VERIFYING IT STILL FOUND ONE IN A BIGGER SIZE CLASS...\n");
+    audit();
+    assert(chunks[5] > chunks[3]);
+    free_all_chunks();
+    passed();
+
+    good_fit_probes = prev_probes;
+    set_policy(POLICY_SEGREGATED_FIT);
+    success("ALL GOOD FIT ALLOCATION TESTS PASSED");
 }
 
-void test_all()
+void test_segregated_fit()
 {
-    emphasis("RUNNING ALL TESTS");
-    test_free_chunk_reuse();
-    test_sorted_free_list();
-    test_splitting_free_chunks();
-    test_coalesce();
-    test_alternating_sequence();
-    test_worst_fit();
-    test_malloc_bad_size();
-    success("ALL TESTS PASSED");
-}
+    emphasis("TESTING SEGREGATED FIT ALLOCATION");
 
-#pragma endregion Tests
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
 
-/* Sets standard chunk size for tests. */
-void init_tests()
-{
-    MAX_CHUNKS = 10;
-    CHUNK_SIZE = SIZE_OF_HEAP / 20;
+    printf("ALLOCATING 5 CHUNKS...\n");
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(CHUNK_SIZE);
+    chunks[3] = my_malloc(CHUNK_SIZE);
+    chunks[4] = my_malloc(CHUNK_SIZE);
+    printf("FREEING SECOND AND FOURTH CHUNKS...\n");
+    my_free(chunks[1]);
+    my_free(chunks[3]);
+    printf("VERIFYING BOTH ARE IN THE SAME SIZE CLASS...\n");
+    assert(verify_bins());
+    assert(arenas[0].bins[bin_index(align(CHUNK_SIZE))] != NULL);
+    printf("ALLOCATING 2 CHUNKS OF THE SAME SIZE...\n");
+    void *reused_0 = my_malloc(CHUNK_SIZE);
+    void *reused_1 = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING THEY REUSED BOTH HOLES AND EMPTIED THE SIZE CLASS...\n");
+    audit();
+    assert((reused_0 == chunks[1] && reused_1 == chunks[3]) || (reused_0 == chunks[3] && reused_1 == chunks[1]));
+    assert(arenas[0].bins[bin_index(align(CHUNK_SIZE))] == NULL);
+    assert(verify_bins());
+    free_all_chunks();
+    passed();
+
+    printf("ALLOCATING 3 CHUNKS. MIDDLE CHUNK IS HALF THE HEAP SIZE...\n");
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    chunks[1] = my_malloc(SIZE_OF_HEAP / 2);
+    chunks[2] = my_malloc(CHUNK_SIZE);
+    printf("FREEING MIDDLE CHUNK...\n");
+    my_free(chunks[1]);
+    printf("ALLOCATING 1 CHUNK...\n");
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING CHUNK WAS SPLIT FROM THE SMALLER FREE CHUNK AT THE END...\n");
+    audit();
+    assert(chunks[1] > chunks[2]);
+    assert(verify_bins());
+    free_all_chunks();
+    passed();
+
+    printf("ALLOCATING 4 CHUNKS OF DIFFERENT SIZES...\n");
+    chunks[0] = my_malloc(CHUNK_SIZE / 4);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(CHUNK_SIZE / 2);
+    chunks[3] = my_malloc(CHUNK_SIZE * 2);
+    printf("FREEING ALL CHUNKS...\n");
+    free_all_chunks();
+    printf("VERIFYING EVERY FREE CHUNK IS STILL IN THE RIGHT BIN AFTER COALESCING...\n");
+    audit();
+    assert(verify_bins());
+    passed();
+
+    success("ALL SEGREGATED FIT ALLOCATION TESTS PASSED");
+}
+
+// Enough holes that a search visiting every one of them would stand out against one that only walks the depth of the tree
+#define FRAGMENTED_HOLES 128
+
+void test_free_tree()
+{
+    emphasis("TESTING THE FREE TREE OVER FREE CHUNKS");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+
+    printf("SWITCHING TO BEST FIT...\n");
+    set_policy(POLICY_BEST_FIT);
+    printf("VERIFYING THE ARENA WAS INDEXED...\n");
+    assert(arenas[0].indexed && arenas[0].free_tree);
+    assert(verify_free_tree());
+    passed();
+
+    printf("ALLOCATING A BIG CHUNK AND 3 SMALLER ONES. FREEING THE BIG ONE AND THE THIRD...\n");
+    chunks[0] = my_malloc(2 * CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(CHUNK_SIZE);
+    chunks[3] = my_malloc(CHUNK_SIZE);
+    my_free(chunks[0]);
+    my_free(chunks[2]);
+    audit();
+    assert(verify_free_tree());
+    printf("ALLOCATING 1 CHUNK...\n");
+    void *best = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING BEST FIT TOOK THE HOLE IT FILLS EXACTLY...\n");
+    audit();
+    assert(best == chunks[2]);
+    assert(verify_free_tree());
+    free_all_chunks();
+    passed();
+
+    printf("SWITCHING TO FIRST FIT AND MAKING THE SAME HOLES...\n");
+    set_policy(POLICY_FIRST_FIT);
+    chunks[0] = my_malloc(2 * CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(CHUNK_SIZE);
+    chunks[3] = my_malloc(CHUNK_SIZE);
+    my_free(chunks[0]);
+    my_free(chunks[2]);
+    printf("ALLOCATING 1 CHUNK...\n");
+    void *first = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING FIRST FIT TOOK THE LOWEST HOLE...\n");
+    audit();
+    assert(first == chunks[0]);
+    assert(verify_free_tree());
+    printf("ALLOCATING A CHUNK TOO BIG FOR EITHER HOLE...\n");
+    void *big = my_malloc(4 * CHUNK_SIZE);
+    printf("VERIFYING IT CAME FROM THE END OF THE HEAP...\n");
+    assert(big > chunks[3]);
+    assert(verify_free_tree());
+    free_all_chunks();
+    passed();
+
+    printf("SWITCHING TO NEXT FIT AND CUTTING THE HEAP INTO %d HOLES OF MIXED SIZES...\n", FRAGMENTED_HOLES);
+    set_policy(POLICY_NEXT_FIT);
+    assert(arenas[0].indexed == TREE_BY_ADDRESS);
+    assert(verify_free_tree());
+    size_t next_region_size = arenas[0].next_region_size;
+    void *holes[FRAGMENTED_HOLES];
+    void *separators[FRAGMENTED_HOLES];
+    unsigned int seed = 1;
+    for (size_t i = 0; i < FRAGMENTED_HOLES; i++)
+    {
+        holes[i] = my_malloc(2 * SMALL_OBJECT_LIMIT + rand_r(&seed) % 64 * ALIGN_TO);
+        separators[i] = my_malloc(2 * SMALL_OBJECT_LIMIT);
+    }
+    for (size_t i = 0; i < FRAGMENTED_HOLES; i++)
+    {
+        my_free(holes[i]);
+    }
+    audit();
+    assert(verify_free_tree());
+    printf("ALLOCATING FROM ALL OVER THE HEAP...\n");
+    printf("VERIFYING EACH CHUNK IS THE LOWEST ONE THAT FITS PAST THE ROVER, OR THE LOWEST ONE THAT FITS AFTER WRAPPING AROUND...\n");
+    for (size_t i = 0; i < 4 * FRAGMENTED_HOLES; i++)
+    {
+        size_t size = 2 * SMALL_OBJECT_LIMIT + rand_r(&seed) % 64 * ALIGN_TO;
+        void *rover = rand_r(&seed) % 2 ? holes[rand_r(&seed) % FRAGMENTED_HOLES] : separators[rand_r(&seed) % FRAGMENTED_HOLES];
+        arenas[0].rover = rover;
+        header_t *expected = walk_next_fit(&arenas[0], align(size), rover);
+        void *chunk = my_malloc(size);
+        assert((header_t *)chunk - 1 == expected);
+        my_free(chunk);
+    }
+    audit();
+    assert(verify_free_tree());
+    for (size_t i = 0; i < FRAGMENTED_HOLES; i++)
+    {
+        my_free(separators[i]);
+    }
+    // Hand back the regions the holes spilled into, so later tests start from the heap they would have had otherwise
+    my_trim(0);
+    arenas[0].next_region_size = next_region_size;
+    passed();
+
+    printf("FILLING THE HEAP AROUND 3 CHUNKS TOO SMALL FOR THE TREE, THE FIRST THE SMALLEST THERE CAN BE...\n");
+    set_policy(POLICY_FIRST_FIT);
+    size_t prev_small_object_limit = small_object_limit;
+    size_t prev_threshold = mmap_threshold;
+    small_object_limit = 0;
+    mmap_threshold = MAX_REQUEST_SIZE;
+    // Small bins hold one size each, so the biggest size below the tree is a whole ALIGN_TO under it
+    size_t smallest = align(1);
+    size_t biggest = (TREE_MIN_CHUNK_SIZE - 1) & ~(ALIGN_TO - 1);
+    void *tiny[3];
+    void *fillers[FRAGMENTED_HOLES];
+    size_t num_fillers = 0;
+    for (size_t i = 0; i < 3; i++)
+    {
+        tiny[i] = my_malloc((i ? biggest : smallest) - sizeof(header_t));
+        fillers[num_fillers++] = my_malloc(CHUNK_SIZE);
+    }
+    for (mallinfo_t info = my_mallinfo(); info.free_chunks; info = my_mallinfo())
+    {
+        assert(num_fillers < FRAGMENTED_HOLES);
+        fillers[num_fillers] = my_malloc(info.largest_free - sizeof(header_t));
+        assert(fillers[num_fillers++]);
+    }
+    // Freed in address order, each bin hands out its highest addressed chunk first
+    for (size_t i = 0; i < 3; i++)
+    {
+        my_free(tiny[i]);
+    }
+    assert(chunk_size((header_t *)tiny[0] - 1) == smallest && chunk_size((header_t *)tiny[2] - 1) == biggest);
+    assert(!arenas[0].free_tree);
+    // Debug headers leave room for only one size below the tree
+    void *lowest_biggest = smallest == biggest ? tiny[0] : tiny[1];
+    printf("VERIFYING FIRST FIT TAKES THE LOWEST ONE THAT FITS, WHICHEVER BIN IT IS IN...\n");
+    void *chunk = my_malloc(biggest - sizeof(header_t));
+    assert(chunk == lowest_biggest);
+    my_free(chunk);
+    printf("VERIFYING NEXT FIT TAKES THE LOWEST ONE PAST THE ROVER...\n");
+    set_policy(POLICY_NEXT_FIT);
+    arenas[0].rover = (char *)tiny[0] + 1;
+    chunk = my_malloc(biggest - sizeof(header_t));
+    assert(chunk == tiny[1]);
+    my_free(chunk);
+    arenas[0].rover = (char *)tiny[1] + 1;
+    chunk = my_malloc(smallest - sizeof(header_t));
+    assert(chunk == tiny[2]);
+    my_free(chunk);
+    printf("VERIFYING WORST FIT TAKES THE LOWEST OF THE BIGGEST ONES...\n");
+    set_policy(POLICY_WORST_FIT);
+    assert(!arenas[0].free_tree);
+    chunk = my_malloc(smallest - sizeof(header_t));
+    assert(chunk == lowest_biggest);
+    my_free(chunk);
+    for (size_t i = 0; i < num_fillers; i++)
+    {
+        my_free(fillers[i]);
+    }
+    drain_all_remote_frees();
+    small_object_limit = prev_small_object_limit;
+    mmap_threshold = prev_threshold;
+    audit();
+    assert(verify_free_tree());
+    passed();
+
+    printf("SWITCHING BACK TO SEGREGATED FIT...\n");
+    set_policy(POLICY_SEGREGATED_FIT);
+    printf("VERIFYING THE TREE WAS DROPPED AND THE BINS STILL HOLD EVERYTHING...\n");
+    assert(!arenas[0].indexed && !arenas[0].free_tree);
+    assert(verify_free_tree());
+    assert(verify_bins());
+    passed();
+
+    success("ALL FREE TREE TESTS PASSED");
+}
+
+size_t num_heap_errors;
+
+void count_heap_errors(heap_error_t error, size_t size)
+{
+    num_heap_errors++;
+}
+
+void test_malloc_bad_size()
+{
+    emphasis("TESTING MALLOC RETURNS NULL ON BAD VALUE SIZE REQUESTS");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+
+    printf("REQUESTING 1 CHUNK OF SIZE -1...\n");
+    chunks[0] = my_malloc(-1);
+    printf("VERIFYING RETURN IS NULL AND THE ERROR SAYS WHY...\n");
+    audit();
+    assert(chunks[0] == NULL);
+    assert(heap_last_error() == HEAP_SIZE_TOO_LARGE);
+    assert(errno == ENOMEM);
+    passed();
+
+    printf("REQUESTING LARGE NEGATIVE SIZE CHUNK...\n");
+    chunks[0] = my_malloc(-SIZE_OF_HEAP / 2);
+    printf("VERIFYING RETURN IS NULL AND THE ERROR SAYS WHY...\n");
+    audit();
+    assert(chunks[0] == NULL);
+    assert(heap_last_error() == HEAP_SIZE_TOO_LARGE);
+    passed();
+
+    printf("REQUESTING SIZE 0 CHUNK...\n");
+    chunks[0] = my_malloc(0);
+    printf("VERIFYING RETURN IS NULL AND THE ERROR SAYS WHY...\n");
+    audit();
+    assert(chunks[0] == NULL);
+    assert(heap_last_error() == HEAP_ZERO_SIZE);
+    assert(errno == EINVAL);
+    passed();
+
+    printf("REPLACING THE LOG HOOK AND REQUESTING 2 BAD SIZES...\n");
+    heap_log_hook_t prev_hook = set_heap_log_hook(count_heap_errors);
+    num_heap_errors = 0;
+    my_malloc(0);
+    my_malloc(-1);
+    printf("VERIFYING THE HOOK SAW BOTH...\n");
+    assert(num_heap_errors == 2);
+    printf("REMOVING THE LOG HOOK AND REQUESTING ANOTHER BAD SIZE...\n");
+    set_heap_log_hook(NULL);
+    my_malloc(0);
+    printf("VERIFYING NOTHING WAS LOGGED...\n");
+    assert(num_heap_errors == 2);
+    set_heap_log_hook(prev_hook);
+    passed();
+
+    success("ALL MALLOC BAD SIZE TESTS PASSED");
+}
+
+void test_heap_growth()
+{
+    emphasis("TESTING HEAP GROWS INTO NEW REGIONS WHEN IT RUNS OUT");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    // The main thread allocates from the first arena
+    arena_t *arena = &arenas[0];
+    size_t prev_num_regions = arena->num_regions;
+
+    printf("REQUESTING 1 CHUNK THAT IS TWICE THE SIZE OF HEAP...\n");
+    chunks[0] = my_malloc(2 * SIZE_OF_HEAP);
+    printf("VERIFYING IT WAS ALLOCATED OUTSIDE THE FIRST REGION...\n");
+    audit();
+    assert(chunks[0] != NULL);
+    assert(arena->num_regions == prev_num_regions + 1);
+    assert(chunks[0] < start_of_heap || chunks[0] >= start_of_heap + SIZE_OF_HEAP);
+    free_all_chunks();
+    passed();
+
+    printf("REQUESTING 1 CHUNK BIGGER THAN ANY FREE CHUNK...\n");
+    prev_num_regions = arena->num_regions;
+    size_t biggest_free = 0;
+    size_t biggest_region = 0;
+    for (size_t i = 0; i < NUM_BINS; i++)
+    {
+        for (node_t *curr = arena->bins[i]; curr; curr = curr->next)
+        {
+            biggest_free = chunk_size((header_t *)curr) > biggest_free ? chunk_size((header_t *)curr) : biggest_free;
+        }
+    }
+    for (size_t i = 0; i < arena->num_regions; i++)
+    {
+        biggest_region = arena->regions[i].size > biggest_region ? arena->regions[i].size : biggest_region;
+    }
+    chunks[0] = my_malloc(biggest_free + 1);
+    printf("VERIFYING NEW REGION IS AT LEAST DOUBLE THE SIZE OF THE BIGGEST ONE...\n");
+    audit();
+    assert(chunks[0] != NULL);
+    assert(arena->num_regions == prev_num_regions + 1);
+    size_t new_biggest_region = 0;
+    for (size_t i = 0; i < arena->num_regions; i++)
+    {
+        new_biggest_region = arena->regions[i].size > new_biggest_region ? arena->regions[i].size : new_biggest_region;
+    }
+    assert(new_biggest_region >= 2 * biggest_region);
+    free_all_chunks();
+    passed();
+
+    printf("ALLOCATING 5 CHUNKS ONCE THE HEAP HAS GROWN...\n");
+    prev_num_regions = arena->num_regions;
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(CHUNK_SIZE);
+    chunks[3] = my_malloc(CHUNK_SIZE);
+    chunks[4] = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING THEY WERE SERVED WITHOUT MAPPING ANOTHER REGION...\n");
+    audit();
+    assert(arena->num_regions == prev_num_regions);
+    printf("FREEING ALL CHUNKS...\n");
+    free_all_chunks();
+    printf("MAKING SURE THERE IS ONLY 1 FREE CHUNK PER REGION...\n");
+    audit();
+    assert(count_free_chunks() == total_regions());
+    passed();
+
+    success("ALL HEAP GROWTH TESTS PASSED");
+}
+
+#define NUM_THREADS 4
+#define CHUNKS_PER_THREAD 64
+#define THREAD_ROUNDS 200
+
+void *thread_chunks[NUM_THREADS][CHUNKS_PER_THREAD];
+
+// pthread_barrier_t isn't available everywhere, so this does the same job
+pthread_mutex_t barrier_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t barrier_cond = PTHREAD_COND_INITIALIZER;
+size_t barrier_waiting;
+size_t barrier_generation;
+
+/* Blocks until all NUM_THREADS threads have called it. */
+void wait_for_threads()
+{
+    pthread_mutex_lock(&barrier_lock);
+    size_t generation = barrier_generation;
+    if (++barrier_waiting == NUM_THREADS)
+    {
+        barrier_waiting = 0;
+        barrier_generation++;
+        pthread_cond_broadcast(&barrier_cond);
+    }
+    while (generation == barrier_generation)
+    {
+        pthread_cond_wait(&barrier_cond, &barrier_lock);
+    }
+    pthread_mutex_unlock(&barrier_lock);
+}
+
+/* Fills a chunk with a byte so we can tell if anyone else wrote over it. */
+void fill_chunk(void *chunk, size_t size, unsigned char byte)
+{
+    memset(chunk, byte, size);
+}
+
+bool chunk_filled_with(void *chunk, size_t size, unsigned char byte)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (((unsigned char *)chunk)[i] != byte)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Each round every thread allocates a set of chunks, then frees the set the next thread allocated. */
+void *stress_thread(void *arg)
+{
+    size_t id = (size_t)arg;
+    unsigned int seed = (unsigned int)id;
+
+    for (size_t round = 0; round < THREAD_ROUNDS; round++)
+    {
+        for (size_t i = 0; i < CHUNKS_PER_THREAD; i++)
+        {
+            // Mostly small sizes so the cache gets used, with the odd bigger one going to the shared heap
+            size_t size = rand_r(&seed) % 8 ? 8 + rand_r(&seed) % 200 : 512 + rand_r(&seed) % 2048;
+            thread_chunks[id][i] = my_malloc(size);
+            assert(thread_chunks[id][i] != NULL);
+            fill_chunk(thread_chunks[id][i], size < 8 ? size : 8, (unsigned char)id);
+        }
+
+        wait_for_threads();
+
+        // Free another thread's chunks
+        size_t other = (id + 1) % NUM_THREADS;
+        for (size_t i = 0; i < CHUNKS_PER_THREAD; i++)
+        {
+            assert(chunk_filled_with(thread_chunks[other][i], 8, (unsigned char)other));
+            my_free(thread_chunks[other][i]);
+        }
+
+        wait_for_threads();
+    }
+
+    return NULL;
+}
+
+void test_threads()
+{
+    emphasis("TESTING MANY THREADS ALLOCATING AND FREEING AT ONCE");
+
+    free_all_chunks();
+    size_t prev_tcache_limit = tcache_limit;
+    pthread_t threads[NUM_THREADS];
+
+    printf("TURNING ON THE THREAD CACHES...\n");
+    tcache_limit = TCACHE_MAX_COUNT;
+    printf("STARTING %d THREADS THAT EACH FREE THE CHUNKS ANOTHER THREAD ALLOCATED...\n", NUM_THREADS);
+    for (size_t i = 0; i < NUM_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, stress_thread, (void *)i);
+    }
+    for (size_t i = 0; i < NUM_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    printf("DRAINING WHAT THE THREADS LEFT ON EACH OTHER'S REMOTE FREE STACKS...\n");
+    drain_all_remote_frees();
+    printf("VERIFYING EXITED THREADS GAVE BACK THEIR CACHES AND THE HEAP IS INTACT...\n");
+    assert(verify_boundary_tags());
+    assert(verify_alternating());
+    assert(verify_bins());
+    assert(count_free_chunks() == total_regions());
+    passed();
+
+    printf("ALLOCATING AND FREEING THE SAME SMALL CHUNK ON ONE THREAD...\n");
+    void *chunk = my_malloc(CHUNK_SIZE / 4);
+    my_free(chunk);
+    printf("VERIFYING IT IS SERVED AGAIN FROM THE CACHE...\n");
+    assert(my_malloc(CHUNK_SIZE / 4) == chunk);
+    my_free(chunk);
+    free_all_chunks();
+    assert(count_free_chunks() == total_regions());
+    passed();
+
+    printf("FILLING THE HEAP SO THE ONLY FREE CHUNK LEFT IS ONE 128 BYTE CHUNK...\n");
+    tcache_limit = 0;
+    size_t prev_threshold = mmap_threshold;
+    mmap_threshold = MAX_REQUEST_SIZE;
+    chunk = my_malloc(128 - sizeof(header_t));
+    void *fillers[CHUNKS_PER_THREAD];
+    size_t num_fillers = 0;
+    for (mallinfo_t info = my_mallinfo(); info.free_chunks; info = my_mallinfo())
+    {
+        assert(num_fillers < CHUNKS_PER_THREAD);
+        fillers[num_fillers] = my_malloc(info.largest_free - sizeof(header_t));
+        assert(fillers[num_fillers++]);
+    }
+    my_free(chunk);
+    assert(count_free_chunks() == 1);
+    printf("ALLOCATING IT WITH THE THREAD CACHE ON...\n");
+    tcache_limit = TCACHE_MAX_COUNT;
+    size_t regions = total_regions();
+    uint64_t failures = my_mallinfo().failures;
+    errno = 0;
+    printf("VERIFYING FILLING THE REST OF THE CACHE BIN NEITHER GREW THE HEAP NOR REPORTED A FAILURE...\n");
+    assert(my_malloc(128 - sizeof(header_t)) == chunk);
+    assert(total_regions() == regions && my_mallinfo().failures == failures && errno == 0);
+    flush_tcache();
+    tcache_limit = 0;
+    mmap_threshold = prev_threshold;
+    my_free(chunk);
+    for (size_t i = 0; i < num_fillers; i++)
+    {
+        my_free(fillers[i]);
+    }
+    drain_all_remote_frees();
+    assert(count_free_chunks() == total_regions());
+    passed();
+
+    printf("CACHING A CHUNK AND A SMALL OBJECT, THEN SETTING THE HEAP UP AGAIN...\n");
+    tcache_limit = TCACHE_MAX_COUNT;
+    chunk = my_malloc(CHUNK_SIZE);
+    void *object = my_malloc(16);
+    my_free(chunk);
+    my_free(object);
+    init_heap();
+    printf("VERIFYING NEITHER IS HANDED OUT AGAIN AND THE NEW HEAP IS INTACT...\n");
+    assert(small_zone_used == 0);
+    chunk = my_malloc(CHUNK_SIZE);
+    object = my_malloc(16);
+    assert((char *)chunk > (char *)start_of_heap && (char *)chunk < (char *)start_of_heap + SIZE_OF_HEAP);
+    assert(is_small_object(object) && small_zone_used == SMALL_PAGE_SIZE);
+    my_free(chunk);
+    my_free(object);
+    flush_tcache();
+    tcache_limit = 0;
+    free_all_chunks();
+    assert(verify_boundary_tags());
+    assert(count_free_chunks() == total_regions() && total_regions() == 1);
+    passed();
+
+    tcache_limit = prev_tcache_limit;
+
+    success("ALL MULTI-THREADED TESTS PASSED");
+}
+
+size_t other_arena_size;
+
+/* Allocates a big chunk in this thread's own arena and frees it again so the arena has memory to spare. */
+void *fill_other_arena(void *arg)
+{
+    void *chunk = my_malloc(other_arena_size);
+    *(arena_t **)arg = chunk_arena((header_t *)chunk - 1);
+    my_free(chunk);
+    return NULL;
+}
+
+/* Allocates a 512 byte chunk with an allocated one after it from a new thread's arena, so freeing the first leaves a lone 512 byte free chunk there. */
+void *lone_chunk_in_other_arena(void *arg)
+{
+    ((void **)arg)[0] = my_malloc(512 - sizeof(header_t));
+    ((void **)arg)[1] = my_malloc(CHUNK_SIZE);
+    return NULL;
+}
+
+void test_arenas()
+{
+    emphasis("TESTING ARENAS ARE INDEPENDENT AND CAN BORROW FROM EACH OTHER");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+
+    if (num_arenas < 2)
+    {
+        printf("ONLY 1 ARENA, NOTHING TO TEST\n");
+        return;
+    }
+
+    printf("ALLOCATING 1 CHUNK ON THE MAIN THREAD...\n");
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    printf("VERIFYING IT CAME FROM THE FIRST ARENA...\n");
+    assert(chunk_arena((header_t *)chunks[0] - 1) == &arenas[0]);
+    free_all_chunks();
+    passed();
+
+    printf("GROWING ANOTHER ARENA FROM ANOTHER THREAD BIGGER THAN ANY FREE CHUNK IN THE FIRST...\n");
+    // These have to come from the arenas, however big they get
+    size_t prev_threshold = mmap_threshold;
+    mmap_threshold = MAX_REQUEST_SIZE;
+    size_t biggest_free = 0;
+    for (size_t i = 0; i < NUM_BINS; i++)
+    {
+        for (node_t *curr = arenas[0].bins[i]; curr; curr = curr->next)
+        {
+            biggest_free = chunk_size((header_t *)curr) > biggest_free ? chunk_size((header_t *)curr) : biggest_free;
+        }
+    }
+    other_arena_size = biggest_free + 2 * SIZE_OF_HEAP;
+    pthread_t thread;
+    arena_t *other = NULL;
+    pthread_create(&thread, NULL, fill_other_arena, &other);
+    pthread_join(thread, NULL);
+    printf("VERIFYING THE OTHER THREAD USED ITS OWN ARENA...\n");
+    assert(other != NULL && other != &arenas[0]);
+    assert(other->num_regions == 1);
+    passed();
+
+    printf("REQUESTING 1 CHUNK ON THE MAIN THREAD THAT ONLY FITS IN THE OTHER ARENA...\n");
+    size_t prev_num_regions = total_regions();
+    chunks[0] = my_malloc(biggest_free + SIZE_OF_HEAP);
+    printf("VERIFYING IT WAS BORROWED INSTEAD OF MAPPING A NEW REGION...\n");
+    audit();
+    assert(chunk_arena((header_t *)chunks[0] - 1) == other);
+    assert(total_regions() == prev_num_regions);
+    printf("FREEING IT FROM THE MAIN THREAD...\n");
+    my_free(chunks[0]);
+    printf("VERIFYING IT IS WAITING ON THE OTHER ARENA'S REMOTE FREE STACK...\n");
+    assert(other->remote_frees == (node_t *)((header_t *)chunks[0] - 1));
+    printf("DRAINING THE REMOTE FREE STACKS...\n");
+    drain_all_remote_frees();
+    printf("VERIFYING IT WENT BACK TO THE ARENA IT CAME FROM...\n");
+    assert(other->remote_frees == NULL);
+    assert(verify_bins());
+    assert(count_free_chunks() == total_regions());
+    mmap_threshold = prev_threshold;
+    passed();
+
+    printf("SWITCHING ONLY THE OTHER ARENA TO WORST FIT...\n");
+    set_arena_policy(other, POLICY_WORST_FIT);
+    printf("VERIFYING IT WAS INDEXED AND THE FIRST ARENA WAS LEFT ALONE...\n");
+    assert(other->policy == POLICY_WORST_FIT && other->indexed);
+    assert(arenas[0].policy == POLICY_SEGREGATED_FIT && !arenas[0].indexed);
+    assert(verify_free_tree());
+    set_arena_policy(other, POLICY_SEGREGATED_FIT);
+    passed();
+
+    printf("LEAVING ONE 512 BYTE FREE CHUNK IN THE WHOLE HEAP, IN ANOTHER ARENA...\n");
+    free_all_chunks();
+    mmap_threshold = MAX_REQUEST_SIZE;
+    void *lone[2];
+    // New threads take the arenas in turn, so keep going until one gets something other than the first
+    do
+    {
+        pthread_create(&thread, NULL, lone_chunk_in_other_arena, lone);
+        pthread_join(thread, NULL);
+        other = chunk_arena((header_t *)lone[0] - 1);
+        if (other == &arenas[0])
+        {
+            my_free(lone[0]);
+            my_free(lone[1]);
+        }
+    } while (other == &arenas[0]);
+    assert(chunk_size((header_t *)lone[0] - 1) == 512);
+    for (mallinfo_t info = my_mallinfo(); info.free_chunks; info = my_mallinfo())
+    {
+        assert(my_malloc(info.largest_free - sizeof(header_t)));
+    }
+    my_free(lone[0]);
+    drain_all_remote_frees();
+    assert(count_free_chunks() == 1);
+    printf("FILLING THE THREAD CACHE WITH 496 BYTE CHUNKS, WHICH CAN ONLY TAKE ALL OF IT...\n");
+    tcache_limit = TCACHE_MAX_COUNT;
+    chunks[0] = my_malloc(496 - sizeof(header_t));
+    chunks[1] = my_malloc(16);
+    printf("VERIFYING IT WENT BACK TO ITS OWN ARENA INSTEAD OF A THREAD CACHE BIN...\n");
+    assert(chunks[0] && chunks[1]);
+    assert(other->remote_frees == (node_t *)((header_t *)lone[0] - 1));
+    flush_tcache();
+    tcache_limit = 0;
+    drain_all_remote_frees();
+    assert(verify_bins());
+    mmap_threshold = prev_threshold;
+    free_all_chunks();
+    passed();
+
+    success("ALL ARENA TESTS PASSED");
+}
+
+void test_realloc()
+{
+    emphasis("TESTING REALLOC RESIZES IN PLACE WHEN IT CAN");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+
+    printf("ALLOCATING 3 CHUNKS AND FILLING THE FIRST ONE...\n");
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(CHUNK_SIZE);
+    assert(next_chunk((header_t *)chunks[0] - 1) == (header_t *)chunks[1] - 1);
+    memset(chunks[0], 'a', CHUNK_SIZE);
+    printf("FREEING THE SECOND CHUNK AND GROWING THE FIRST INTO IT...\n");
+    my_free(chunks[1]);
+    void *grown = my_realloc(chunks[0], CHUNK_SIZE + CHUNK_SIZE / 2);
+    printf("VERIFYING IT DIDN'T MOVE AND KEPT ITS CONTENTS...\n");
+    audit();
+    assert(grown == chunks[0]);
+    assert(my_malloc_usable_size(grown) >= CHUNK_SIZE + CHUNK_SIZE / 2);
+    for (size_t i = 0; i < CHUNK_SIZE; i++)
+    {
+        assert(((char *)grown)[i] == 'a');
+    }
+    printf("VERIFYING WHAT IT DIDN'T NEED WAS LEFT FREE...\n");
+    assert(!(next_chunk((header_t *)grown - 1)->size_flags & CHUNK_IN_USE));
+    passed();
+
+    printf("SHRINKING IT BACK DOWN...\n");
+    size_t prev_free_chunks = count_free_chunks();
+    void *shrunk = my_realloc(grown, CHUNK_SIZE / 4);
+    printf("VERIFYING IT DIDN'T MOVE AND THE TAIL MERGED WITH THE FREE CHUNK AFTER IT...\n");
+    audit();
+    assert(shrunk == chunks[0]);
+    assert(my_malloc_usable_size(shrunk) < CHUNK_SIZE);
+    assert(count_free_chunks() == prev_free_chunks);
+    passed();
+
+    printf("GROWING IT PAST THE ALLOCATED CHUNK AFTER IT...\n");
+    memset(shrunk, 'b', CHUNK_SIZE / 4);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    void *moved = my_realloc(shrunk, 4 * CHUNK_SIZE);
+    printf("VERIFYING IT MOVED AND THE CONTENTS CAME WITH IT...\n");
+    audit();
+    assert(moved && moved != shrunk);
+    for (size_t i = 0; i < CHUNK_SIZE / 4; i++)
+    {
+        assert(((char *)moved)[i] == 'b');
+    }
+    free_all_chunks();
+    passed();
+
+    printf("REALLOCATING NULL AND THEN TO SIZE 0...\n");
+    chunks[0] = my_realloc(NULL, CHUNK_SIZE);
+    assert(chunks[0] != NULL);
+    printf("VERIFYING THE SECOND ONE FREED THE CHUNK...\n");
+    assert(my_realloc(chunks[0], 0) == NULL);
+    audit();
+    assert(count_free_chunks() == total_regions());
+    passed();
+
+    success("ALL REALLOC TESTS PASSED");
+}
+
+void test_calloc()
+{
+    emphasis("TESTING CALLOC ONLY HANDS OUT ZEROED MEMORY");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+
+    printf("DIRTYING A CHUNK AND FREEING IT...\n");
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    memset(chunks[0], 0xff, CHUNK_SIZE);
+    my_free(chunks[0]);
+    printf("CALLOCING THE SAME SIZE...\n");
+    chunks[0] = my_calloc(CHUNK_SIZE, 1);
+    printf("VERIFYING IT GOT THE DIRTY CHUNK BACK AND CLEARED IT...\n");
+    audit();
+    assert(!(((header_t *)chunks[0] - 1)->size_flags & CHUNK_ZEROED));
+    for (size_t i = 0; i < CHUNK_SIZE; i++)
+    {
+        assert(((char *)chunks[0])[i] == 0);
+    }
+    free_all_chunks();
+    passed();
+
+    printf("CALLOCING FROM A FRESHLY MAPPED REGION...\n");
+    size_t prev_num_regions = arenas[0].num_regions;
+    chunks[0] = my_calloc(1, arenas[0].next_region_size);
+    printf("VERIFYING IT IS ALL ZERO...\n");
+    audit();
+    assert(chunks[0] != NULL);
+    assert(arenas[0].num_regions == prev_num_regions + 1);
+    for (size_t i = 0; i < my_malloc_usable_size(chunks[0]); i++)
+    {
+        assert(((char *)chunks[0])[i] == 0);
+    }
+    free_all_chunks();
+    passed();
+
+    printf("CALLOCING A COUNT AND SIZE THAT OVERFLOW...\n");
+    chunks[0] = my_calloc(SIZE_MAX / 2, 4);
+    printf("VERIFYING RETURN IS NULL AND THE ERROR SAYS WHY...\n");
+    audit();
+    assert(chunks[0] == NULL);
+    assert(heap_last_error() == HEAP_SIZE_TOO_LARGE);
+    passed();
+
+    success("ALL CALLOC TESTS PASSED");
+}
+
+void test_aligned_alloc()
+{
+    emphasis("TESTING ALIGNED ALLOCATIONS");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+
+    printf("ALLOCATING CHUNKS ALIGNED TO 16 THROUGH 4096 BYTES...\n");
+    size_t num_chunks = 0;
+    for (size_t alignment = 16; alignment <= 4096; alignment *= 4)
+    {
+        // Knock the next address off alignment so the leading gap has to be split off
+        chunks[num_chunks++] = my_malloc(8);
+        chunks[num_chunks] = my_aligned_alloc(alignment, CHUNK_SIZE);
+        printf("VERIFYING THE CHUNK ALIGNED TO %zu IS ALIGNED...\n", alignment);
+        assert(chunks[num_chunks] != NULL);
+        assert(((uintptr_t)chunks[num_chunks] & (alignment - 1)) == 0);
+        memset(chunks[num_chunks], 'a', CHUNK_SIZE);
+        num_chunks++;
+    }
+    audit();
+    free_all_chunks();
+    printf("MAKING SURE THERE IS ONLY 1 FREE CHUNK PER REGION...\n");
+    audit();
+    assert(count_free_chunks() == total_regions());
+    passed();
+
+    printf("ASKING FOR AN ALIGNMENT THAT ISN'T A POWER OF TWO...\n");
+    void *ptr = NULL;
+    assert(my_aligned_alloc(24, CHUNK_SIZE) == NULL);
+    assert(heap_last_error() == HEAP_BAD_ALIGNMENT);
+    assert(errno == EINVAL);
+    assert(my_posix_memalign(&ptr, 24, CHUNK_SIZE) == EINVAL);
+    printf("ASKING POSIX MEMALIGN FOR A GOOD ONE...\n");
+    assert(my_posix_memalign(&ptr, 64, CHUNK_SIZE) == 0);
+    assert(ptr && ((uintptr_t)ptr & 63) == 0);
+    audit();
+    free_all_chunks();
+    passed();
+
+    printf("ALIGNING BLOCKS ON EITHER SIDE OF THE MMAP THRESHOLD...\n");
+    align_around_threshold(64);
+    free_all_chunks();
+    passed();
+
+    success("ALL ALIGNED ALLOCATION TESTS PASSED");
+}
+
+void test_trace()
+{
+    emphasis("TESTING ALLOCATION CALLS ARE TRACED TO A FILE");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    char path[] = "/tmp/malloc_free_trace_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    printf("TRACING A MALLOC, REALLOC, CALLOC, ALIGNED ALLOC AND 3 FREES...\n");
+    assert(trace_start(path) == 0);
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    void *moved_from = chunks[0];
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[0] = my_realloc(chunks[0], 2 * CHUNK_SIZE);
+    chunks[2] = my_calloc(4, CHUNK_SIZE / 4);
+    chunks[3] = my_aligned_alloc(256, CHUNK_SIZE);
+    my_free(chunks[1]);
+    my_free(chunks[0]);
+    my_free(chunks[3]);
+    trace_stop();
+    printf("VERIFYING ALLOCATING AFTER STOPPING ISN'T TRACED...\n");
+    my_free(chunks[2]);
+
+    printf("READING THE TRACE BACK...\n");
+    FILE *file = fopen(path, "rb");
+    assert(file);
+    trace_file_header_t header;
+    assert(fread(&header, sizeof(header), 1, file) == 1);
+    assert(!memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)));
+    assert(header.version == TRACE_VERSION && header.record_size == sizeof(trace_record_t));
+    assert(header.start == start);
+    trace_record_t records[10];
+    size_t num_records = fread(records, sizeof(trace_record_t), 10, file);
+    fclose(file);
+    unlink(path);
+
+    printf("VERIFYING EVERY CALL WAS RECORDED ONCE AND IN ORDER...\n");
+    assert(num_records == 8);
+    trace_op_t ops[] = {TRACE_MALLOC, TRACE_MALLOC, TRACE_REALLOC, TRACE_CALLOC, TRACE_ALIGNED, TRACE_FREE, TRACE_FREE, TRACE_FREE};
+    for (size_t i = 0; i < num_records; i++)
+    {
+        assert(records[i].op == ops[i]);
+        assert(i == 0 || records[i].time >= records[i - 1].time);
+        assert(records[i].thread == records[0].thread);
+    }
+    printf("VERIFYING THE OFFSETS MATCH WHAT AUDIT WOULD SHOW...\n");
+    assert(records[0].offset == (int64_t)((uint64_t)moved_from - start) && records[0].size == CHUNK_SIZE);
+    assert(records[2].offset == (int64_t)((uint64_t)chunks[0] - start) && records[2].extra == records[0].offset);
+    assert(records[2].size == 2 * CHUNK_SIZE);
+    assert(records[3].size == CHUNK_SIZE);
+    assert(records[4].offset == (int64_t)((uint64_t)chunks[3] - start) && records[4].extra == 256);
+    assert(records[5].offset == records[1].offset);
+    assert(records[6].offset == records[2].offset);
+    assert(records[7].offset == records[4].offset);
+    audit();
+    passed();
+
+    success("ALL TRACE TESTS PASSED");
+}
+
+/* Counts the slabs on one of a cache's lists. */
+static size_t count_slabs(slab_t *slab)
+{
+    size_t num_slabs = 0;
+    for (; slab; slab = slab->next)
+    {
+        num_slabs++;
+    }
+    return num_slabs;
+}
+
+void test_slab()
+{
+    emphasis("TESTING SLAB CACHES OF FIXED SIZE OBJECTS");
+
+    free_all_chunks();
+
+    printf("CREATING A CACHE OF 24 BYTE OBJECTS...\n");
+    slab_cache_t *cache = slab_create(24, 0);
+    assert(cache);
+    printf("VERIFYING THEY ARE PACKED SO NONE STRADDLES A CACHE LINE...\n");
+    assert(cache->stride == 32);
+    assert(cache->first_offset % CACHE_LINE == 0);
+    assert(cache->slab_size == SLAB_SIZE);
+    passed();
+
+    printf("FILLING 2 SLABS...\n");
+    size_t num_objs = 2 * cache->objs_per_slab;
+    char *objs[num_objs];
+    for (size_t i = 0; i < num_objs; i++)
+    {
+        objs[i] = slab_alloc(cache);
+        assert(objs[i]);
+        memset(objs[i], 'a', 24);
+    }
+    printf("VERIFYING OBJECTS IN A SLAB SIT BACK TO BACK WITH NO HEADERS...\n");
+    audit();
+    for (size_t i = 1; i < cache->objs_per_slab; i++)
+    {
+        assert(objs[i] == objs[i - 1] + cache->stride);
+    }
+    assert(count_slabs(cache->full) == 2 && !cache->partial);
+    passed();
+
+    printf("FREEING AN OBJECT AND ALLOCATING ANOTHER...\n");
+    slab_free(cache, objs[5]);
+    assert(count_slabs(cache->partial) == 1);
+    printf("VERIFYING IT REUSED THE FREED ONE...\n");
+    assert(slab_alloc(cache) == objs[5]);
+    assert(count_slabs(cache->full) == 2 && !cache->partial);
+    passed();
+
+    printf("FREEING EVERY OBJECT...\n");
+    for (size_t i = 0; i < num_objs; i++)
+    {
+        slab_free(cache, objs[i]);
+    }
+    printf("VERIFYING ONE EMPTY SLAB IS KEPT AND THE OTHER WENT BACK TO THE HEAP...\n");
+    audit();
+    assert(!cache->full && !cache->partial && cache->empty);
+    printf("VERIFYING THE NEXT OBJECT COMES FROM THE START OF THE KEPT SLAB...\n");
+    slab_t *kept = cache->empty;
+    assert(slab_alloc(cache) == (char *)kept + cache->first_offset);
+    assert(cache->partial == kept);
+    slab_destroy(cache);
+    passed();
+
+    printf("CREATING A CACHE OF 100 BYTE OBJECTS ALIGNED TO 64...\n");
+    cache = slab_create(100, 64);
+    assert(cache && cache->stride == 128);
+    for (size_t i = 0; i < 10; i++)
+    {
+        objs[i] = slab_alloc(cache);
+        assert(((uintptr_t)objs[i] & 63) == 0);
+    }
+    printf("VERIFYING BAD SIZES AND ALIGNMENTS ARE REFUSED...\n");
+    assert(!slab_create(0, 8) && errno == EINVAL);
+    assert(!slab_create(32, 24) && errno == EINVAL);
+    slab_destroy(cache);
+    printf("MAKING SURE DESTROYING THE CACHES GAVE EVERYTHING BACK...\n");
+    audit();
+    assert(count_free_chunks() == total_regions());
+    passed();
+
+    success("ALL SLAB TESTS PASSED");
+}
+
+void test_bump_arena()
+{
+    emphasis("TESTING BUMP ARENAS THROW AWAY THEIR ALLOCATIONS TOGETHER");
+
+    free_all_chunks();
+
+    printf("CREATING AN ARENA WITH 1024 BYTE BLOCKS AND ALLOCATING 4 OBJECTS...\n");
+    bump_arena_t *arena = bump_arena_create(1024);
+    assert(arena);
+    char *objs[16];
+    for (size_t i = 0; i < 4; i++)
+    {
+        objs[i] = bump_arena_alloc(arena, 100);
+        assert(objs[i]);
+        memset(objs[i], 'a', 100);
+    }
+    printf("VERIFYING THEY ARE BACK TO BACK IN ONE BLOCK...\n");
+    audit();
+    for (size_t i = 0; i < 4; i++)
+    {
+        assert(((uintptr_t)objs[i] & (ALIGN_TO - 1)) == 0);
+        assert(i == 0 || objs[i] == objs[i - 1] + 112);
+    }
+    assert(arena->current && !arena->current->prev);
+    char *first = objs[0];
+    passed();
+
+    printf("SAVING A MARK AND FILLING 2 MORE BLOCKS...\n");
+    bump_mark_t outer = bump_arena_save(arena);
+    char *after_outer = bump_arena_alloc(arena, 100);
+    for (size_t i = 0; i < 16; i++)
+    {
+        objs[i] = bump_arena_alloc(arena, 100);
+    }
+    printf("SAVING A NESTED MARK AND ALLOCATING 1 MORE...\n");
+    bump_mark_t inner = bump_arena_save(arena);
+    char *after_inner = bump_arena_alloc(arena, 100);
+    printf("VERIFYING RESTORING THE NESTED MARK HANDS OUT THE SAME ADDRESS AGAIN...\n");
+    bump_arena_restore(arena, inner);
+    assert(bump_arena_alloc(arena, 100) == after_inner);
+    printf("VERIFYING RESTORING THE OUTER MARK GIVES THE NEW BLOCKS BACK TO THE HEAP...\n");
+    bump_arena_restore(arena, outer);
+    audit();
+    assert(!arena->current->prev);
+    assert(bump_arena_alloc(arena, 100) == after_outer);
+    passed();
+
+    printf("ALLOCATING SOMETHING BIGGER THAN A BLOCK...\n");
+    char *big = bump_arena_alloc(arena, 4096);
+    assert(big);
+    memset(big, 'b', 4096);
+    printf("RESETTING THE ARENA...\n");
+    bump_arena_reset(arena);
+    printf("VERIFYING ONLY THE FIRST BLOCK IS KEPT AND ALLOCATING STARTS AGAIN AT THE FRONT...\n");
+    audit();
+    assert(!arena->current->prev);
+    assert(bump_arena_alloc(arena, 8) == first);
+    passed();
+
+    printf("DESTROYING THE ARENA...\n");
+    bump_arena_destroy(arena);
+    printf("MAKING SURE EVERY BLOCK WENT BACK TO THE HEAP...\n");
+    audit();
+    assert(count_free_chunks() == total_regions());
+    passed();
+
+    success("ALL BUMP ARENA TESTS PASSED");
+}
+
+void test_mmap()
+{
+    emphasis("TESTING LARGE CHUNKS GET MAPPINGS OF THEIR OWN");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    size_t prev_threshold = mmap_threshold;
+    int prev_dynamic = mmap_threshold_dynamic;
+    size_t prev_mmapped = mmapped_chunks;
+    size_t prev_regions = total_regions();
+    mmap_threshold = 64 * 1024;
+    mmap_threshold_dynamic = 0;
+
+    printf("ALLOCATING 1 CHUNK ABOVE THE THRESHOLD...\n");
+    chunks[0] = my_malloc(100 * 1024);
+    printf("VERIFYING IT HAS ITS OWN MAPPING OUTSIDE THE REGIONS...\n");
+    audit();
+    header_t *hptr = (header_t *)chunks[0] - 1;
+    assert(hptr->size_flags & CHUNK_MMAPPED);
+    assert(((uintptr_t)chunks[0] & (SIZE_OF_HEAP - 1)) == ALIGN_TO);
+    assert(mmapped_chunks == prev_mmapped + 1);
+    assert(total_regions() == prev_regions);
+    passed();
+
+    printf("GROWING IT TO 1 MB...\n");
+    memset(chunks[0], 'a', 100 * 1024);
+    size_t prev_bytes = mmapped_bytes;
+    chunks[0] = my_realloc(chunks[0], 1024 * 1024);
+    printf("VERIFYING IT IS STILL MAPPED AND KEPT ITS CONTENTS...\n");
+    hptr = (header_t *)chunks[0] - 1;
+    assert(hptr->size_flags & CHUNK_MMAPPED);
+    assert(my_malloc_usable_size(chunks[0]) >= 1024 * 1024);
+    assert(mmapped_bytes > prev_bytes);
+    assert(((char *)chunks[0])[0] == 'a' && ((char *)chunks[0])[100 * 1024 - 1] == 'a');
+    printf("SHRINKING IT BELOW THE THRESHOLD...\n");
+    chunks[0] = my_realloc(chunks[0], CHUNK_SIZE);
+    printf("VERIFYING IT MOVED INTO THE HEAP AND THE MAPPING IS GONE...\n");
+    audit();
+    assert(!(((header_t *)chunks[0] - 1)->size_flags & CHUNK_MMAPPED));
+    assert(((char *)chunks[0])[CHUNK_SIZE - 1] == 'a');
+    assert(mmapped_chunks == prev_mmapped);
+    free_all_chunks();
+    passed();
+
+    printf("ALLOCATING A ZEROED AND AN ALIGNED CHUNK ABOVE THE THRESHOLD...\n");
+    chunks[0] = my_calloc(200, 1024);
+    chunks[1] = my_aligned_alloc(8192, 100 * 1024);
+    printf("VERIFYING BOTH ARE MAPPED, ZEROED AND ALIGNED...\n");
+    assert(mmapped_chunks == prev_mmapped + 2);
+    for (size_t i = 0; i < 200 * 1024; i++)
+    {
+        assert(((char *)chunks[0])[i] == 0);
+    }
+    assert(((uintptr_t)chunks[1] & 8191) == 0);
+    assert(my_malloc_usable_size(chunks[1]) >= 100 * 1024);
+    memset(chunks[1], 'b', 100 * 1024);
+    my_free(chunks[0]);
+    my_free(chunks[1]);
+    assert(mmapped_chunks == prev_mmapped);
+    passed();
+
+    printf("TURNING ON THE DYNAMIC THRESHOLD AND FREEING A MAPPED CHUNK...\n");
+    mmap_threshold_dynamic = 1;
+    chunks[0] = my_malloc(100 * 1024);
+    size_t mapped_size = chunk_size((header_t *)chunks[0] - 1);
+    my_free(chunks[0]);
+    printf("VERIFYING THE THRESHOLD ROSE AND THE SAME SIZE NOW COMES FROM THE HEAP...\n");
+    assert(mmap_threshold == mapped_size);
+    chunks[0] = my_malloc(100 * 1024);
+    assert(!(((header_t *)chunks[0] - 1)->size_flags & CHUNK_MMAPPED));
+    free_all_chunks();
+    passed();
+
+    mmap_threshold = prev_threshold;
+    mmap_threshold_dynamic = prev_dynamic;
+
+    success("ALL MMAP TESTS PASSED");
+}
+
+/* Returns 1 if the page holding ptr is in memory. */
+static int page_resident(void *ptr)
+{
+    unsigned char resident = 0;
+    void *page = (void *)((uintptr_t)ptr & ~(uintptr_t)(SIZE_OF_HEAP - 1));
+    assert(mincore(page, SIZE_OF_HEAP, (void *)&resident) == 0);
+    return resident & 1;
+}
+
+void test_trim()
+{
+    emphasis("TESTING FREE MEMORY IS RETURNED TO THE OS");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    arena_t *arena = &arenas[0];
+    // These have to come from the arena, however big they get
+    size_t prev_threshold = mmap_threshold;
+    mmap_threshold = MAX_REQUEST_SIZE;
+
+    printf("ALLOCATING 1 CHUNK THAT NEEDS A NEW REGION AND FREEING IT...\n");
+    size_t prev_num_regions = arena->num_regions;
+    chunks[0] = my_malloc(arena->next_region_size / 2);
+    assert(arena->num_regions == prev_num_regions + 1);
+    memset(chunks[0], 'a', arena->next_region_size / 4);
+    my_free(chunks[0]);
+    printf("VERIFYING A BIG ENOUGH PAD KEEPS IT...\n");
+    assert(my_trim(SIZE_MAX) == 0);
+    assert(arena->num_regions == prev_num_regions + 1);
+    printf("VERIFYING TRIMMING WITH NO PAD UNMAPS EVERY REGION THAT IS ENTIRELY FREE...\n");
+    assert(my_trim(0) > 0);
+    audit();
+    assert(arena->num_regions == 1 && arena->regions[0].base == start_of_heap);
+    passed();
+
+    printf("ALLOCATING A BIG CHUNK, WRITING TO IT AND SHRINKING IT SO THE REST IS FREE...\n");
+    size_t big_size = 12 * SIZE_OF_HEAP;
+    chunks[0] = my_malloc(2 * big_size);
+    memset(chunks[0], 'a', 2 * big_size);
+    chunks[0] = my_realloc(chunks[0], CHUNK_SIZE);
+    node_t *trimmed = (node_t *)next_chunk((header_t *)chunks[0] - 1);
+    char *middle = (char *)trimmed + big_size;
+    assert(!(trimmed->size_flags & CHUNK_IN_USE));
+    assert(page_resident(middle));
+    printf("VERIFYING TRIMMING RELEASES THE PAGES INSIDE THE FREE CHUNK BUT KEEPS ITS TAGS...\n");
+    assert(my_trim(0) >= big_size);
+    audit();
+    assert(!page_resident(middle));
+    assert(trimmed->size_flags & CHUNK_TRIMMED);
+    printf("VERIFYING TRIMMING AGAIN DOESN'T RELEASE IT TWICE...\n");
+    assert(my_trim(0) == 0);
+    printf("VERIFYING THE SPACE CAN STILL BE ALLOCATED...\n");
+    chunks[1] = my_malloc(big_size);
+    assert(chunks[1] && !(((header_t *)chunks[1] - 1)->size_flags & CHUNK_TRIMMED));
+    memset(chunks[1], 'b', big_size);
+    free_all_chunks();
+    passed();
+
+    printf("STARTING THE BACKGROUND TRIMMER WITH A 20 MS DECAY...\n");
+    assert(start_background_trim(20) == 0);
+    assert(start_background_trim(20) == EBUSY);
+    chunks[0] = my_malloc(2 * big_size);
+    memset(chunks[0], 'c', 2 * big_size);
+    chunks[0] = my_realloc(chunks[0], CHUNK_SIZE);
+    middle = (char *)next_chunk((header_t *)chunks[0] - 1) + big_size;
+    assert(page_resident(middle));
+    printf("VERIFYING THE FREED PAGES ARE RELEASED WITHIN A FEW DECAY PERIODS...\n");
+    for (size_t i = 0; i < 50 && page_resident(middle); i++)
+    {
+        usleep(10000);
+    }
+    stop_background_trim();
+    audit();
+    assert(!page_resident(middle));
+    free_all_chunks();
+    mmap_threshold = prev_threshold;
+    passed();
+
+    success("ALL TRIM TESTS PASSED");
+}
+
+#ifdef __linux__
+/* Returns 1 if the kernel has the mapping starting at base marked for transparent huge pages. */
+static int huge_page_advised(void *base)
+{
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    assert(smaps);
+    char line[512];
+    int in_mapping = 0;
+    int advised = 0;
+    while (fgets(line, sizeof(line), smaps))
+    {
+        uintptr_t from, to;
+        // Each mapping starts with its address range, followed by its fields
+        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR, &from, &to) == 2)
+        {
+            in_mapping = from == (uintptr_t)base;
+        }
+        else if (in_mapping && !strncmp(line, "VmFlags:", 8))
+        {
+            advised = strstr(line, " hg") != NULL;
+            break;
+        }
+    }
+    fclose(smaps);
+    return advised;
+}
+#endif
+
+void test_huge_pages()
+{
+    emphasis("TESTING HUGE PAGE BACKED REGIONS");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    arena_t *arena = &arenas[0];
+    size_t prev_threshold = mmap_threshold;
+    huge_pages_t prev_huge_pages = huge_pages;
+    mmap_threshold = MAX_REQUEST_SIZE;
+    huge_pages = HUGE_PAGES_ADVISE;
+
+    printf("ALLOCATING 1 CHUNK THAT NEEDS A NEW REGION...\n");
+    size_t prev_num_regions = arena->num_regions;
+    size_t size = arena->next_region_size / 2;
+    chunks[0] = my_malloc(size);
+    assert(arena->num_regions == prev_num_regions + 1);
+    region_t *region = NULL;
+    for (size_t i = 0; i < arena->num_regions; i++)
+    {
+        if ((char *)chunks[0] > (char *)arena->regions[i].base && (char *)chunks[0] < (char *)arena->regions[i].base + arena->regions[i].size)
+        {
+            region = &arena->regions[i];
+        }
+    }
+    assert(region);
+    printf("VERIFYING THE REGION IS WHOLE HUGE PAGES AND ALIGNED TO THEM...\n");
+    assert(((uintptr_t)region->base & (HUGE_PAGE_SIZE - 1)) == 0);
+    assert(region->size >= HUGE_PAGE_SIZE && (region->size & (HUGE_PAGE_SIZE - 1)) == 0);
+    assert(arena->next_region_size == 2 * region->size);
+#ifdef __linux__
+    printf("VERIFYING THE KERNEL WAS ASKED TO BACK IT WITH HUGE PAGES...\n");
+    assert(huge_page_advised(region->base));
+#endif
+    memset(chunks[0], 'a', size);
+    audit();
+    passed();
+
+    printf("FREEING IT AND TRIMMING...\n");
+    free_all_chunks();
+    assert(my_trim(0) > 0);
+    printf("VERIFYING THE WHOLE REGION WAS UNMAPPED...\n");
+    audit();
+    assert(arena->num_regions == 1 && arena->regions[0].base == start_of_heap);
+    passed();
+
+    huge_pages = prev_huge_pages;
+    mmap_threshold = prev_threshold;
+
+    success("ALL HUGE PAGE TESTS PASSED");
+}
+
+void test_mallinfo()
+{
+    emphasis("TESTING HEAP STATISTICS");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    mallinfo_t before = my_mallinfo();
+
+    printf("ALLOCATING 3 CHUNKS AND FREEING THE MIDDLE ONE...\n");
+    chunks[0] = my_malloc(CHUNK_SIZE);
+    chunks[1] = my_malloc(CHUNK_SIZE);
+    chunks[2] = my_malloc(CHUNK_SIZE);
+    my_free(chunks[1]);
+    mallinfo_t info = my_mallinfo();
+    printf("VERIFYING THE CALLS WERE COUNTED...\n");
+    assert(info.mallocs == before.mallocs + 3);
+    assert(info.frees == before.frees + 1);
+    assert(info.in_use_bytes == before.in_use_bytes + 2 * align(CHUNK_SIZE));
+    printf("VERIFYING THE TOTALS MATCH A WALK OF THE HEAP...\n");
+    audit();
+    size_t free_bytes = 0;
+    size_t largest_free = 0;
+    size_t fenceposts = 0;
+    size_t arena_bytes = 0;
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        for (size_t i = 0; i < arenas[a].num_regions; i++)
+        {
+            arena_bytes += arenas[a].regions[i].size;
+            header_t *chunk = first_chunk(&arenas[a].regions[i]);
+            for (; chunk_size(chunk); chunk = next_chunk(chunk))
+            {
+                if (!(chunk->size_flags & CHUNK_IN_USE))
+                {
+                    free_bytes += chunk_size(chunk);
+                    largest_free = chunk_size(chunk) > largest_free ? chunk_size(chunk) : largest_free;
+                }
+            }
+            fenceposts += ALIGN_TO;
+        }
+    }
+    assert(info.free_bytes == free_bytes);
+    assert(info.free_chunks == count_free_chunks());
+    assert(info.largest_free == largest_free);
+    assert(info.arena_bytes == arena_bytes);
+    assert(info.in_use_bytes + info.free_bytes + fenceposts == info.arena_bytes);
+    assert(info.regions == total_regions());
+    passed();
+
+    printf("ASKING FOR 0 BYTES...\n");
+    assert(my_malloc(0) == NULL);
+    printf("VERIFYING THE FAILURE WAS COUNTED...\n");
+    assert(my_mallinfo().failures == info.failures + 1);
+    passed();
+
+    printf("DUMPING THE TOTALS AS JSON...\n");
+    char json[1024];
+    int length = my_mallinfo_json(json, sizeof(json));
+    printf("%s\n", json);
+    printf("VERIFYING IT IS ONE OBJECT WITH EVERY COUNTER...\n");
+    assert(length > 0 && (size_t)length < sizeof(json));
+    assert(json[0] == '{' && json[length - 1] == '}');
+    assert(strstr(json, "\"in_use_bytes\": ") && strstr(json, "\"largest_free\": ") && strstr(json, "\"failures\": "));
+    free_all_chunks();
+    passed();
+
+    success("ALL HEAP STATISTICS TESTS PASSED");
+}
+
+void test_small_objects()
+{
+    emphasis("TESTING SMALL OBJECTS");
+
+    free_all_chunks();
+    size_t prev_small_object_limit = small_object_limit;
+    small_object_limit = SMALL_OBJECT_LIMIT;
+    if (!small_zone)
+    {
+        printf("NO ADDRESS SPACE FOR SMALL PAGES, SKIPPING...\n");
+        success("ALL SMALL OBJECT TESTS PASSED");
+        return;
+    }
+
+    printf("ALLOCATING ONE OBJECT OF EVERY SMALL SIZE...\n");
+    void *objects[NUM_SMALL_CLASSES];
+    mallinfo_t before = my_mallinfo();
+    size_t total = 0;
+    for (size_t i = 0; i < NUM_SMALL_CLASSES; i++)
+    {
+        objects[i] = my_malloc((i + 1) * ALIGN_TO - 1);
+        total += (i + 1) * ALIGN_TO;
+    }
+    printf("VERIFYING EACH CAME FROM ITS OWN PAGE WITH NO HEADER...\n");
+    for (size_t i = 0; i < NUM_SMALL_CLASSES; i++)
+    {
+        assert(is_small_object(objects[i]));
+        assert(((uintptr_t)objects[i] & (ALIGN_TO - 1)) == 0);
+        assert(small_page(objects[i])->size == (i + 1) * ALIGN_TO);
+        assert(my_malloc_usable_size(objects[i]) == (i + 1) * ALIGN_TO);
+        for (size_t j = 0; j < i; j++)
+        {
+            assert(small_page(objects[i]) != small_page(objects[j]));
+        }
+    }
+    mallinfo_t info = my_mallinfo();
+    assert(info.small_object_bytes == before.small_object_bytes + total);
+    assert(info.small_pages >= NUM_SMALL_CLASSES);
+    assert(info.in_use_bytes == before.in_use_bytes);
+    passed();
+
+    printf("ALLOCATING TWO MORE OF THE SMALLEST SIZE...\n");
+    void *first = my_malloc(1);
+    void *second = my_malloc(ALIGN_TO);
+    printf("VERIFYING THEY SIT NEXT TO EACH OTHER IN THE SAME PAGE...\n");
+    assert(small_page(first) == small_page(objects[0]) && small_page(second) == small_page(first));
+    assert((char *)second == (char *)first + ALIGN_TO);
+    passed();
+
+    printf("FREEING ONE AND ALLOCATING THE SAME SIZE AGAIN...\n");
+    my_free(first);
+    void *again = my_malloc(ALIGN_TO);
+    printf("VERIFYING THE FREED OBJECT WAS REUSED...\n");
+    assert(again == first);
+    passed();
+
+    printf("SHRINKING AND THEN GROWING AN OBJECT WITH REALLOC...\n");
+    memset(objects[3], 0xab, SMALL_OBJECT_LIMIT);
+    assert(my_realloc(objects[3], ALIGN_TO) == objects[3]);
+    void *grown = my_realloc(objects[3], SMALL_OBJECT_LIMIT * 2);
+    printf("VERIFYING IT STAYED PUT TO SHRINK AND MOVED INTO A CHUNK TO GROW...\n");
+    assert(grown && !is_small_object(grown));
+    for (size_t i = 0; i < SMALL_OBJECT_LIMIT; i++)
+    {
+        assert(((unsigned char *)grown)[i] == 0xab);
+    }
+    objects[3] = grown;
+    passed();
+
+    printf("CALLOCING A SMALL OBJECT OVER FREED GARBAGE...\n");
+    memset(objects[1], 0xff, 2 * ALIGN_TO);
+    my_free(objects[1]);
+    objects[1] = my_calloc(1, 2 * ALIGN_TO);
+    printf("VERIFYING IT CAME BACK ZEROED...\n");
+    assert(is_small_object(objects[1]));
+    for (size_t i = 0; i < 2 * ALIGN_TO; i++)
+    {
+        assert(((unsigned char *)objects[1])[i] == 0);
+    }
+    passed();
+
+    printf("TURNING SMALL OBJECTS OFF AND ALLOCATING A SMALL SIZE...\n");
+    small_object_limit = 0;
+    void *chunk = my_malloc(ALIGN_TO);
+    printf("VERIFYING IT GOT A CHUNK WITH A HEADER...\n");
+    assert(!is_small_object(chunk));
+    assert(((header_t *)chunk - 1)->size_flags & CHUNK_IN_USE);
+    small_object_limit = SMALL_OBJECT_LIMIT;
+    passed();
+
+    printf("FREEING EVERYTHING...\n");
+    my_free(chunk);
+    my_free(again);
+    my_free(second);
+    for (size_t i = 0; i < NUM_SMALL_CLASSES; i++)
+    {
+        my_free(objects[i]);
+    }
+    printf("VERIFYING THE SMALL OBJECT BYTES ARE BACK WHERE THEY STARTED...\n");
+    assert(my_mallinfo().small_object_bytes == before.small_object_bytes);
+    audit();
+    free_all_chunks();
+    small_object_limit = prev_small_object_limit;
+    passed();
+
+    success("ALL SMALL OBJECT TESTS PASSED");
+}
+
+#ifdef MF_DEBUG
+size_t num_corruptions;
+heap_corruption_t last_corruption;
+
+void count_corruptions(heap_corruption_t problem, void *ptr)
+{
+    num_corruptions++;
+    last_corruption = problem;
+}
+#endif
+
+void test_hardening()
+{
+    emphasis("TESTING DEBUG HARDENING");
+
+#ifndef MF_DEBUG
+    printf("NOT A DEBUG BUILD, SKIPPING...\n");
+#else
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    heap_corruption_hook_t prev_hook = set_heap_corruption_hook(count_corruptions);
+    num_corruptions = 0;
+    guard_blocks = 1;
+    quarantine_limit = QUARANTINE_LIMIT;
+
+    printf("ALLOCATING A SMALL BLOCK WITH GUARDS ON...\n");
+    chunks[0] = my_malloc(24);
+    header_t *hptr = (header_t *)chunks[0] - 1;
+    printf("VERIFYING IT GOT A CHUNK WITH A CANARY RIGHT AFTER WHAT WAS ASKED FOR...\n");
+    assert(!is_small_object(chunks[0]));
+    assert(hptr->size_flags & CHUNK_GUARDED);
+    assert(my_malloc_usable_size(chunks[0]) == 24);
+    assert((char *)chunk_footer(hptr) == (char *)chunks[0] + 24 && *chunk_footer(hptr) == (CANARY_VALUE ^ 24));
+    passed();
+
+    printf("FILLING IT AND FREEING IT...\n");
+    memset(chunks[0], 1, 24);
+    my_free(chunks[0]);
+    printf("VERIFYING IT WAS POISONED AND QUARANTINED WITHOUT A REPORT...\n");
+    assert(num_corruptions == 0);
+    assert((hptr->size_flags & CHUNK_IN_USE) && (hptr->size_flags & CHUNK_FREED));
+    assert(((unsigned char *)chunks[0])[0] == POISON_BYTE && ((unsigned char *)chunks[0])[23] == POISON_BYTE);
+    passed();
+
+    printf("FREEING IT AGAIN...\n");
+    my_free(chunks[0]);
+    printf("VERIFYING THE DOUBLE FREE WAS REPORTED...\n");
+    assert(num_corruptions == 1 && last_corruption == HEAP_DOUBLE_FREE);
+    passed();
+
+    printf("WRITING ONE BYTE PAST THE END OF A BLOCK AND FREEING IT...\n");
+    chunks[1] = my_malloc(20);
+    ((unsigned char *)chunks[1])[20] = 0;
+    my_free(chunks[1]);
+    printf("VERIFYING THE OVERRUN WAS REPORTED AND THE BLOCK KEPT...\n");
+    assert(num_corruptions == 2 && last_corruption == HEAP_OVERRUN);
+    assert(!(((header_t *)chunks[1] - 1)->size_flags & CHUNK_FREED));
+    ((unsigned char *)chunks[1])[20] = CANARY_BYTE;
+    my_free(chunks[1]);
+    assert(num_corruptions == 2);
+    passed();
+
+    printf("OVERWRITING A HEADER'S MAGIC NUMBER AND FREEING IT...\n");
+    chunks[2] = my_malloc(40);
+    hptr = (header_t *)chunks[2] - 1;
+    hptr->magic = 0;
+    my_free(chunks[2]);
+    printf("VERIFYING THE BAD MAGIC NUMBER WAS REPORTED...\n");
+    assert(num_corruptions == 3 && last_corruption == HEAP_BAD_MAGIC);
+    hptr->magic = MAGIC_NUMBER;
+    my_free(chunks[2]);
+    passed();
+
+    printf("WRITING TO A BLOCK AFTER FREEING IT AND FLUSHING THE QUARANTINE...\n");
+    chunks[3] = my_malloc(40);
+    my_free(chunks[3]);
+    ((unsigned char *)chunks[3])[8] = 1;
+    flush_quarantine();
+    printf("VERIFYING THE WRITE AFTER FREE WAS REPORTED...\n");
+    assert(num_corruptions == 4 && last_corruption == HEAP_WRITE_AFTER_FREE);
+    audit();
+    passed();
+
+    printf("SHRINKING THE QUARANTINE TO 3 CHUNKS AND FREEING 4...\n");
+    free_all_chunks();
+    for (size_t i = 0; i < 4; i++)
+    {
+        chunks[i] = my_malloc(CHUNK_SIZE);
+    }
+    quarantine_limit = 3 * chunk_size((header_t *)chunks[0] - 1);
+    uint64_t frees = my_mallinfo().frees;
+    for (size_t i = 0; i < 3; i++)
+    {
+        my_free(chunks[i]);
+    }
+    assert(my_mallinfo().frees == frees);
+    my_free(chunks[3]);
+    printf("VERIFYING ONLY THE OLDEST WENT BACK TO THE HEAP...\n");
+    assert(my_mallinfo().frees == frees + 1);
+    assert(!(((header_t *)chunks[0] - 1)->size_flags & CHUNK_IN_USE));
+    for (size_t i = 1; i < 4; i++)
+    {
+        assert(((header_t *)chunks[i] - 1)->size_flags & CHUNK_FREED);
+    }
+    audit();
+    quarantine_limit = QUARANTINE_LIMIT;
+    passed();
+
+    printf("GROWING AND SHRINKING A BLOCK WITH REALLOC...\n");
+    chunks[0] = my_malloc(24);
+    memset(chunks[0], 'x', 24);
+    chunks[1] = my_realloc(chunks[0], 48);
+    printf("VERIFYING IT MOVED, KEPT ITS CONTENTS AND GOT A NEW CANARY...\n");
+    assert(chunks[1] != chunks[0] && my_malloc_usable_size(chunks[1]) == 48);
+    for (size_t i = 0; i < 24; i++)
+    {
+        assert(((char *)chunks[1])[i] == 'x');
+    }
+    assert(*chunk_footer((header_t *)chunks[1] - 1) == (CANARY_VALUE ^ 48));
+    chunks[2] = my_realloc(chunks[1], 8);
+    assert(chunks[2] != chunks[1] && my_malloc_usable_size(chunks[2]) == 8 && ((char *)chunks[2])[7] == 'x');
+    my_free(chunks[2]);
+    passed();
+
+    printf("CALLOCING AND ALIGNING GUARDED BLOCKS...\n");
+    chunks[0] = my_calloc(3, 10);
+    chunks[1] = my_aligned_alloc(64, 24);
+    printf("VERIFYING BOTH GOT CANARIES AND FREE CLEANLY...\n");
+    assert(my_malloc_usable_size(chunks[0]) == 30 && ((unsigned char *)chunks[0])[29] == 0);
+    assert(((uintptr_t)chunks[1] & 63) == 0 && my_malloc_usable_size(chunks[1]) == 24);
+    my_free(chunks[0]);
+    my_free(chunks[1]);
+    assert(num_corruptions == 4);
+    passed();
+
+    printf("ALIGNING GUARDED BLOCKS WHOSE CANARY TIPS THEM OVER THE MMAP THRESHOLD...\n");
+    align_around_threshold(64);
+    assert(num_corruptions == 4);
+    passed();
+
+    flush_quarantine();
+    audit();
+    set_heap_corruption_hook(prev_hook);
+    guard_blocks = 0;
+    quarantine_limit = 0;
+    free_all_chunks();
+#endif
+
+    success("ALL DEBUG HARDENING TESTS PASSED");
+}
+
+void test_incremental_audit()
+{
+    emphasis("TESTING THE INCREMENTAL AUDIT");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    audit_cursor_t cursor = {0};
+
+    printf("ALLOCATING 6 CHUNKS AND FREEING EVERY OTHER ONE...\n");
+    for (size_t i = 0; i < 6; i++)
+    {
+        chunks[i] = my_malloc(CHUNK_SIZE);
+    }
+    for (size_t i = 0; i < 6; i += 2)
+    {
+        my_free(chunks[i]);
+    }
+    size_t num_chunks = 0;
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        for (size_t i = 0; i < arenas[a].num_regions; i++)
+        {
+            header_t *chunk = first_chunk(&arenas[a].regions[i]);
+            for (; chunk_size(chunk); chunk = next_chunk(chunk))
+            {
+                num_chunks++;
+            }
+            // The fencepost gets checked too
+            num_chunks++;
+        }
+    }
+    printf("CHECKING THE HEAP 2 CHUNKS AT A TIME...\n");
+    size_t calls = 0;
+    size_t checked = 0;
+    audit_result_t result;
+    do
+    {
+        result = audit_step(&cursor, 2, 0);
+        assert(result.chunks_checked <= 2);
+        checked += result.chunks_checked;
+        calls++;
+    } while (result.status == AUDIT_IN_PROGRESS);
+    printf("VERIFYING IT TOOK SEVERAL CALLS, CHECKED EVERY CHUNK ONCE AND FOUND NOTHING WRONG...\n");
+    assert(result.status == AUDIT_OK && calls > 1 && cursor.passes == 1);
+    assert(checked == num_chunks);
+    passed();
+
+    printf("CHECKING THE WHOLE HEAP IN ONE CALL WITH A SECOND TO DO IT...\n");
+    result = audit_step(&cursor, 0, 1000000);
+    printf("VERIFYING IT FINISHED ANOTHER PASS...\n");
+    assert(result.status == AUDIT_OK && result.chunks_checked == num_chunks && cursor.passes == 2);
+    passed();
+
+    printf("PAUSING PARTWAY, MERGING THE CHUNK IT STOPPED AT AND CARRYING ON...\n");
+    result = audit_step(&cursor, 2, 0);
+    assert(result.status == AUDIT_IN_PROGRESS && cursor.chunk == (header_t *)chunks[2] - 1);
+    my_free(chunks[1]);
+    printf("VERIFYING IT STILL FINISHES WITHOUT FINDING ANYTHING WRONG...\n");
+    assert(finish_audit(&cursor).status == AUDIT_OK);
+    passed();
+
+    printf("CORRUPTING A FREE CHUNK'S FOOTER...\n");
+    header_t *free_chunk = (header_t *)first_free_chunk();
+    *chunk_footer(free_chunk) += ALIGN_TO;
+    result = finish_audit(&cursor);
+    printf("VERIFYING IT WAS REPORTED AT THAT CHUNK INSTEAD OF ASSERTING...\n");
+    printf("%s\n", audit_status_string(result.status));
+    assert(result.status == AUDIT_BAD_FOOTER && result.arena == 0 && result.chunk == free_chunk);
+    *chunk_footer(free_chunk) -= ALIGN_TO;
+    passed();
+
+    printf("MARKING THE CHUNK AFTER IT AS FOLLOWING AN ALLOCATED ONE...\n");
+    header_t *hptr = (header_t *)chunks[3] - 1;
+    hptr->size_flags |= PREV_IN_USE;
+    cursor = (audit_cursor_t){0};
+    result = finish_audit(&cursor);
+    printf("VERIFYING THE PREV IN USE BIT WAS REPORTED...\n");
+    assert(result.status == AUDIT_BAD_PREV_IN_USE && result.chunk == hptr);
+    hptr->size_flags &= ~PREV_IN_USE;
+    passed();
+
+    printf("POINTING A FREE CHUNK'S LINK OUTSIDE THE HEAP...\n");
+    node_t *next = ((node_t *)free_chunk)->next;
+    ((node_t *)free_chunk)->next = (node_t *)&cursor;
+    cursor = (audit_cursor_t){0};
+    result = finish_audit(&cursor);
+    printf("VERIFYING THE BROKEN FREE LIST WAS REPORTED...\n");
+    assert(result.status == AUDIT_BAD_FREE_LIST && result.chunk == free_chunk);
+    ((node_t *)free_chunk)->next = next;
+    cursor = (audit_cursor_t){0};
+    assert(finish_audit(&cursor).status == AUDIT_OK);
+    free_all_chunks();
+    passed();
+
+    printf("ALLOCATING 8 CHUNKS, PAUSING PARTWAY AND FREEING THE ONE BEFORE WHERE IT STOPPED...\n");
+    for (size_t i = 0; i < 8; i++)
+    {
+        chunks[i] = my_malloc(CHUNK_SIZE);
+    }
+    cursor = (audit_cursor_t){0};
+    result = audit_step(&cursor, 2, 0);
+    assert(result.status == AUDIT_IN_PROGRESS && cursor.chunk == (header_t *)chunks[2] - 1);
+    my_free(chunks[1]);
+    printf("VERIFYING NOTHING MERGED AND IT STILL FINISHES WITHOUT FINDING ANYTHING WRONG...\n");
+    assert(arenas[0].layout_changes == cursor.layout_changes);
+    assert(finish_audit(&cursor).status == AUDIT_OK);
+    free_all_chunks();
+    passed();
+
+    success("ALL INCREMENTAL AUDIT TESTS PASSED");
+}
+
+void test_heap_report()
+{
+    emphasis("TESTING THE FRAGMENTATION REPORT");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    heap_report_t *report = my_malloc(sizeof(heap_report_t));
+    heap_report_t *before = my_malloc(sizeof(heap_report_t));
+
+    printf("ALLOCATING 4 CHUNKS AND FREEING THE FIRST AND THIRD...\n");
+    my_heap_report(before);
+    for (size_t i = 0; i < 4; i++)
+    {
+        chunks[i] = my_malloc(CHUNK_SIZE);
+    }
+    my_free(chunks[0]);
+    my_free(chunks[2]);
+    my_heap_report(report);
+    printf("VERIFYING THE HISTOGRAMS AND TOTALS MATCH THE HEAP...\n");
+    size_t bucket = report_bucket(chunk_size((header_t *)chunks[1] - 1));
+    assert(report->allocated_chunks[bucket].chunks == before->allocated_chunks[bucket].chunks + 2);
+    assert(report->free_chunks[bucket].chunks >= 2);
+    size_t free_chunks = 0;
+    size_t free_bytes = 0;
+    for (size_t i = 0; i < REPORT_BUCKETS; i++)
+    {
+        free_chunks += report->free_chunks[i].chunks;
+        free_bytes += report->free_chunks[i].bytes;
+    }
+    mallinfo_t info = my_mallinfo();
+    assert(free_chunks == info.free_chunks && free_bytes == info.free_bytes);
+    assert(report->free_bytes == info.free_bytes && report->largest_free == info.largest_free);
+    assert(report->external_fragmentation == 1 - (double)info.largest_free / info.free_bytes);
+    passed();
+
+    printf("ALLOCATING A 17 BYTE SMALL OBJECT...\n");
+    my_heap_report(before);
+    chunks[4] = my_malloc(17);
+    my_heap_report(report);
+    printf("VERIFYING IT COUNTS AS 17 BYTES ASKED FOR AND 32 HANDED OUT IN THE 32 BYTE CLASS...\n");
+    assert(is_small_object(chunks[4]));
+    assert(report->requested_bytes == before->requested_bytes + 17);
+    assert(report->granted_bytes == before->granted_bytes + 32);
+    assert(report->small_objects[1] == before->small_objects[1] + 1 && report->small_capacity[1] >= report->small_objects[1]);
+    assert(report->internal_fragmentation > 0 && report->internal_fragmentation < 1);
+    my_free(chunks[4]);
+    passed();
+
+    printf("LIMITING THE ADDRESS SPACE AND ASKING FOR MORE THAN FITS IN IT...\n");
+    struct rlimit prev_limit;
+    getrlimit(RLIMIT_AS, &prev_limit);
+    struct rlimit limit = {MAX_REQUEST_SIZE, prev_limit.rlim_max};
+    setrlimit(RLIMIT_AS, &limit);
+    size_t prev_threshold = mmap_threshold;
+    mmap_threshold = SIZE_MAX;
+    chunks[4] = my_malloc(MAX_REQUEST_SIZE);
+    mmap_threshold = prev_threshold;
+    setrlimit(RLIMIT_AS, &prev_limit);
+    my_heap_report(report);
+    printf("VERIFYING THE FAILURE WAS RECORDED WITH THE SHAPE OF THE FREE CHUNKS...\n");
+    assert(chunks[4] == NULL && heap_last_error() == HEAP_OUT_OF_MEMORY);
+    assert(report->failures == before->failures + 1 && report->num_snapshots >= 1);
+    failure_snapshot_t *snapshot = &report->snapshots[report->num_snapshots - 1];
+    assert(snapshot->needed_size == align(MAX_REQUEST_SIZE) && snapshot->arena == 0);
+    assert(snapshot->regions == arenas[0].num_regions && snapshot->free_bytes == arenas[0].free_bytes);
+    free_bytes = 0;
+    for (size_t i = 0; i < REPORT_BUCKETS; i++)
+    {
+        free_bytes += snapshot->free_chunks[i].bytes;
+    }
+    assert(free_bytes == snapshot->free_bytes);
+    print_heap_report();
+    passed();
+
+    printf("SETTING THE HEAP UP AGAIN...\n");
+    my_free(report);
+    my_free(before);
+    free_all_chunks();
+    init_heap();
+    printf("VERIFYING THE TOTALS AND THE FAILURES START OVER...\n");
+    for (size_t a = 0; a < num_arenas; a++)
+    {
+        assert(!arenas[a].requested_bytes && !arenas[a].granted_bytes && !arenas[a].layout_changes);
+    }
+    assert(my_mallinfo().failures == 0);
+    report = my_malloc(sizeof(heap_report_t));
+    my_heap_report(report);
+    assert(report->failures == 0 && report->num_snapshots == 0);
+    my_free(report);
+    free_all_chunks();
+    passed();
+
+    success("ALL FRAGMENTATION REPORT TESTS PASSED");
+}
+
+/* Writes the profile to a temporary file and reads it back into buffer. Returns how many lines it has. */
+static size_t read_profile(profile_format_t format, char *buffer, size_t size)
+{
+    char path[] = "/tmp/profile_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    assert(profile_write(fd, format) == 0);
+    lseek(fd, 0, SEEK_SET);
+    ssize_t length = read(fd, buffer, size - 1);
+    close(fd);
+    assert(length >= 0 && (size_t)length < size - 1);
+    buffer[length] = '\0';
+
+    size_t lines = 0;
+    for (char *c = buffer; *c; c++)
+    {
+        lines += *c == '\n';
+    }
+    return lines;
+}
+
+void test_profiler()
+{
+    emphasis("TESTING THE ALLOCATION PROFILER");
+
+    free_all_chunks();
+    void *chunks[MAX_CHUNKS];
+    static char profile[1 << 16];
+
+    printf("SAMPLING ABOUT EVERY BYTE AND ALLOCATING 10 100 BYTE BLOCKS AND A 24 BYTE ONE...\n");
+    assert(profile_start(1) == 0);
+    for (size_t i = 0; i < 10; i++)
+    {
+        chunks[i] = my_malloc(100);
+    }
+    chunks[10] = my_malloc(24);
+    profile_info_t info = profile_info();
+    printf("VERIFYING EVERY ONE WAS SAMPLED FROM 2 CALL SITES AND GOT A FLAGGED HEADER...\n");
+    assert(info.running && info.interval == 1 && !info.dropped);
+    assert(info.samples == 11 && info.sampled_bytes == 1024 && info.sites == 2);
+    assert(info.live_samples == 11 && info.live_bytes == 1024);
+    assert(!is_small_object(chunks[10]));
+    for (size_t i = 0; i <= 10; i++)
+    {
+        assert(((header_t *)chunks[i] - 1)->size_flags & CHUNK_SAMPLED);
+    }
+    passed();
+
+    printf("FREEING 5 OF THEM, REALLOCATING ONE AND CALLOCATING ANOTHER...\n");
+    for (size_t i = 0; i < 5; i++)
+    {
+        my_free(chunks[i]);
+    }
+    chunks[5] = my_realloc(chunks[5], 4000);
+    chunks[11] = my_calloc(4, 8);
+    info = profile_info();
+    printf("VERIFYING ONLY THE BLOCKS STILL HELD COUNT AS LIVE...\n");
+    assert(info.live_samples == 7);
+    assert(((header_t *)chunks[5] - 1)->size_flags & CHUNK_SAMPLED);
+    assert(((header_t *)chunks[11] - 1)->size_flags & CHUNK_SAMPLED);
+    for (size_t i = 0; i < 32; i++)
+    {
+        assert(!((char *)chunks[11])[i]);
+    }
+    passed();
+
+    printf("WRITING THE PROFILE AS FOLDED STACKS AND FOR PPROF...\n");
+    size_t lines = read_profile(PROFILE_FOLDED, profile, sizeof(profile));
+    assert(lines == info.sites);
+    lines = read_profile(PROFILE_PPROF, profile, sizeof(profile));
+    assert(!strncmp(profile, "heap profile: ", 14) && strstr(profile, "@ heap_v2/1\n"));
+    assert(strstr(profile, "\nMAPPED_LIBRARIES:\n") && lines > info.sites + 2);
+    passed();
+
+    printf("STOPPING THE PROFILER AND FREEING EVERYTHING...\n");
+    profile_stop();
+    for (size_t i = 0; i < 10; i++)
+    {
+        chunks[12 + i] = my_malloc(100);
+        my_free(chunks[12 + i]);
+    }
+    for (size_t i = 5; i <= 11; i++)
+    {
+        my_free(chunks[i]);
+    }
+    printf("VERIFYING NOTHING NEW WAS SAMPLED AND NOTHING IS LIVE...\n");
+    profile_info_t after = profile_info();
+    assert(!after.running && after.samples == info.samples && !after.live_samples && !after.live_bytes);
+    passed();
+
+    printf("SAMPLING EVERY 4096 BYTES ON AVERAGE OVER 64000 64 BYTE ALLOCATIONS...\n");
+    assert(profile_start(4096) == 0);
+    for (size_t i = 0; i < 64000; i++)
+    {
+        my_free(my_malloc(64));
+    }
+    profile_stop();
+    info = profile_info();
+    printf("%" PRIu64 " SAMPLES, ABOUT 992 EXPECTED\n", info.samples);
+    assert(info.samples > 800 && info.samples < 1200 && !info.live_samples);
+    read_profile(PROFILE_FOLDED, profile, sizeof(profile));
+    uint64_t estimate = strtoull(strrchr(profile, ' ') + 1, NULL, 10);
+    printf("VERIFYING THE PROFILE ESTIMATES CLOSE TO THE %d BYTES ALLOCATED: %" PRIu64 "\n", 64000 * 64, estimate);
+    assert(estimate > 64000 * 64 * 0.8 && estimate < 64000 * 64 * 1.2);
+    passed();
+
+    free_all_chunks();
+
+    success("ALL ALLOCATION PROFILER TESTS PASSED");
+}
+
+void test_all()
+{
+    emphasis("RUNNING ALL TESTS");
+    test_free_chunk_reuse();
+    test_boundary_tags();
+    test_splitting_free_chunks();
+    test_coalesce();
+    test_deferred_coalescing();
+    test_alternating_sequence();
+    test_worst_fit();
+    test_best_fit();
+    test_first_fit();
+    test_next_fit();
+    test_good_fit();
+    test_segregated_fit();
+    test_free_tree();
+    test_malloc_bad_size();
+    test_heap_growth();
+    test_realloc();
+    test_calloc();
+    test_aligned_alloc();
+    test_trace();
+    test_slab();
+    test_bump_arena();
+    test_mmap();
+    test_trim();
+    test_huge_pages();
+    test_mallinfo();
+    test_small_objects();
+    test_hardening();
+    test_incremental_audit();
+    test_heap_report();
+    test_profiler();
+    test_arenas();
+    test_threads();
+    success("ALL TESTS PASSED");
+}
+
+#pragma endregion Tests
+
+/* Sets standard chunk size for tests. */
+void init_tests()
+{
+    MAX_CHUNKS = 10;
+    CHUNK_SIZE = SIZE_OF_HEAP / 20;
+
+    // The tests look at the shared heap directly, so frees can't be held back in a thread cache
+    tcache_limit = 0;
+#ifdef MF_DEBUG
+    // Nor can they have canaries making chunks bigger than asked for, or frees waiting in quarantine
+    guard_blocks = 0;
+    quarantine_limit = 0;
+#endif
 
     printf("Tests using standard chunk size of %zu\n", CHUNK_SIZE);
     printf("This translate to a total aligned size of %zu\n", align(CHUNK_SIZE));
@@ -5,15 +5,40 @@ void init_tests();
 void free_all_chunks();
 
 void test_free_chunk_reuse();
-void test_sorted_free_list();
+void test_boundary_tags();
 void test_splitting_free_chunks();
 void test_coalesce();
+void test_deferred_coalescing();
 void test_alternating_sequence();
 void test_worst_fit();
+void test_best_fit();
+void test_first_fit();
+void test_next_fit();
+void test_good_fit();
+void test_segregated_fit();
+void test_free_tree();
 void test_malloc_bad_size();
+void test_heap_growth();
+void test_realloc();
+void test_calloc();
+void test_aligned_alloc();
+void test_trace();
+void test_slab();
+void test_bump_arena();
+void test_mmap();
+void test_trim();
+void test_huge_pages();
+void test_mallinfo();
+void test_small_objects();
+void test_hardening();
+void test_incremental_audit();
+void test_heap_report();
+void test_profiler();
+void test_arenas();
+void test_threads();
 void test_all();
 
-size_t MAX_CHUNKS;
-size_t CHUNK_SIZE;
+extern size_t MAX_CHUNKS;
+extern size_t CHUNK_SIZE;
 
 #endif
\ No newline at end of file